@@ -0,0 +1,78 @@
+/* Stand-in for the parts of VirtualBox's VBox/vd.h that vdfuse uses, so that   *
+ * the benchmark can be built without the VirtualBox sources.  The functions   *
+ * are implemented by vdstub.c.                                                 */
+
+#ifndef VDSTUB_VD_H
+#define VDSTUB_VD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+
+#define RT_SUCCESS(rc) ((int) (rc) >= 0)
+#define RT_FAILURE(rc) ((int) (rc) < 0)
+#define VINF_SUCCESS 0
+#define VERR_GENERAL_FAILURE (-1)
+#define VERR_NO_MEMORY (-8)
+#define VERR_FILE_NOT_FOUND (-102)
+#define VERR_EOF (-110)
+#define VERR_NOT_SUPPORTED (-37)
+
+#define VD_OPEN_FLAGS_NORMAL 0
+#define VD_OPEN_FLAGS_READONLY 1
+#define VD_OPEN_FLAGS_DISCARD 0x80
+#define VD_LAST_IMAGE 0xffffffffU
+
+typedef struct VBOXHDD *PVBOXHDD;
+
+typedef struct RTRANGE
+{
+	uint64_t offStart;
+	size_t cbRange;
+} RTRANGE, *PRTRANGE;
+typedef const RTRANGE *PCRTRANGE;
+
+typedef enum
+{
+	VDINTERFACETYPE_ERROR = 1
+} VDINTERFACETYPE;
+
+typedef enum
+{
+	VDTYPE_INVALID = 0,
+	VDTYPE_HDD
+} VDTYPE;
+
+typedef struct VDINTERFACE
+{
+	const char *pszInterfaceName;
+	struct VDINTERFACE *pNext;
+	VDINTERFACETYPE enmInterface;
+	size_t cbSize;
+	void *pvUser;
+} VDINTERFACE, *PVDINTERFACE;
+
+typedef struct VDINTERFACEERROR
+{
+	VDINTERFACE Core;
+	void (*pfnError) (void *pvUser, int rc, const char *file, unsigned iLine,
+										const char *function, const char *format, va_list va);
+	int (*pfnMessage) (void *pvUser, const char *pszFormat, va_list va);
+} VDINTERFACEERROR;
+
+int VDInterfaceAdd (PVDINTERFACE pInterface, const char *pszName,
+										VDINTERFACETYPE enmInterface, void *pvUser,
+										size_t cbInterface, PVDINTERFACE * ppVDIfs);
+int VDCreate (PVDINTERFACE pVDIfsDisk, VDTYPE enmType, PVBOXHDD * ppDisk);
+int VDOpen (PVBOXHDD pDisk, const char *pszBackend, const char *pszFilename,
+						unsigned uOpenFlags, PVDINTERFACE pVDIfsImage);
+int VDRead (PVBOXHDD pDisk, uint64_t uOffset, void *pvBuf, size_t cbRead);
+int VDWrite (PVBOXHDD pDisk, uint64_t uOffset, const void *pvBuf,
+						 size_t cbWrite);
+int VDDiscardRanges (PVBOXHDD pDisk, PCRTRANGE paRanges, unsigned cRanges);
+int VDFlush (PVBOXHDD pDisk);
+uint64_t VDGetSize (PVBOXHDD pDisk, unsigned nImage);
+int VDCloseAll (PVBOXHDD pDisk);
+int VDDestroy (PVBOXHDD pDisk);
+
+#endif
@@ -0,0 +1,763 @@
+/* vdbench.c - benchmark for the vdfuse I/O paths                              *
+ *                                                                              *
+ * vdfuse.c is compiled into this program with its libfuse calls answered here. *
+ * Instead of serving a kernel mount, the session loop runs the workloads by    *
+ * calling the low-level callbacks directly from 1 to 64 threads, and VBox/vd.h  *
+ * resolves to the stub in this directory (vdstub.c).  No VirtualBox install,   *
+ * image or FUSE mount is needed, so the numbers only depend on vdfuse: its     *
+ * locking, the block cache, readahead and write back.                          *
+ *                                                                              *
+ * The image is a raw disk synthesised at startup with an MBR, one primary and  *
+ * optionally logical partitions in an EBR chain, which vdfuse parses as usual. *
+ * Everything after -- is passed to vdfuse, e.g. -- --cache-size=1G -n 4 -r.    */
+
+#define NO_ZLIB									// --export is not benchmarked
+#define main vdfuseMain
+#include "../vdfuse.c"
+#undef main
+
+#define BENCH_HIST_SUB 16				// sub-buckets per power of two, about 6% resolution
+#define BENCH_HIST_BUCKETS (64 * BENCH_HIST_SUB)
+#define BENCH_THREADS_MAX 64
+#define BENCH_SECTOR 512
+
+// What a reply to a request looks like to the workload
+
+struct fuse_req
+{
+	int err;
+	char *buf;										// where read data is copied to
+	size_t size;									// bytes read or written
+	struct fuse_entry_param entry;
+	struct fuse_file_info fi;
+};
+
+typedef struct
+{
+	const char *name;
+	int sequential;
+	int readPercent;
+} BenchWorkload;
+
+typedef struct
+{
+	pthread_t tid;
+	int id;
+	int threads;
+	fuse_ino_t ino;
+	uint64_t size;								// of the partition
+	const BenchWorkload *workload;
+	uint64_t ops;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t hist[BENCH_HIST_BUCKETS];
+} BenchWorker;
+
+static BenchWorkload benchWorkloads[] = {
+	{"seqread", 1, 100},
+	{"randread", 0, 100},
+	{"seqwrite", 1, 0},
+	{"randwrite", 0, 0},
+	{"randrw", 0, 70},
+	{NULL, 0, 0}
+};
+
+extern int vdStubMemory;
+extern unsigned vdStubLatency;
+
+static struct fuse_lowlevel_ops benchOps;
+static char *benchWorkloadList = "seqread,randread,seqwrite,randwrite,randrw";
+static char *benchThreadList = "1,4,16,64";
+static char *benchPartition = "Partition1";
+static size_t benchBlock = 64 * 1024;
+static int benchSeconds = 3;
+static volatile int benchStop = 0;
+static pthread_barrier_t benchBarrier;
+
+//====================================================================================================
+//                                         libfuse replacement
+//====================================================================================================
+
+int
+fuse_opt_add_arg (struct fuse_args *args, const char *arg)
+{
+	char **argv = realloc (args->allocated ? args->argv : NULL,
+												 (args->argc + 2) * sizeof (char *));
+
+	if (!argv)
+		return -1;
+	if (!args->allocated && args->argc)
+		memcpy (argv, args->argv, args->argc * sizeof (char *));
+	argv[args->argc++] = strdup (arg);
+	argv[args->argc] = NULL;
+	args->argv = argv;
+	args->allocated = 1;
+	return 0;
+}
+
+void
+fuse_opt_free_args (struct fuse_args *args)
+{
+	int i;
+
+	if (args->allocated)
+	{
+		for (i = 0; i < args->argc; i++)
+			free (args->argv[i]);
+		free (args->argv);
+	}
+	args->argc = 0;
+	args->argv = NULL;
+	args->allocated = 0;
+}
+
+int
+fuse_parse_cmdline (struct fuse_args *args, char **mountpoint,
+										int *multithreaded, int *foreground)
+{
+	*mountpoint = args->argv[args->argc - 1];
+	*multithreaded = 1;
+	*foreground = 1;
+	return 0;
+}
+
+struct fuse_chan *
+fuse_mount (const char *mountpoint UNUSED, struct fuse_args *args UNUSED)
+{
+	return (struct fuse_chan *) &benchOps;	// never dereferenced
+}
+
+void
+fuse_unmount (const char *mountpoint UNUSED, struct fuse_chan *ch UNUSED)
+{
+}
+
+int
+fuse_daemonize (int foreground UNUSED)
+{
+	return 0;
+}
+
+struct fuse_session *
+fuse_lowlevel_new (struct fuse_args *args UNUSED,
+									 const struct fuse_lowlevel_ops *op, size_t op_size,
+									 void *userdata UNUSED)
+{
+	memcpy (&benchOps, op, op_size);
+	return (struct fuse_session *) &benchOps;
+}
+
+int
+fuse_set_signal_handlers (struct fuse_session *se UNUSED)
+{
+	return 0;
+}
+
+void
+fuse_remove_signal_handlers (struct fuse_session *se UNUSED)
+{
+}
+
+void
+fuse_session_add_chan (struct fuse_session *se UNUSED, struct fuse_chan *ch UNUSED)
+{
+}
+
+void
+fuse_session_remove_chan (struct fuse_chan *ch UNUSED)
+{
+}
+
+void
+fuse_session_destroy (struct fuse_session *se UNUSED)
+{
+}
+
+size_t
+fuse_buf_size (const struct fuse_bufvec *bufv)
+{
+	size_t i, size = 0;
+
+	for (i = bufv->idx; i < bufv->count; i++)
+		size += bufv->buf[i].size;
+	return size - bufv->off;
+}
+
+/**
+ * Copy memory and fd buffers into a single memory buffer, which is all vdfuse
+ * and fuse_reply_data need
+ */
+ssize_t
+fuse_buf_copy (struct fuse_bufvec *dst, struct fuse_bufvec *src,
+							 enum fuse_buf_copy_flags flags UNUSED)
+{
+	char *out = dst->buf[dst->idx].mem;
+	size_t room = dst->buf[dst->idx].size, copied = 0, i;
+
+	for (i = src->idx; i < src->count && copied < room; i++)
+	{
+		struct fuse_buf *b = src->buf + i;
+		size_t skip = (i == src->idx) ? src->off : 0;
+		size_t n = b->size - skip;
+
+		if (n > room - copied)
+			n = room - copied;
+		if (!(b->flags & FUSE_BUF_IS_FD))
+			memcpy (out + copied, (char *) b->mem + skip, n);
+		else if (pread (b->fd, out + copied, n, b->pos + skip) != (ssize_t) n)
+			return -EIO;
+		copied += n;
+	}
+	return copied;
+}
+
+int
+fuse_reply_err (fuse_req_t req, int err)
+{
+	req->err = err;
+	return 0;
+}
+
+int
+fuse_reply_entry (fuse_req_t req, const struct fuse_entry_param *e)
+{
+	req->err = 0;
+	req->entry = *e;
+	return 0;
+}
+
+int
+fuse_reply_attr (fuse_req_t req, const struct stat *attr, double attr_timeout UNUSED)
+{
+	req->err = 0;
+	req->entry.attr = *attr;
+	return 0;
+}
+
+int
+fuse_reply_open (fuse_req_t req, const struct fuse_file_info *fi)
+{
+	req->err = 0;
+	req->fi = *fi;
+	return 0;
+}
+
+int
+fuse_reply_write (fuse_req_t req, size_t count)
+{
+	req->err = 0;
+	req->size = count;
+	return 0;
+}
+
+int
+fuse_reply_buf (fuse_req_t req, const char *buf, size_t size)
+{
+	req->err = 0;
+	req->size = size;
+	if (size)
+		memcpy (req->buf, buf, size);
+	return 0;
+}
+
+int
+fuse_reply_data (fuse_req_t req, struct fuse_bufvec *bufv,
+								 enum fuse_buf_copy_flags flags)
+{
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT (fuse_buf_size (bufv));
+	ssize_t n;
+
+	dst.buf[0].mem = req->buf;
+	if ((n = fuse_buf_copy (&dst, bufv, flags)) < 0)
+		return fuse_reply_err (req, -n);
+	req->err = 0;
+	req->size = n;
+	return 0;
+}
+
+size_t
+fuse_add_direntry (fuse_req_t req UNUSED, char *buf, size_t bufsize,
+									 const char *name, const struct stat *stbuf UNUSED,
+									 off_t off UNUSED)
+{
+	size_t size = strlen (name) + 1;
+
+	if (buf && bufsize >= size)
+		memcpy (buf, name, size);
+	return size;
+}
+
+const struct fuse_ctx *
+fuse_req_ctx (fuse_req_t req UNUSED)
+{
+	static struct fuse_ctx ctx;
+
+	ctx.uid = geteuid ();
+	ctx.gid = getegid ();
+	return &ctx;
+}
+
+//====================================================================================================
+//                                           Image synthesis
+//====================================================================================================
+
+/**
+ * Put a partition entry and the boot signature into a descriptor sector
+ * @param sector 512 byte MBR or EBR
+ * @param n Entry 0..3
+ * @param type Partition type
+ * @param start First sector, relative as the MBR or EBR requires
+ * @param count Number of sectors
+ */
+static void
+benchEntry (unsigned char *sector, int n, uint8_t type, uint32_t start,
+						uint32_t count)
+{
+	MBRentry *e = (MBRentry *) (sector + MBR_START) + n;
+
+	memset (e, 0, sizeof (MBRentry));
+	e->type = type;
+	e->offset = start;
+	e->size = count;
+	sector[510] = 0x55;
+	sector[511] = 0xaa;
+}
+
+/**
+ * Create a sparse raw image with Partition1 and partitions - 1 logical
+ * partitions (Partition5 ...) in an extended partition, all of the same size
+ * @param fd Image file
+ * @param size Image size in bytes
+ * @param partitions Number of partitions
+ */
+static void
+benchLayout (int fd, uint64_t size, int partitions)
+{
+	unsigned char sector[BENCH_SECTOR];
+	uint64_t sectors = size / BENCH_SECTOR;
+	uint32_t first = 2048, slot, ext = 0, i;
+
+	if (ftruncate (fd, size) < 0)
+		usageAndExit ("cannot size the benchmark image");
+	if (sectors > 0xffffffffULL || sectors < (uint64_t) (partitions + 1) * 4096)
+		usageAndExit ("image size does not fit %d partitions", partitions);
+	slot = (sectors - first) / partitions;
+
+	memset (sector, 0, sizeof (sector));
+	benchEntry (sector, 0, 0x83, first, slot);
+	if (partitions > 1)
+	{
+		ext = first + slot;
+		benchEntry (sector, 1, 0x05, ext, sectors - ext);
+	}
+	if (pwrite (fd, sector, BENCH_SECTOR, 0) != BENCH_SECTOR)
+		usageAndExit ("cannot write the MBR");
+
+// Each logical partition slot starts with its EBR, the partition follows 2048
+// sectors later.  The link to the next EBR is relative to the extended partition.
+
+	for (i = 1; i < (uint32_t) partitions; i++)
+	{
+		memset (sector, 0, sizeof (sector));
+		benchEntry (sector, 0, 0x83, 2048, slot - 2048);
+		if (i + 1 < (uint32_t) partitions)
+			benchEntry (sector, 1, 0x05, i * slot, slot);
+		if (pwrite (fd, sector, BENCH_SECTOR,
+								(uint64_t) (ext + (i - 1) * slot) * BENCH_SECTOR) != BENCH_SECTOR)
+			usageAndExit ("cannot write an EBR");
+	}
+}
+
+//====================================================================================================
+//                                               Workloads
+//====================================================================================================
+
+/**
+ * Histogram bucket of a latency: the power of two and the next four bits
+ */
+static int
+benchBucket (uint64_t ns)
+{
+	int e;
+
+	if (ns < BENCH_HIST_SUB)
+		return ns;
+	e = 63 - __builtin_clzll (ns);
+	return (e - 3) * BENCH_HIST_SUB + ((ns >> (e - 4)) & (BENCH_HIST_SUB - 1));
+}
+
+/**
+ * Upper bound of a histogram bucket
+ * @return nanoseconds
+ */
+static uint64_t
+benchBucketValue (int b)
+{
+	int e = b / BENCH_HIST_SUB + 3;
+
+	if (b < BENCH_HIST_SUB)
+		return b;
+	return ((uint64_t) (BENCH_HIST_SUB + b % BENCH_HIST_SUB + 1) << (e - 4)) - 1;
+}
+
+/**
+ * @return latency at a percentile of the merged histogram, in nanoseconds
+ */
+static uint64_t
+benchPercentile (const uint64_t * hist, uint64_t count, int percent)
+{
+	uint64_t rank = (count * percent + 99) / 100, seen = 0;
+	int b;
+
+	for (b = 0; b < BENCH_HIST_BUCKETS - 1; b++)
+		if ((seen += hist[b]) >= rank)
+			break;
+	return benchBucketValue (b);
+}
+
+/**
+ * One workload thread: open the partition, then read or write benchBlock
+ * sized pieces until told to stop.  Sequential workers each stream through
+ * their own slice of the partition, random ones pick aligned blocks anywhere.
+ */
+static void *
+benchWorker (void *arg)
+{
+	BenchWorker *w = arg;
+	struct fuse_req req;
+	struct fuse_file_info fi;
+	struct fuse_bufvec bufv = FUSE_BUFVEC_INIT (benchBlock);
+	uint64_t blocks = w->size / benchBlock;
+	uint64_t slice = blocks / w->threads, next = slice * w->id;
+	uint64_t seed = 0x9e3779b97f4a7c15ULL * (w->id + 1);
+	char *buf = malloc (benchBlock);
+
+	if (!buf)
+		usageAndExit ("out of memory");
+	memset (buf, w->id, benchBlock);
+	bufv.buf[0].mem = buf;
+	memset (&req, 0, sizeof (req));
+	req.buf = buf;
+	memset (&fi, 0, sizeof (fi));
+	fi.flags = readonly ? O_RDONLY : O_RDWR;
+	benchOps.open (&req, w->ino, &fi);
+	if (req.err)
+		usageAndExit ("cannot open %s: %s", benchPartition, strerror (req.err));
+	fi = req.fi;
+
+	pthread_barrier_wait (&benchBarrier);
+	while (!benchStop)
+	{
+		uint64_t block, start;
+		int isRead;
+
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		if (w->workload->sequential)
+		{
+			block = next++;
+			if (next == slice * (w->id + 1))
+				next = slice * w->id;
+		}
+		else
+			block = seed % blocks;
+		isRead = (int) ((seed >> 32) % 100) < w->workload->readPercent;
+
+		req.err = 0;
+		req.size = 0;
+		start = traceClock ();
+		if (isRead)
+			benchOps.read (&req, w->ino, benchBlock, block * benchBlock, &fi);
+		else
+		{
+			bufv.idx = 0;
+			bufv.off = 0;
+			benchOps.write_buf (&req, w->ino, &bufv, block * benchBlock, &fi);
+		}
+		w->hist[benchBucket (traceClock () - start)]++;
+		if (req.err || req.size != benchBlock)
+			w->errors++;
+		w->ops++;
+		w->bytes += req.size;
+	}
+
+	benchOps.flush (&req, w->ino, &fi);
+	benchOps.release (&req, w->ino, &fi);
+	free (buf);
+	return NULL;
+}
+
+/**
+ * Run a workload with a number of threads for benchSeconds and print a line
+ * of results
+ * @param workload What to run
+ * @param threads Number of threads
+ * @param ino Inode of the partition under test
+ * @param size Size of the partition
+ */
+static void
+benchRun (const BenchWorkload * workload, int threads, fuse_ino_t ino,
+					uint64_t size)
+{
+	BenchWorker *workers = calloc (threads, sizeof (BenchWorker));
+	uint64_t *hist = calloc (BENCH_HIST_BUCKETS, sizeof (uint64_t));
+	uint64_t ops = 0, bytes = 0, errors = 0, start, elapsed;
+	double seconds;
+	int i, b;
+
+	if (!workers || !hist)
+		usageAndExit ("out of memory");
+	pthread_barrier_init (&benchBarrier, NULL, threads + 1);
+	benchStop = 0;
+	for (i = 0; i < threads; i++)
+	{
+		workers[i].id = i;
+		workers[i].threads = threads;
+		workers[i].ino = ino;
+		workers[i].size = size;
+		workers[i].workload = workload;
+		if (pthread_create (&workers[i].tid, NULL, benchWorker, workers + i))
+			usageAndExit ("cannot start worker threads");
+	}
+	pthread_barrier_wait (&benchBarrier);
+	start = traceClock ();
+	sleep (benchSeconds);
+	benchStop = 1;
+	for (i = 0; i < threads; i++)
+		pthread_join (workers[i].tid, NULL);
+	elapsed = traceClock () - start;
+	pthread_barrier_destroy (&benchBarrier);
+
+	for (i = 0; i < threads; i++)
+	{
+		ops += workers[i].ops;
+		bytes += workers[i].bytes;
+		errors += workers[i].errors;
+		for (b = 0; b < BENCH_HIST_BUCKETS; b++)
+			hist[b] += workers[i].hist[b];
+	}
+	seconds = elapsed / 1e9;
+	printf ("%-10s %7d %12.0f %10.1f %10.1f %10.1f %8llu\n", workload->name,
+					threads, ops / seconds, bytes / seconds / 1048576.0,
+					benchPercentile (hist, ops, 50) / 1e3,
+					benchPercentile (hist, ops, 99) / 1e3, (unsigned long long) errors);
+	fflush (stdout);
+	free (workers);
+	free (hist);
+}
+
+/**
+ * Stands in for the FUSE session: initialise vdfuse, run every selected
+ * workload at every thread count against the partition under test, then shut
+ * vdfuse down the way an unmount would
+ * @return 0 on success
+ */
+static int
+benchSession (void)
+{
+	struct fuse_req req;
+	struct fuse_conn_info conn;
+	char *workloads = strdup (benchWorkloadList), *w, *t, *save;
+	int threads, found;
+
+	memset (&conn, 0, sizeof (conn));
+	conn.max_write = 1 << 20;
+	conn.max_readahead = 1 << 20;
+	benchOps.init (NULL, &conn);
+
+	memset (&req, 0, sizeof (req));
+	benchOps.lookup (&req, FUSE_ROOT_ID, benchPartition);
+	if (req.err)
+	{
+		fprintf (stderr, "%s: no %s on the benchmark image\n", processName,
+						 benchPartition);
+		benchOps.destroy (NULL);
+		return 1;
+	}
+
+	printf ("# %s %llu bytes, %s backend, block %zu, %d s per run\n",
+					benchPartition, (unsigned long long) req.entry.attr.st_size,
+					images[0]->backend->name, benchBlock, benchSeconds);
+	printf ("%-10s %7s %12s %10s %10s %10s %8s\n", "workload", "threads", "ops/s",
+					"MB/s", "p50_us", "p99_us", "errors");
+	for (w = strtok_r (workloads, ",", &save); w; w = strtok_r (NULL, ",", &save))
+	{
+		const BenchWorkload *workload;
+		char *threadList = strdup (benchThreadList), *tsave;
+
+		for (found = 0, workload = benchWorkloads; workload->name; workload++)
+			if (strcmp (workload->name, w) == 0 && (found = 1))
+				break;
+		if (!found)
+			usageAndExit ("unknown workload %s", w);
+		if (readonly && workload->readPercent < 100)
+		{
+			printf ("%-10s skipped on a readonly mount\n", w);
+			free (threadList);
+			continue;
+		}
+		for (t = strtok_r (threadList, ",", &tsave); t;
+				 t = strtok_r (NULL, ",", &tsave))
+		{
+			threads = atoi (t);
+			if (threads < 1 || threads > BENCH_THREADS_MAX)
+				usageAndExit ("thread counts must be between 1 and %d",
+											BENCH_THREADS_MAX);
+			benchRun (workload, threads, req.entry.ino, req.entry.attr.st_size);
+		}
+		free (threadList);
+	}
+	free (workloads);
+
+	if (verbose)
+	{
+		struct fuse_file_info fi;
+		char stats[1 << 16];
+
+		memset (&fi, 0, sizeof (fi));
+		benchOps.lookup (&req, INO_STATSDIR, STATSFILE);
+		benchOps.open (&req, req.entry.ino, &fi);
+		req.buf = stats;
+		benchOps.read (&req, req.entry.ino, sizeof (stats) - 1, 0, &req.fi);
+		stats[req.err ? 0 : req.size] = 0;
+		fputs (stats, stdout);
+		benchOps.release (&req, req.entry.ino, &req.fi);
+	}
+
+	benchOps.destroy (NULL);
+	return 0;
+}
+
+int
+fuse_session_loop (struct fuse_session *se UNUSED)
+{
+	return benchSession ();
+}
+
+int
+fuse_session_loop_mt (struct fuse_session *se UNUSED)
+{
+	return benchSession ();
+}
+
+//====================================================================================================
+//                                                 Main
+//====================================================================================================
+
+static void
+benchUsage (const char *name)
+{
+	fprintf (stderr,
+					 "USAGE: %s [options] [-- vdfuse options]\n"
+					 "\t-i, --image=PATH\tcreate and benchmark a new sparse image file, which\n"
+					 "\t\t\tmust not exist (default: in memory)\n"
+					 "\t-s, --size=SIZE\timage size (default 1G)\n"
+					 "\t-p, --partitions=N\tPartition1 plus N-1 logical partitions (default 1)\n"
+					 "\t-P, --partition=NAME\tfile to benchmark (default Partition1)\n"
+					 "\t-b, --block=SIZE\trequest size (default 64k)\n"
+					 "\t-d, --duration=SECONDS\tlength of each run (default 3)\n"
+					 "\t-T, --threads=LIST\tthread counts (default 1,4,16,64)\n"
+					 "\t-w, --workloads=LIST\tof seqread, randread, seqwrite, randwrite, randrw\n"
+					 "\t-l, --latency=US\tadded to every backend read and write\n"
+					 "\t-k, --keep\tdo not delete the created image file afterwards\n", name);
+	exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+	static struct option benchOptions[] = {
+		{"image", required_argument, NULL, 'i'},
+		{"size", required_argument, NULL, 's'},
+		{"partitions", required_argument, NULL, 'p'},
+		{"partition", required_argument, NULL, 'P'},
+		{"block", required_argument, NULL, 'b'},
+		{"duration", required_argument, NULL, 'd'},
+		{"threads", required_argument, NULL, 'T'},
+		{"workloads", required_argument, NULL, 'w'},
+		{"latency", required_argument, NULL, 'l'},
+		{"keep", no_argument, NULL, 'k'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+	char image[] = "/tmp/vdbench.XXXXXX", *path = image;
+	char **vdArgv;
+	uint64_t size = 1ULL << 30;
+	int partitions = 1, keep = 0, fd, c, i, vdArgc = 0, err;
+
+	processName = argv[0];
+	while ((c = getopt_long (argc, argv, "i:s:p:P:b:d:T:w:l:kh", benchOptions,
+													 NULL)) != -1)
+	{
+		switch (c)
+		{
+			case 'i':
+				path = optarg;
+				vdStubMemory = 0;
+				break;
+			case 's':
+				size = parseSize (optarg);
+				break;
+			case 'p':
+				partitions = atoi (optarg);
+				break;
+			case 'P':
+				benchPartition = optarg;
+				break;
+			case 'b':
+				benchBlock = parseSize (optarg);
+				break;
+			case 'd':
+				benchSeconds = atoi (optarg);
+				break;
+			case 'T':
+				benchThreadList = optarg;
+				break;
+			case 'w':
+				benchWorkloadList = optarg;
+				break;
+			case 'l':
+				vdStubLatency = atoi (optarg);
+				break;
+			case 'k':
+				keep = 1;
+				break;
+			default:
+				benchUsage (argv[0]);
+		}
+	}
+	if (partitions < 1 || partitions > HOSTPARTITION_MAX - 4 || benchSeconds < 1
+			|| !benchBlock || size < benchBlock)
+		benchUsage (argv[0]);
+
+	if (path == image)
+		fd = mkstemp (image);
+	else
+		fd = open (path, O_RDWR | O_CREAT | O_EXCL, 0600);	// never an existing image
+	if (fd < 0)
+		usageAndExit ("cannot create %s: %s", path,
+									errno == EEXIST ? "it exists, give a new file" : strerror (errno));
+	benchLayout (fd, size, partitions);
+	close (fd);
+
+// vdfuse gets the image, the bench's pass-through options and a dummy mountpoint
+
+	if (!(vdArgv = calloc (argc - optind + 7, sizeof (char *))))
+		usageAndExit ("out of memory");
+	vdArgv[vdArgc++] = "vdfuse";
+	vdArgv[vdArgc++] = "-t";
+	vdArgv[vdArgc++] = "VDI";
+	vdArgv[vdArgc++] = "-f";
+	vdArgv[vdArgc++] = path;
+	for (i = optind; i < argc; i++)
+		vdArgv[vdArgc++] = argv[i];
+	vdArgv[vdArgc++] = "bench";
+	optind = 0;
+	err = vdfuseMain (vdArgc, vdArgv);
+
+	if (!keep)
+		unlink (path);
+	free (vdArgv);
+	return err;
+}
@@ -0,0 +1,258 @@
+/* vdstub.c - in-memory / sparse file stand-in for the VBoxDDU VD API           *
+ *                                                                              *
+ * Every image is a raw disk.  By default it is loaded into anonymous memory,   *
+ * so that the benchmark measures vdfuse rather than the host disk; writes are  *
+ * not saved.  With vdStubMemory cleared, reads and writes go to the (sparse)   *
+ * image file with pread/pwrite.  vdStubLatency adds a fixed delay to every     *
+ * read, write and flush to model a slow image.                                 */
+
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <VBox/vd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// One StubImage per image file, shared by all containers that open it so that
+// the read pool (-n) sees the data written through the main handle
+
+typedef struct StubImage
+{
+	char *name;
+	int fd;
+	char *mem;										// contents when vdStubMemory is set
+	uint64_t size;
+	int refs;
+	struct StubImage *next;
+} StubImage;
+
+struct VBOXHDD
+{
+	StubImage *image;
+};
+
+int vdStubMemory = 1;
+unsigned vdStubLatency = 0;			// microseconds
+
+static StubImage *stubImages = NULL;
+static pthread_mutex_t stubMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Wait vdStubLatency microseconds
+ */
+static void
+stubDelay (void)
+{
+	struct timespec ts = { vdStubLatency / 1000000, (vdStubLatency % 1000000) * 1000 };
+
+	if (vdStubLatency)
+		nanosleep (&ts, NULL);
+}
+
+/**
+ * Copy the data regions of a sparse file into memory, skipping the holes
+ * @param image Image with fd and mem set up
+ * @return 0 or -1
+ */
+static int
+stubLoad (StubImage * image)
+{
+	off_t data = 0, hole;
+
+	while ((data = lseek (image->fd, data, SEEK_DATA)) >= 0)
+	{
+		if ((hole = lseek (image->fd, data, SEEK_HOLE)) < 0)
+			hole = image->size;
+		if (pread (image->fd, image->mem + data, hole - data, data) != hole - data)
+			return -1;
+		data = hole;
+	}
+	if (errno == ENXIO)						// no more data
+		return 0;
+
+// SEEK_DATA is not supported, read everything
+
+	return (pread (image->fd, image->mem, image->size, 0) == (ssize_t) image->size)
+		? 0 : -1;
+}
+
+int
+VDInterfaceAdd (PVDINTERFACE pInterface, const char *pszName,
+								VDINTERFACETYPE enmInterface, void *pvUser, size_t cbInterface,
+								PVDINTERFACE * ppVDIfs)
+{
+	pInterface->pszInterfaceName = pszName;
+	pInterface->enmInterface = enmInterface;
+	pInterface->pvUser = pvUser;
+	pInterface->cbSize = cbInterface;
+	pInterface->pNext = *ppVDIfs;
+	*ppVDIfs = pInterface;
+	return VINF_SUCCESS;
+}
+
+int
+VDCreate (PVDINTERFACE pVDIfsDisk, VDTYPE enmType, PVBOXHDD * ppDisk)
+{
+	(void) pVDIfsDisk;
+	(void) enmType;
+	*ppDisk = calloc (1, sizeof (struct VBOXHDD));
+	return *ppDisk ? VINF_SUCCESS : VERR_NO_MEMORY;
+}
+
+/**
+ * Open an image.  Only a single image per container is supported, the stub has
+ * no differencing images.
+ */
+int
+VDOpen (PVBOXHDD pDisk, const char *pszBackend, const char *pszFilename,
+				unsigned uOpenFlags, PVDINTERFACE pVDIfsImage)
+{
+	StubImage *image;
+	struct stat st;
+
+	(void) pszBackend;
+	(void) pVDIfsImage;
+	if (pDisk->image)
+		return VERR_GENERAL_FAILURE;
+	if (uOpenFlags & VD_OPEN_FLAGS_DISCARD)
+		return VERR_NOT_SUPPORTED;	// like VBoxDDU for formats that cannot discard
+
+	pthread_mutex_lock (&stubMutex);
+	for (image = stubImages; image; image = image->next)
+		if (strcmp (image->name, pszFilename) == 0)
+			break;
+	if (!image)
+	{
+		if (!(image = calloc (1, sizeof (StubImage))))
+			goto fail;
+		image->fd = open (pszFilename,
+											(uOpenFlags & VD_OPEN_FLAGS_READONLY) ? O_RDONLY : O_RDWR);
+		if (image->fd < 0 || fstat (image->fd, &st) < 0)
+		{
+			free (image);
+			goto fail;
+		}
+		image->size = st.st_size;
+		if (vdStubMemory)
+		{
+			image->mem = mmap (NULL, image->size, PROT_READ | PROT_WRITE,
+												 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (image->mem == MAP_FAILED || stubLoad (image) < 0)
+			{
+				close (image->fd);
+				free (image);
+				goto fail;
+			}
+		}
+		image->name = strdup (pszFilename);
+		image->next = stubImages;
+		stubImages = image;
+	}
+	image->refs++;
+	pDisk->image = image;
+	pthread_mutex_unlock (&stubMutex);
+	return VINF_SUCCESS;
+
+fail:
+	pthread_mutex_unlock (&stubMutex);
+	return VERR_FILE_NOT_FOUND;
+}
+
+int
+VDRead (PVBOXHDD pDisk, uint64_t uOffset, void *pvBuf, size_t cbRead)
+{
+	StubImage *image = pDisk->image;
+
+	if (uOffset + cbRead > image->size)
+		return VERR_EOF;
+	stubDelay ();
+	if (image->mem)
+	{
+		memcpy (pvBuf, image->mem + uOffset, cbRead);
+		return VINF_SUCCESS;
+	}
+	return (pread (image->fd, pvBuf, cbRead, uOffset) == (ssize_t) cbRead)
+		? VINF_SUCCESS : VERR_GENERAL_FAILURE;
+}
+
+int
+VDWrite (PVBOXHDD pDisk, uint64_t uOffset, const void *pvBuf, size_t cbWrite)
+{
+	StubImage *image = pDisk->image;
+
+	if (uOffset + cbWrite > image->size)
+		return VERR_EOF;
+	stubDelay ();
+	if (image->mem)
+	{
+		memcpy (image->mem + uOffset, pvBuf, cbWrite);
+		return VINF_SUCCESS;
+	}
+	return (pwrite (image->fd, pvBuf, cbWrite, uOffset) == (ssize_t) cbWrite)
+		? VINF_SUCCESS : VERR_GENERAL_FAILURE;
+}
+
+int
+VDDiscardRanges (PVBOXHDD pDisk, PCRTRANGE paRanges, unsigned cRanges)
+{
+	(void) pDisk;
+	(void) paRanges;
+	(void) cRanges;
+	return VERR_NOT_SUPPORTED;
+}
+
+int
+VDFlush (PVBOXHDD pDisk)
+{
+	stubDelay ();
+	if (pDisk->image->mem)
+		return VINF_SUCCESS;
+	return (fdatasync (pDisk->image->fd) == 0) ? VINF_SUCCESS : VERR_GENERAL_FAILURE;
+}
+
+uint64_t
+VDGetSize (PVBOXHDD pDisk, unsigned nImage)
+{
+	(void) nImage;
+	return pDisk->image ? pDisk->image->size : 0;
+}
+
+int
+VDCloseAll (PVBOXHDD pDisk)
+{
+	StubImage *image = pDisk->image, **pp;
+
+	if (!image)
+		return VINF_SUCCESS;
+	pthread_mutex_lock (&stubMutex);
+	if (--image->refs == 0)
+	{
+		for (pp = &stubImages; *pp != image; pp = &(*pp)->next)
+			;
+		*pp = image->next;
+		if (image->mem)
+			munmap (image->mem, image->size);
+		close (image->fd);
+		free (image->name);
+		free (image);
+	}
+	pthread_mutex_unlock (&stubMutex);
+	pDisk->image = NULL;
+	return VINF_SUCCESS;
+}
+
+int
+VDDestroy (PVBOXHDD pDisk)
+{
+	if (!pDisk)
+		return VINF_SUCCESS;
+	VDCloseAll (pDisk);
+	free (pDisk);
+	return VINF_SUCCESS;
+}
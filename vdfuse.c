@@ -20,16 +20,26 @@
 
 #define FUSE_USE_VERSION 26
 #define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE									// struct ucred, FALLOC_FL_*
 #include <limits.h>
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <errno.h>
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <pthread.h>
+#include <time.h>
+#include <signal.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
 
 #ifdef __GNUC__
 #define UNUSED __attribute__ ((unused))
@@ -40,49 +50,331 @@
 #define IN_RING3
 #define BLOCKSIZE 512
 #define UNALLOCATED -1
-#define GETOPT_ARGS "rgvawt:s:f:dh?"
+#define GETOPT_ARGS "rgvawt:s:f:n:dh?"
+#define OPT_CACHE_SIZE 256
+#define OPT_CACHE_BLOCK 257
+#define OPT_READAHEAD 258
+#define OPT_WRITEBACK 259
+#define OPT_WRITEBACK_MAX 260
+#define OPT_WRITEBACK_AGE 261
+#define OPT_NO_NATIVE 262
+#define OPT_DAEMON 263
+#define OPT_IO_THREADS 264
+#define OPT_IO_URING 265
+#define OPT_NBD 266
+#define OPT_EXPORT 267
+#define OPT_OUTPUT 268
+#define OPT_COMPRESS 269
+#define OPT_SIDECAR 270
+#define OPT_PROFILE 271
+#define OPT_BUFFER_POOL 272
+#define OPT_INVENTORY 273
+#define OPT_CACHE_PREFAULT 274
 #define HOSTPARTITION_MAX 100
 #define DIFFERENCING_MAX 100
+#define READERS_MAX 64
+#define CACHE_SHARDS 64
+#define CACHE_BLOCK_DEFAULT (64 * 1024)
+#define CACHE_BLOCK_MAX (16 * 1024 * 1024)
+#define CACHE_RUN_MAX 64
+#define CACHE_KEY_SHIFT 40				// cache keys are an image or file id above the block number
+#define CACHE_KEY_ID(id,b) (((uint64_t) (id) << CACHE_KEY_SHIFT) | (b))
+#define CACHE_KEY(img,b) CACHE_KEY_ID ((img)->id, b)
+#define CACHE_KEY_BLOCK(k) ((k) & (((uint64_t) 1 << CACHE_KEY_SHIFT) - 1))
+#define READAHEAD_DEFAULT (2 * 1024 * 1024)
+#define READAHEAD_THREADS 2
+#define READAHEAD_TRIGGER 2		// sequential reads seen before readahead starts
+#define READAHEAD_QUEUE_MAX (2 * READAHEAD_THREADS)	// readahead jobs queued or running at a time
+#define IO_THREADS_DEFAULT 4
+#define IO_THREADS_MAX 64
+#define SPLIT_BLOCK_DEFAULT (1024 * 1024)	// split unit when the image block size is unknown
+#define WRITEBACK_CACHE_DEFAULT (256 * 1024 * 1024)
+#define WRITEBACK_AGE_DEFAULT 5
+#define WRITEBACK_RUN_MAX (4 * 1024 * 1024)
+#define BUFFER_SIZE (4 * 1024 * 1024)	// pool buffer, a cache miss run or write back run
+#define BUFFER_ALIGN 4096				// of every buffer, enough for O_DIRECT
+#define BUFFER_POOL_DEFAULT (64 * 1024 * 1024)
+#define BUFFER_STASH 2					// freed buffers a thread keeps for itself
+#define BUFFER_PAGES_SMALL 0
+#define BUFFER_PAGES_THP 1			// transparent huge pages were asked for
+#define BUFFER_PAGES_HUGETLB 2	// reserved huge pages
+#define STATSDIR ".vdfuse"
+#define STATSFILE "stats"				// in STATSDIR
+#define CONTROLFILE "control"		// in STATSDIR, daemon mode only
+#define INO_STATSDIR 2
+#define INO_STATSFILE 3
+#define INO_CONTROLFILE 4
+#define INO_IMAGE_SHIFT 10			// every image owns 2^INO_IMAGE_SHIFT inodes
+#define INO_IMAGE(slot) ((fuse_ino_t) ((slot) + 1) << INO_IMAGE_SHIFT)	// directory of images[slot]
+#define INO_SLOT(ino) ((int) ((ino) >> INO_IMAGE_SHIFT) - 1)	// -1 for the inodes above
+#define INO_LOCAL(ino) ((ino) & ((1 << INO_IMAGE_SHIFT) - 1))
+#define INO_PARTITION 16			// local inode of partition[0]
+#define INO_STRIDE 4					// inodes per partition: the partition and its virtual files
+#define INO_KIND(ino) ((INO_LOCAL (ino) - INO_PARTITION) % INO_STRIDE)
+#define INO_PARTITION_FILE(slot,n,kind) (INO_IMAGE (slot) + INO_PARTITION + (n) * INO_STRIDE + (kind))
+#define IMAGES_MAX 1024
+#define IMAGE_NAME_MAX 63
+#define CONTROL_LINE_MAX 4096
+#define KIND_PARTITION 0
+#define KIND_ALLOCMAP 1				// Partition1.allocmap etc.
+#define KIND_SHA256MAP 2				// Partition1.sha256map etc.
+#define KIND_CHANGEMAP 3				// Partition1.changemap etc.
+#define KIND_MAX 4
+#define ALLOCMAP_BLOCK (1024 * 1024)	// bytes of partition per allocation map bit
+#define SHA256MAP_BLOCK (1024 * 1024)	// bytes of partition per block hash
+#define SHA256MAP_HEAD 82				// "digest-of-blocks ", 64 hex digits and a newline
+#define SHA256MAP_LINE 82				// 16 hex digits of offset, a space, 64 hex digits
+#define SHA256_SIZE 32
+#define SIDECAR_MAGIC "VDFUSEMD"
+#define SIDECAR_VERSION 1
+#define SIDECAR_SUFFIX ".vdfuse"
+#define PROFILE_MAGIC "VDFUSEAP"
+#define PROFILE_VERSION 1
+#define PROFILE_SUFFIX ".vdprofile"
+#define PROFILE_CHUNK (64 * 1024)	// bytes of disk per profile bit
+#define PROFILE_EXTENTS_MAX (1024 * 1024)	// reads beyond this many runs are not recorded
+#define PROFILE_PIECE (1024 * 1024)	// loaded at a time by the replay
+#define PROFILE_BACKOFF_US 1000	// replay sleep while the image is busy
+#define TRACE_READ 0
+#define TRACE_WRITE 1
+#define TRACE_FLUSH 2
+#define TRACE_FSYNC 3
+#define TRACE_GETATTR 4
+#define TRACE_OPS 5
+#define TRACE_OTHER (HOSTPARTITION_MAX + 1)	// histogram slot for anything but a partition
+#define TRACE_SLOTS (HOSTPARTITION_MAX + 2)
+#define TRACE_BUCKETS 24				// powers of two from 1us
+#define TRACE_RING 4096					// events per thread
+#define TRACE_INTERVAL_MS 50
+#define ATTR_TIMEOUT 1.0
+#define SPLICE_EXTENTS_MAX 32
+#define SPLICE_ZERO_MAX (1024 * 1024)	// largest hole a spliced read can cover
+#define IO_BATCH_MAX 256				// extents per ioRead, and io_uring entries per ring
 #define PNAMESIZE 15
 #define MBR_START 446
 #define EBR_START 446
 #define PARTTYPE_IS_EXTENDED(x) ((x) == 0x05 || (x) == 0x0f || (x) == 0x85)
+#define VDI_SIGNATURE 0xbeda107f
+#define VDI_VERSION 0x00010001			// 1.1, the only version with the VDIheader layout
+#define VDI_BLOCK_FREE 0xffffffff
+#define VDI_BLOCK_ZERO 0xfffffffe
+#define VDI_TYPE_NORMAL 1
+#define VDI_TYPE_FIXED 2
+#define VDI_TYPE_DIFF 4
+#define VHD_TYPE_FIXED 2
+#define VHD_TYPE_DYNAMIC 3
+#define VHD_TYPE_DIFF 4
+#define INVENTORY_DESCRIPTOR_MAX (64 * 1024)	// longest VMDK descriptor read
+#define VDI_INDEX(layer,entry) (((uint64_t) (layer) << 32) | (entry))
+#define NBD_MAGIC 0x4e42444d41474943ULL	// "NBDMAGIC", see the NBD protocol document
+#define NBD_OPTS_MAGIC 0x49484156454f5054ULL	// "IHAVEOPT"
+#define NBD_REP_MAGIC 0x3e889045565a9ULL
+#define NBD_REQUEST_MAGIC 0x25609513
+#define NBD_REPLY_MAGIC 0x67446698
+#define NBD_FLAG_FIXED_NEWSTYLE 1		// handshake flags
+#define NBD_FLAG_NO_ZEROES 2
+#define NBD_FLAG_HAS_FLAGS 1				// transmission flags
+#define NBD_FLAG_READ_ONLY 2
+#define NBD_FLAG_SEND_FLUSH 4
+#define NBD_FLAG_SEND_FUA 8
+#define NBD_FLAG_SEND_TRIM 32
+#define NBD_FLAG_SEND_WRITE_ZEROES 64
+#define NBD_FLAG_CAN_MULTI_CONN 256
+#define NBD_OPT_EXPORT_NAME 1
+#define NBD_OPT_ABORT 2
+#define NBD_OPT_LIST 3
+#define NBD_OPT_INFO 6
+#define NBD_OPT_GO 7
+#define NBD_REP_ACK 1
+#define NBD_REP_SERVER 2
+#define NBD_REP_INFO 3
+#define NBD_REP_ERR_UNSUP 0x80000001
+#define NBD_REP_ERR_POLICY 0x80000002
+#define NBD_REP_ERR_INVALID 0x80000003
+#define NBD_REP_ERR_UNKNOWN 0x80000006
+#define NBD_INFO_EXPORT 0
+#define NBD_INFO_BLOCK_SIZE 3
+#define NBD_CMD_READ 0
+#define NBD_CMD_WRITE 1
+#define NBD_CMD_DISC 2
+#define NBD_CMD_FLUSH 3
+#define NBD_CMD_TRIM 4
+#define NBD_CMD_WRITE_ZEROES 6
+#define NBD_CMD_FLAG_FUA 1
+#define NBD_OPTION_MAX 4096				// longest option accepted during the handshake
+#define NBD_REQUEST_MAX (32 * 1024 * 1024)	// longest read or write
+#define NBD_INFLIGHT_MAX 64				// requests per connection queued for the workers
+#define ZERO_CHUNK (1024 * 1024)		// zeros written at a time by diskZero
+#define EXPORT_CHUNK (1024 * 1024)		// unit of an --export, read, checked and compressed as one
+#define EXPORT_WINDOW 4						// chunks in flight per worker
+#define EXPORT_LEVEL_DEFAULT 6
 #define VERSION "0.83"
 
+typedef struct Image Image;
+typedef struct PartitionTable PartitionTable;
+
 void usageAndExit (char *optFormat, ...);
 void vbprintf (const char *format, ...);
 void vdErrorCallback (void *pvUser, int rc, const char *file, unsigned iLine,
 											const char *function, const char *format, va_list va);
-void initialisePartitionTable (void);
-int findPartition (const char *filename);
+const char *initialisePartitionTable (Image * img);
+void rescanPartitionTable (Image * img);
+int partitionDescriptorTouched (Image * img, uint64_t offset, size_t len);
+int findPartition (PartitionTable * t, const char *filename);
 int detectDiskType (char **disktype, char *filename);
-static int VD_open (const char *c, struct fuse_file_info *i);
-static int VD_release (const char *name, struct fuse_file_info *fi);
-static int VD_read (const char *c, char *out, size_t len, off_t offset,
-										struct fuse_file_info *i UNUSED);
-static int VD_write (const char *c, const char *in, size_t len, off_t offset,
-										 struct fuse_file_info *i UNUSED);
-static int VD_flush (const char *p, struct fuse_file_info *i UNUSED);
-static int VD_readdir (const char *p, void *buf, fuse_fill_dir_t filler,
-											 off_t offset UNUSED, struct fuse_file_info *i UNUSED);
-static int VD_getattr (const char *p, struct stat *stbuf);
-void VD_destroy (void *u);
+uint64_t parseSize (const char *s);
+void bufferInit (uint64_t size);
+void cacheInit (uint64_t size, size_t block);
+int cacheRead (Image * img, uint64_t offset, char *buf, size_t len);
+int cacheScan (Image * img, uint64_t offset, char *buf, size_t len);
+void cacheUpdate (Image * img, uint64_t offset, const char *buf, size_t len);
+void cachePrefetch (Image * img, uint64_t offset, size_t len);
+void cachePurge (unsigned id);
+unsigned cacheFileGet (const struct stat *st);
+void cacheFilePut (unsigned id);
+int cacheWriteBack (Image * img, uint64_t offset, const char *buf, size_t len);
+int writebackFlush (Image * img);
+int writebackFlushAll (void);
+int groupCommit (Image * img);
+size_t cacheStats (char *buf, size_t size);
+Image *imageOpen (const char *name, const char *filename, char **snapshots,
+									int count, const char **error);
+static void imageClose (Image * img);
+Image *imageGet (int slot);
+void imageRelease (Image * img);
+int imageList (Image ** list);
+int imageAdd (Image * img);
+int imageRemove (const char *name);
+void taskInit (int threads);
+void backgroundInit (void);
+void backgroundStop (void);
+int nbdServe (const char *path, int foreground);
+int exportStream (const char *name, const char *output);
+int inventoryRun (char **files, int count, const char *output);
+uint64_t traceClock (void);
+uint64_t traceBegin (void);
+void traceLock (pthread_mutex_t * m);
+void traceEnd (int op, Image * img, int slot, uint64_t ino, uint64_t offset,
+							 size_t len, int error, uint64_t start);
+void traceInit (void);
+size_t traceStats (char *buf, size_t size);
+int taskSubmit (void (*run) (void *), void *arg);
+int splitRead (Image * img, uint64_t offset, char *buf, size_t len);
+static void VD_lookup (fuse_req_t req, fuse_ino_t parent, const char *name);
+static void VD_open (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *i);
+static void VD_release (fuse_req_t req, fuse_ino_t ino,
+												struct fuse_file_info *fi);
+static void VD_read (fuse_req_t req, fuse_ino_t ino, size_t len, off_t offset,
+										 struct fuse_file_info *i);
+static void VD_write_buf (fuse_req_t req, fuse_ino_t ino,
+													struct fuse_bufvec *bufv, off_t offset,
+													struct fuse_file_info *i);
+static void VD_flush (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *i);
+static void VD_fsync (fuse_req_t req, fuse_ino_t ino, int datasync,
+											struct fuse_file_info *i);
+static void VD_readdir (fuse_req_t req, fuse_ino_t ino, size_t size,
+												off_t offset, struct fuse_file_info *i);
+static void VD_getattr (fuse_req_t req, fuse_ino_t ino,
+												struct fuse_file_info *i);
+static void VD_fallocate (fuse_req_t req, fuse_ino_t ino, int mode,
+													off_t offset, off_t length, struct fuse_file_info *i);
+static void VD_init (void *userdata, struct fuse_conn_info *conn);
+static void VD_destroy (void *u);
+
+// Compiling with -DNO_VBOX drops VBoxDDU altogether.  Only readonly mounts of
+// plain VDI images are possible then, through the native VDI backend.
 
+#ifndef NO_VBOX
 #include <VBox/vd.h>
+#else
+#define RT_SUCCESS(rc) ((rc) >= 0)
+#define RT_FAILURE(rc) ((rc) < 0)
+#endif
+
+// io_uring is used through its system calls, so only the kernel headers are
+// needed.  -DNO_IO_URING leaves it out.
+
+#ifndef NO_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+// --compress needs zlib.  -DNO_ZLIB leaves it out.
+
+#ifndef NO_ZLIB
+#include <zlib.h>
+#endif
+
+// On x86-64, SHA-256 uses the SHA extensions when the CPU has them
+
+#if defined (__x86_64__) && defined (__GNUC__)
+#define SHA_NI
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+
+// A contiguous piece of the virtual disk as stored in the image: len bytes at pos
+// in fd, or zeros if fd is -1
+
+typedef struct
+{
+	int fd;
+	uint64_t pos;
+	size_t len;
+} DiskExtent;
+
+// A disk backend provides the virtual disk of an image to everything above it.
+// Status codes follow the VBox convention: negative on failure.  Backends that
+// set concurrent may be read from several threads at once without diskMutex.
+// map is optional; it describes where a range of the disk lives so that reads
+// can be spliced.  discard is optional too; it frees whole blocks of the image
+// so that they read as zeros, and is only used if the image's discard is set.
+
+typedef struct
+{
+	const char *name;
+	int (*read) (Image * img, uint64_t offset, void *buf, size_t len);
+	int (*map) (Image * img, uint64_t offset, size_t len, DiskExtent * ext, int max);
+	int (*write) (Image * img, uint64_t offset, const void *buf, size_t len);
+	int (*discard) (Image * img, uint64_t offset, size_t len);
+	int (*flush) (Image * img);
+	uint64_t (*size) (Image * img);
+	void (*close) (Image * img);
+	int concurrent;
+} DiskBackend;
+
+int poolRead (Image * img, uint64_t offset, void *buf, size_t len);
+int vdiOpen (Image * img, int writable);
+
+// Time spent in the backend is added to the operation being traced, see traceEnd
+
+#define TRACE_BACKEND(call) \
+   ({ uint64_t t_ = traceClock (); int r_ = (call); traceBackendNs += traceClock () - t_; r_; })
 
-#define DISKread(o,b,s) VDRead (hdDisk,o,b,s);
-#define DISKwrite(o,b,s) VDWrite (hdDisk,o,b,s);
-#define DISKclose VDCloseAll(hdDisk)
-#define DISKsize VDGetSize(hdDisk, 0)
-#define DISKflush VDFlush(hdDisk)
-#define DISKopen(t,i) \
-   if (RT_FAILURE(VDOpen(hdDisk,t , i, readonly ? VD_OPEN_FLAGS_READONLY : VD_OPEN_FLAGS_NORMAL, NULL))) \
-      usageAndExit("opening vbox image failed");
+#define DISKread(i,o,b,s) TRACE_BACKEND ((i)->backend->read (i,o,b,s))
+#define DISKwrite(i,o,b,s) TRACE_BACKEND ((i)->backend->write (i,o,b,s))
+#define DISKclose(i) (i)->backend->close (i)
+#define DISKsize(i) (i)->backend->size (i)
+#define DISKflush(i) TRACE_BACKEND ((i)->backend->flush (i))
 
-PVBOXHDD hdDisk;
+#ifndef NO_VBOX
+int openDiskChain (Image * img, PVBOXHDD * disk, unsigned flags);
+
+// Pool of additional read-only handles on the same image chain (-n).  VBoxDDU
+// handles are not thread safe, so each one carries its own mutex; readers try
+// the handle they used last, then any idle one, and only block when all are busy.
+
+typedef struct
+{
+	PVBOXHDD disk;								// read-only VD container for the image + snapshots
+	pthread_mutex_t mutex;				// held for the duration of a VDRead on this handle
+} ReadHandle;
+
+static __thread int readPoolHint = -1;
 PVDINTERFACE pVDifs = NULL;
 VDINTERFACE vdError;
 VDINTERFACEERROR vdInterfaceError;
+#endif
 
 // Partition table information
 
@@ -111,6 +403,26 @@ typedef struct
 	MBRentry descriptor;					// copy of MBR / EBR descriptor that defines the partion
 } Partition;
 
+// The partition table is published as an immutable snapshot.  A rescan builds a
+// new table and swaps the pointer, and open handles keep the geometry they were
+// opened with.  Code that looks at the table for the length of a call brackets
+// that with partitionsEnter and partitionsExit; an open handle or NBD export
+// holds a reference with partitionsHold instead.  A retired table is freed once
+// it has no references and nobody is between enter and exit, see
+// partitionsReclaim.
+
+struct PartitionTable
+{
+	Partition partition[HOSTPARTITION_MAX + 1];	// partition[0] is the EntireDisk descriptor
+	int last;											// highest partition number in use
+	off_t sector[HOSTPARTITION_MAX + 1];	// disk offsets of the MBR and all EBRs
+	int sectors;
+	int refs;											// open handles and NBD exports using it
+	struct PartitionTable *retired;	// the table this one replaced
+};
+
+#define PARTITIONS(img) __atomic_load_n (&(img)->partitions, __ATOMIC_SEQ_CST)
+
 #pragma pack( push )
 #pragma pack( 1 )
 
@@ -131,27 +443,639 @@ typedef struct
 	uint16_t signature;
 } EBRentry;
 
+// VDI on-disk format, see VDICore.h in the VirtualBox sources
+
+typedef struct
+{
+	char fileInfo[64];						// "<<< Oracle VM VirtualBox Disk Image >>>\n"
+	uint32_t signature;						// VDI_SIGNATURE
+	uint32_t version;							// major in the high 16 bits, see VDI_VERSION
+} VDIpreHeader;
+
+typedef struct
+{
+	uint32_t headerSize;					// at least sizeof (VDIheader) for version 1.1
+	uint32_t type;								// VDI_TYPE_*
+	uint32_t flags;
+	char comment[256];
+	uint32_t blocksOffset;				// file offset of the block map
+	uint32_t dataOffset;					// file offset of the first block
+	uint32_t cylinders, heads, sectors, sectorSize;	// legacy geometry
+	uint32_t unused;
+	uint64_t diskSize;						// virtual size in bytes
+	uint32_t blockSize;
+	uint32_t blockExtra;					// bytes of extra data in front of each block
+	uint32_t blocks;
+	uint32_t blocksAllocated;
+	uint8_t uuidCreate[16];
+	uint8_t uuidModify[16];
+	uint8_t uuidLinkage[16];
+	uint8_t uuidParentModify[16];
+} VDIheader;
+
+// The parts of the VHD and VMDK headers that the inventory reads.  VHD is big
+// endian, VMDK little endian.
+
+typedef struct
+{
+	char cookie[8];								// "conectix"
+	uint32_t features;
+	uint32_t version;
+	uint64_t dataOffset;					// of the dynamic disk header
+	uint32_t timestamp;
+	char creatorApp[4];
+	uint32_t creatorVersion;
+	uint32_t creatorOs;
+	uint64_t originalSize;
+	uint64_t currentSize;					// virtual size in bytes
+	uint32_t geometry;
+	uint32_t diskType;						// VHD_TYPE_*
+	uint32_t checksum;
+	uint8_t uniqueId[16];
+} VHDfooter;
+
+typedef struct
+{
+	char cookie[8];								// "cxsparse"
+	uint64_t dataOffset;
+	uint64_t tableOffset;
+	uint32_t headerVersion;
+	uint32_t maxTableEntries;
+	uint32_t blockSize;
+	uint32_t checksum;
+	uint8_t parentUniqueId[16];
+} VHDdynamicHeader;
+
+typedef struct
+{
+	char magic[4];								// "KDMV"
+	uint32_t version;
+	uint32_t flags;
+	uint64_t capacity;						// in sectors
+	uint64_t grainSize;
+	uint64_t descriptorOffset;		// in sectors, 0 without an embedded descriptor
+	uint64_t descriptorSize;			// in sectors
+} VMDKheader;
+
+#pragma pack( pop )
+
+// One image of a native VDI chain, layer 0 is the base image
+
+typedef struct
+{
+	int fd;
+	uint64_t fileSize;						// grows when VBoxDDU allocates blocks in the top layer
+	uint64_t dataOffset;
+	uint32_t blockExtra;
+	uint32_t blocksOffset;				// file offset of the block map
+	unsigned cacheId;							// see cacheFileGet, 0 if not cached by file
+} VDIlayer;
+
+// Native VDI backend state.  The block maps of all layers are merged into one
+// index when the chain is opened.  Each entry holds the layer that owns the block
+// in the high 32 bits and that layer's block map entry (the index of the block in
+// its file or VDI_BLOCK_FREE/ZERO) in the low 32 bits, so finding a block costs
+// one lookup however many snapshots there are.
+
+typedef struct
+{
+	VDIlayer layer[DIFFERENCING_MAX + 1];
+	int layers;
+	uint64_t diskSize;
+	uint32_t blockSize;
+	uint32_t blocks;
+	uint64_t *index;
+	void *indexMap;								// sidecar mapping that holds index, see sidecarVdi
+	size_t indexMapSize;
+	int cacheByFile;							// readonly chain, blocks are cached by layer file
+	uint32_t *owner;							// disk block stored in each slot of the base image
+	uint32_t slots;								// slots in use, see vdiChainDiscard
+} VDIimage;
+
+// Metadata sidecar, see sidecarSave.  A header, a SidecarFile for the base image
+// and each snapshot, a SidecarVdi, the PartitionTable and, page aligned, the
+// native VDI index.  Everything is in host byte order.
+
+typedef struct
+{
+	char magic[8];								// SIDECAR_MAGIC
+	uint32_t version;							// SIDECAR_VERSION
+	uint32_t files;								// the base image and its snapshots
+	uint32_t tableSize;						// sizeof (PartitionTable) of the writer
+	uint32_t unused;
+	uint64_t indexOffset;					// 0 without a native VDI index
+	uint64_t size;								// of the whole sidecar
+	unsigned char checksum[SHA256_SIZE];	// SHA-256 of everything after the header
+} SidecarHeader;
+
+typedef struct
+{
+	uint64_t dev;									// identify the file and its version
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime;
+	int64_t mtimeNs;
+	char type[8];									// detected disk type, empty if it was not needed
+} SidecarFile;
+
+typedef struct
+{
+	uint64_t diskSize;
+	uint32_t blockSize;
+	uint32_t blocks;
+	int32_t layers;								// 0 if the image was not opened natively
+	uint32_t unused;
+	struct
+	{
+		uint64_t dataOffset;
+		uint32_t blockExtra;
+		uint32_t blocksOffset;
+	} layer[DIFFERENCING_MAX + 1];
+} SidecarVdi;
+
+#define SIDECAR_FILES(h) ((SidecarFile *) ((SidecarHeader *) (h) + 1))
+#define SIDECAR_VDI(h) ((SidecarVdi *) (SIDECAR_FILES (h) + ((SidecarHeader *) (h))->files))
+#define SIDECAR_TABLE(h) ((PartitionTable *) (SIDECAR_VDI (h) + 1))
+
+// Access profile, see profileSave.  A header and the runs of PROFILE_CHUNK
+// chunks of the disk in the order they were first read.  Everything is in host
+// byte order.
+
+typedef struct
+{
+	char magic[8];								// PROFILE_MAGIC
+	uint32_t version;							// PROFILE_VERSION
+	uint32_t chunk;								// PROFILE_CHUNK of the writer
+	uint64_t diskSize;
+	uint64_t extents;
+	unsigned char checksum[SHA256_SIZE];	// SHA-256 of the extents
+} ProfileHeader;
+
+typedef struct
+{
+	uint64_t start;								// in chunks
+	uint64_t count;
+} ProfileExtent;
+
+#define PROFILE_SEEN(img,c) (__atomic_load_n ((img)->profileSeen + (c) / 8, __ATOMIC_RELAXED) & (1 << ((c) % 8)))
+
+// Block cache.  The disk is divided into cacheBlock sized blocks which are spread
+// over CACHE_SHARDS independently locked shards by block number, so that readers
+// of neighbouring blocks rarely meet on the same mutex.  Each shard evicts with
+// the CLOCK algorithm over a fixed set of entries.  Blocks that a prefetch is
+// reading are listed as pending in their shard, see cachePrefetch.
+
+typedef struct
+{
+	uint64_t key;									// see cacheKey
+	char *data;										// cacheBlock bytes, allocated on first use
+	int next;											// next entry in the same hash bucket or -1
+	uint8_t valid;
+	uint8_t referenced;						// CLOCK reference bit
+	uint8_t dirty;								// modified in write-back mode, not yet on disk
+	uint8_t writing;							// being written back, must not be evicted
+} CacheEntry;
+
+typedef struct
+{
+	pthread_mutex_t mutex;
+	CacheEntry *entries;
+	int *buckets;									// heads of the hash chains or -1
+	int nEntries;
+	int hand;											// CLOCK hand
+	unsigned generation;					// bumped whenever a cached block is modified
+	uint64_t *pending;						// keys of the blocks being prefetched
+	int pendingCount;
+	int pendingRoom;
+	pthread_cond_t filled;				// a prefetch finished with its pending blocks
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t pendingWaits;				// reads that waited for a prefetch
+} CacheShard;
+
+// A layer file whose blocks are cached by file rather than by image, shared by
+// every image that has it in its chain
+
+typedef struct CacheFile
+{
+	dev_t dev;
+	ino_t ino;
+	unsigned id;									// from the image id counter, so keys never clash
+	int refs;											// layers of open images
+	struct CacheFile *next;
+} CacheFile;
+
+// Tracing, see traceEnd
+
+typedef struct
+{
+	uint8_t op;										// TRACE_xxx
+	uint8_t slot;									// partition number or TRACE_OTHER
+	int16_t error;								// errno the request was answered with
+	uint32_t len;
+	uint32_t image;								// id of the image or 0, see ino for its slot
+	uint64_t ino;
+	uint64_t offset;
+	uint64_t latency;							// all times in nanoseconds
+	uint64_t lockWait;						// waiting for the disk lock or a read handle
+	uint64_t backend;							// inside the disk backend
+} TraceEvent;
+
+typedef struct TraceRing
+{
+	TraceEvent events[TRACE_RING];
+	uint64_t head;								// next event to write, only moved by the owner
+	uint64_t tail;								// next event to drain, only moved by the drainer
+	int owned;										// a live thread writes into this ring
+	struct TraceRing *next;
+} TraceRing;
+
+typedef struct
+{
+	uint64_t count;
+	uint64_t total;
+	uint64_t max;
+	uint64_t lockWait;
+	uint64_t backend;
+	uint64_t buckets[TRACE_BUCKETS];	// bucket b counts latencies below 2^b us
+} TraceHistogram;
+
+// The block hashes of a partition, see sha256mapOpen.  An image keeps them
+// until writes clear their valid bits.
+
+typedef struct HashMap
+{
+	uint64_t offset;							// of the partition on the disk
+	uint64_t size;								// of the partition
+	uint64_t blocks;
+	unsigned char (*hash)[SHA256_SIZE];
+	unsigned char *valid;					// a bit per block
+	uint64_t writes;							// writes to the partition so far
+	struct HashMap *next;
+} HashMap;
+
+typedef struct
+{
+	uint32_t state[8];
+	uint64_t length;							// bytes hashed so far
+	unsigned char buf[64];				// partial block
+} Sha256;
+
+// A range of the disk in use by a read or a write, see rangeLock.  Holds are
+// queued in arrival order, and each waits for the earlier ones it overlaps,
+// unless both only read.
+
+typedef struct RangeHold
+{
+	uint64_t start;
+	uint64_t end;									// exclusive
+	int write;
+	struct RangeHold *next;
+} RangeHold;
+
+// Everything vdfuse knows about one image.  A normal mount has a single image,
+// whose partitions appear in the root directory.  In daemon mode every image is
+// a subdirectory, and images come and go through CONTROLFILE.  The block cache,
+// the worker threads and the FUSE threads are shared by all images.  An image is
+// freed when it has been removed and the last handle on it is closed.
+
+struct Image
+{
+	char name[IMAGE_NAME_MAX + 1];	// subdirectory in daemon mode
+	int slot;											// in images[], selects the inode range
+	unsigned id;									// unique over the daemon's lifetime, see CACHE_KEY
+	int refs;											// open handles and jobs, plus one while listed
+	char *filename;
+	char *diskType;
+	char *differencing[DIFFERENCING_MAX];
+	char *differencingType[DIFFERENCING_MAX];
+	int differencingLen;
+	struct stat fileStat;					// of the image file, the base for all attributes
+	DiskBackend *backend;
+	uint32_t splitBlock;					// large reads are split on these boundaries
+	VDIimage vdi;									// native VDI backend state
+#ifndef NO_VBOX
+	PVBOXHDD hdDisk;
+	ReadHandle readPool[READERS_MAX];
+	int readPoolSize;
+	unsigned int readPoolNext;
+#endif
+	pthread_mutex_t diskMutex;		// serialises backends that are not concurrent
+	pthread_mutex_t partMutex;		// one partition table rescan at a time
+	PartitionTable *partitions;		// current snapshot, see PARTITIONS
+	int partReaders;							// threads between partitionsEnter and partitionsExit
+	int partRetired;							// retired tables not freed yet
+	pthread_mutex_t rangeMutex;		// protects ranges
+	pthread_cond_t rangeCond;
+	RangeHold *ranges;						// held and waiting ranges in arrival order
+	int discard;									// backend->discard can free blocks, see diskZero
+	uint64_t *writebackBlocks;		// scratch list of dirty block numbers
+	int writebackDirty;						// number of dirty cache blocks
+	time_t writebackOldest;				// when the oldest dirty block was dirtied
+	uint64_t writebackRuns;
+	uint64_t writebackBytes;
+	pthread_mutex_t writebackMutex;	// one flusher at a time
+	pthread_mutex_t commitMutex;	// see groupCommit
+	pthread_cond_t commitCond;
+	uint64_t commitRequested;
+	uint64_t commitDone;
+	uint64_t commitFlushes;
+	int committing;
+	int commitResult;
+	TraceHistogram (*traceHistograms)[TRACE_SLOTS];	// [TRACE_OPS], allocated by the drainer
+	pthread_mutex_t hashMutex;		// protects hashMaps and their contents
+	HashMap *hashMaps;						// block hashes of partitions, see sha256mapOpen
+	uint64_t *changed;						// a bit per ALLOCMAP_BLOCK of the disk written since opening
+	SidecarHeader *sidecar;				// valid sidecar mapped while opening, see sidecarLoad
+	size_t sidecarSize;
+	pthread_mutex_t profileMutex;	// protects the recorded profile
+	unsigned char *profileSeen;		// a bit per chunk already recorded, NULL without --profile
+	uint64_t profileChunks;
+	ProfileExtent *profile;				// recorded so far, see profileRecord
+	uint64_t profileExtents;
+	uint64_t profileRoom;
+	ProfileExtent *replay;				// profile of an earlier open, freed by the replay
+	uint64_t replayExtents;
+	pthread_t replayThread;
+	int replayJoin;								// replayThread was started
+	int replayStop;								// set by imageClose
+	int replaying;								// reads and writes count themselves in foreground
+	int foreground;								// reads and writes in flight, the replay waits for 0
+};
+
+// Queue of jobs for the background worker threads
+
+typedef struct Task
+{
+	void (*run) (void *arg);
+	void *arg;
+	struct Task *next;
+} Task;
+
+// Per open file state, stored in fuse_file_info->fh.  For virtual files (see
+// statsOpen) data holds the generated contents; for the disk and partitions it
+// is NULL and the readahead fields track the access pattern of the handle.
+
+typedef struct
+{
+	char *data;										// generated contents of a virtual file
+	size_t size;
+	Image *image;									// holds a reference, NULL for files in STATSDIR
+	int control;									// CONTROLFILE, writes are commands
+	Partition *partition;					// in the partition table current at open time
+	PartitionTable *table;				// holds a reference, the table partition is in
+	pthread_mutex_t mutex;				// protects the readahead state below
+	uint64_t nextOffset;					// where the next sequential read would start
+	int sequential;								// number of consecutive sequential reads
+	uint64_t raWindow;						// current readahead window, 0 while off
+	uint64_t raEnd;								// end of the range already queued for readahead
+} FileHandle;
+
+typedef struct
+{
+	Image *image;									// holds a reference
+	uint64_t offset;							// absolute disk offset
+	size_t len;
+} ReadaheadJob;
+
+// A large read split along block boundaries, see splitRead.  Pieces are
+// claimed in order through next by the caller and the workers alike.
+
+typedef struct
+{
+	Image *image;
+	uint64_t offset;
+	char *buf;
+	size_t len;
+	uint64_t first;								// first split block of the read
+	uint64_t per;									// split blocks per piece
+	int pieces;
+	int next;											// next piece to claim
+	int done;											// pieces finished
+	int result;										// first failure or 0
+	int refs;											// the caller and every queued task
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} SplitRead;
+
+// A hashing pass over the stale blocks of a HashMap, see sha256mapUpdate.
+// Blocks are claimed through next by the caller and the workers alike.
+
+typedef struct
+{
+	Image *image;
+	HashMap *map;
+	uint64_t writes;							// map->writes when the pass started
+	uint64_t next;								// next block to claim
+	uint64_t done;								// blocks finished
+	int result;										// first failure or 0
+	int refs;											// the caller and every queued task
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} HashPass;
+
+// An NBD client connection, see nbdConnection
+
+typedef struct NbdConn
+{
+	int fd;
+	Image *image;									// holds a reference
+	Partition *partition;					// the export, NULL during the handshake
+	PartitionTable *table;				// holds a reference, the table partition is in
+	fuse_ino_t ino;								// of the export's file, for tracing
+	int writable;
+	pthread_mutex_t sendMutex;		// replies go out whole, one at a time
+	pthread_mutex_t mutex;				// protects inflight
+	pthread_cond_t cond;
+	int inflight;									// requests queued for or running on the workers
+	struct NbdConn *next;					// in nbdConns
+} NbdConn;
+
+typedef struct
+{
+	NbdConn *conn;
+	uint16_t flags;
+	uint16_t type;
+	uint64_t handle;							// as received, echoed in the reply
+	uint64_t offset;
+	uint32_t len;
+	char *data;										// write payload or read buffer
+} NbdRequest;
+
+// NBD messages, big endian on the wire
+
+#pragma pack( push )
+#pragma pack( 1 )
+
+typedef struct
+{
+	uint64_t magic;								// NBD_OPTS_MAGIC
+	uint32_t option;
+	uint32_t len;									// of the data that follows
+} NbdOption;
+
+typedef struct
+{
+	uint64_t magic;								// NBD_REP_MAGIC
+	uint32_t option;
+	uint32_t type;
+	uint32_t len;
+} NbdOptionReply;
+
+typedef struct
+{
+	uint32_t magic;								// NBD_REQUEST_MAGIC
+	uint16_t flags;
+	uint16_t type;
+	uint64_t handle;
+	uint64_t offset;
+	uint32_t len;
+} NbdRequestHeader;
+
+typedef struct
+{
+	uint32_t magic;								// NBD_REPLY_MAGIC
+	uint32_t error;
+	uint64_t handle;
+} NbdReply;
+
 #pragma pack( pop )
 
-Partition partitionTable[HOSTPARTITION_MAX + 1];	// Note the partitionTable[0] is reserved for the EntireDisk descriptor
-static int lastPartition = 0;
+// A streaming export and its chunks, see exportStream
+
+#define EXPORT_QUEUED 0
+#define EXPORT_DONE 1
+
+struct ExportJob;
+
+typedef struct
+{
+	struct ExportJob *job;
+	uint64_t offset;							// into the partition
+	size_t len;
+	int state;										// EXPORT_xxx, protected by the job's mutex
+	int error;
+	int hole;											// not stored in the image, data was not read
+	int zero;											// reads as zeros
+	char *data;										// EXPORT_CHUNK bytes
+	char *out;										// compressed, or job->zeroMember
+	size_t outLen;
+} ExportChunk;
+
+typedef struct ExportJob
+{
+	Image *image;
+	Partition *partition;
+	int level;										// gzip level or -1 for raw output
+	char *zeroMember;							// a whole chunk of zeros, compressed
+	size_t zeroMemberLen;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;					// signalled when a chunk is done
+} ExportJob;
+
+#ifndef NO_IO_URING
+// A thread's io_uring, see ioRead
+
+typedef struct
+{
+	int fd;
+	unsigned *sqTail;
+	unsigned *sqMask;
+	unsigned *sqArray;
+	unsigned *cqHead;
+	unsigned *cqTail;
+	unsigned *cqMask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sqRing;
+	size_t sqRingSize;
+	void *cqRing;									// sqRing with IORING_FEAT_SINGLE_MMAP
+	size_t cqRingSize;
+	size_t sqesSize;
+} IoRing;
+#endif
+
+FileHandle *statsOpen (void);
+FileHandle *controlOpen (void);
+int controlWrite (const char *data, size_t len);
+FileHandle *allocmapOpen (Image * img, Partition * p);
+uint64_t allocmapSize (Partition * p);
+FileHandle *changemapOpen (Image * img, Partition * p);
+FileHandle *sha256mapOpen (Image * img, Partition * p);
+uint64_t sha256mapSize (Partition * p);
+void sha256mapInvalidate (Image * img, uint64_t offset, size_t len);
+int sidecarLoad (Image * img);
+static int sidecarDiskType (Image * img, int n, char **type);
+static int sidecarVdi (Image * img);
+static void sidecarSave (Image * img);
+void sidecarRemove (Image * img);
+void profileLoad (Image * img);
+void profileRecord (Image * img, uint64_t offset, size_t len);
+void profileSave (Image * img);
+void profileStart (Image * img);
+void *bufferArena (uint64_t size, int prefault, int *pages);
+char *bufferGet (size_t len);
+void bufferPut (char *buf);
+static int partitionTableRead (Image * img, uint64_t offset, void *buf,
+															 size_t len);
+static int diskAllocated (Image * img, uint64_t offset, uint64_t len);
+static int diskZero (Image * img, uint64_t offset, uint64_t len);
+static int isZero (const char *buf, size_t len);
+void cacheForget (Image * img, uint64_t offset, uint64_t len, int zero);
+void readaheadUpdate (FileHandle * fh, uint64_t offset, size_t len);
+
+static const char *partitionSuffix[KIND_MAX] = { "", ".allocmap", ".sha256map", ".changemap" };	// file names per KIND_xxx
 
 // Preparing FUSE features
-static struct fuse_operations fuseOperations = {
+static struct fuse_lowlevel_ops fuseOperations = {
+	.lookup = VD_lookup,
 	.readdir = VD_readdir,
 	.getattr = VD_getattr,
 	.open = VD_open,
 	.release = VD_release,
 	.read = VD_read,
-	.write = VD_write,
+	.write_buf = VD_write_buf,
 	.flush = VD_flush,
+	.fsync = VD_fsync,
+	.fallocate = VD_fallocate,
+	.init = VD_init,
 	.destroy = VD_destroy
 };
 
 static struct fuse_args fuseArgs = FUSE_ARGS_INIT (0, NULL);
 
-static struct stat VDfile_stat;
+static struct option longOptions[] = {
+	{"readers", required_argument, NULL, 'n'},
+	{"cache-size", required_argument, NULL, OPT_CACHE_SIZE},
+	{"cache-block", required_argument, NULL, OPT_CACHE_BLOCK},
+	{"readahead", required_argument, NULL, OPT_READAHEAD},
+	{"write-back", no_argument, NULL, OPT_WRITEBACK},
+	{"writeback-max", required_argument, NULL, OPT_WRITEBACK_MAX},
+	{"writeback-age", required_argument, NULL, OPT_WRITEBACK_AGE},
+	{"no-native", no_argument, NULL, OPT_NO_NATIVE},
+	{"daemon", no_argument, NULL, OPT_DAEMON},
+	{"io-threads", required_argument, NULL, OPT_IO_THREADS},
+	{"io-uring", no_argument, NULL, OPT_IO_URING},
+	{"nbd", required_argument, NULL, OPT_NBD},
+	{"export", required_argument, NULL, OPT_EXPORT},
+	{"output", required_argument, NULL, OPT_OUTPUT},
+	{"compress", optional_argument, NULL, OPT_COMPRESS},
+	{"sidecar", optional_argument, NULL, OPT_SIDECAR},
+	{"profile", optional_argument, NULL, OPT_PROFILE},
+	{"buffer-pool", required_argument, NULL, OPT_BUFFER_POOL},
+	{"inventory", no_argument, NULL, OPT_INVENTORY},
+	{"cache-prefault", no_argument, NULL, OPT_CACHE_PREFAULT},
+	{NULL, 0, NULL, 0}
+};
 
+static Image *images[IMAGES_MAX];	// by slot, NULL once removed
+static int imageCount = 0;
+static unsigned imageIds = 0;
+static pthread_rwlock_t imagesLock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t controlMutex = PTHREAD_MUTEX_INITIALIZER;	// one control command at a time
+static int daemonMode = 0;				// --daemon: every image is a subdirectory
+static struct stat rootStat;			// attributes of the directories in daemon mode
 static int verbose = 0;
 static int readonly = 0;
 static int allowall = 0;				// allow all users to read from disk
@@ -159,9 +1083,94 @@ static int allowallw = 0;				// allow all users to write to disk
 static uid_t myuid = 0;
 static gid_t mygid = 0;
 static char *processName;
-static int entireDiskOpened = 0;
-static int partitionOpened = 0;
-static int opened = 0;					// how many opened instances are there
+static char *diskType = "auto";
+static int native = 1;						// use the native VDI backend where possible
+static char *sidecarDir = NULL;		// --sidecar: where metadata sidecars live, "" next to the image
+static char *profileDir = NULL;		// --profile: where access profiles live, "" next to the image
+static uint64_t profileRecorded = 0;	// bytes of disk added to profiles
+static uint64_t profileReplayed = 0;	// bytes of profiles loaded into the cache
+static int readers = 0;					// size of each image's read pool
+static CacheShard cacheShards[CACHE_SHARDS];
+static CacheFile *cacheFiles = NULL;
+static pthread_mutex_t cacheFilesMutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t cacheSize = 0;	// 0 disables the block cache
+static size_t cacheBlock = CACHE_BLOCK_DEFAULT;
+static int cachePages = BUFFER_PAGES_SMALL;	// of the block cache arena
+static uint64_t bufferPool = BUFFER_POOL_DEFAULT;	// --buffer-pool, 0 = malloc every buffer
+static int cachePrefault = 0;		// --cache-prefault: fault the cache in at startup
+static char *bufferStart = NULL;	// the pool, bufferCount buffers up to bufferEnd
+static char *bufferEnd = NULL;
+static uint64_t bufferCount = 0;
+static int bufferPages = BUFFER_PAGES_SMALL;
+static char *bufferFree = NULL;		// free buffers, linked through their first word
+static pthread_mutex_t bufferMutex = PTHREAD_MUTEX_INITIALIZER;	// protects bufferFree
+static __thread char *bufferStash[BUFFER_STASH];	// this thread's free buffers
+static __thread int bufferStashed = 0;
+static pthread_key_t bufferKey;	// hands the stash back when a thread exits
+static uint64_t bufferUsed = 0;		// pool buffers handed out
+static uint64_t bufferPeak = 0;
+static uint64_t bufferFallbacks = 0;	// buffers that did not come from the pool
+static const char *bufferPageNames[] = { "small", "thp", "hugetlb" };	// by BUFFER_PAGES_xxx
+static uint64_t readaheadMax = READAHEAD_DEFAULT;	// 0 disables readahead
+static uint64_t readaheadJobs = 0;
+static uint64_t readaheadBytes = 0;
+static int readaheadQueued = 0;		// jobs queued or running, at most READAHEAD_QUEUE_MAX
+static uint64_t readaheadSkipped = 0;	// refills put off because the queue was full
+static int ioThreads = IO_THREADS_DEFAULT;	// workers that take pieces of split reads
+static uint64_t splitReads = 0;
+static uint64_t hashBlocks = 0;		// blocks read and hashed for sha256map files
+static uint64_t hashHoles = 0;		// blocks hashed as holes
+static uint64_t hashReused = 0;		// blocks whose hash was still valid
+static uint64_t rangeWaits = 0;		// reads and writes that waited for an overlapping one
+static uint64_t zeroSkipped = 0;	// writes of zeros to unallocated space that were dropped
+static uint64_t discardBytes = 0;	// freed in the image by diskZero
+static int sha256Engine = -1;			// 1 with the SHA extensions, see sha256Blocks
+static uint64_t splitPieces = 0;
+static int ioUring = 0;					// --io-uring
+#ifndef NO_IO_URING
+static int ioUringActive = 0;		// from VD_init until the kernel turns out not to support it
+static __thread IoRing *ioRing = NULL;	// this thread's ring
+static pthread_key_t ioRingKey;	// frees the ring when a thread exits
+#endif
+static uint64_t ioBatches = 0;
+static uint64_t ioRequests = 0;
+static char *nbdSocket = NULL;		// --nbd: serve the partitions over this socket, no FUSE
+static int nbdListenFd = -1;
+static NbdConn *nbdConns = NULL;	// open connections
+static pthread_mutex_t nbdMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t nbdCond = PTHREAD_COND_INITIALIZER;	// signalled when a connection closes
+static char *exportName = NULL;	// --export: stream this partition out, no FUSE
+static char *exportOutput = NULL;	// --output, stdout if NULL
+static int exportLevel = -1;		// --compress: gzip level, -1 for raw output
+static int inventory = 0;				// --inventory: describe the images given as arguments, no FUSE
+static char *spliceZeros = NULL;	// SPLICE_ZERO_MAX zero bytes, set while reads are spliced
+static pthread_mutex_t taskMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t taskCond = PTHREAD_COND_INITIALIZER;
+static Task *taskHead = NULL;
+static Task *taskTail = NULL;
+static int taskThreads = 0;
+static int taskRunning = 0;			// tasks taken off the queue and not finished yet
+static pthread_cond_t taskIdleCond = PTHREAD_COND_INITIALIZER;	// queue empty, nothing running
+static int writeBack = 0;				// keep writes in the cache, see writebackFlush
+static uint64_t writebackMax = 0;	// dirty bytes of all images that trigger a write back
+static int writebackAge = WRITEBACK_AGE_DEFAULT;	// seconds dirty data may stay in memory
+static int writebackDirty = 0;	// dirty cache blocks of all images
+static pthread_mutex_t writebackWakeMutex = PTHREAD_MUTEX_INITIALIZER;	// protects writebackWakes
+static uint64_t writebackWakes = 0;	// times a writer found the budget exceeded
+static int writebackStop = 0;		// tells the write back thread to exit, see backgroundStop
+static pthread_t writebackTid;
+static int writebackStarted = 0;
+static pthread_cond_t writebackCond = PTHREAD_COND_INITIALIZER;
+static const char *traceOpNames[TRACE_OPS] = { "read", "write", "flush", "fsync", "getattr" };
+static TraceHistogram traceGlobal[TRACE_OPS];	// files that belong to no image
+static TraceRing *traceRings = NULL;	// every ring ever created
+static __thread TraceRing *traceRing = NULL;	// this thread's ring
+static __thread uint64_t traceLockNs = 0;	// lock wait of the current operation
+static __thread uint64_t traceBackendNs = 0;	// backend time of the current operation
+static pthread_key_t traceKey;	// hands the ring back when a thread exits
+static pthread_mutex_t traceMutex = PTHREAD_MUTEX_INITIALIZER;	// held while draining
+static uint64_t traceEvents = 0;
+static uint64_t traceDropped = 0;
 
 //
 //====================================================================================================
@@ -171,26 +1180,26 @@ static int opened = 0;					// how many opened instances are there
 int
 main (int argc, char **argv)
 {
-	char *diskType = "auto";
-	char *imagefilename = NULL;
 	char *mountpoint = NULL;
 	int debug = 0;
 	int foreground = 0;
-	char c;
-	int i;
+	int c;
+#ifndef NO_VBOX
+	int rc;
+#endif
+	uint64_t cacheBlockArg = CACHE_BLOCK_DEFAULT;
+	char *imagefilename = NULL;
 	char *differencing[DIFFERENCING_MAX];
 	int differencingLen = 0;
 
 	extern char *optarg;
 	extern int optind, optopt;
-    int rc;
-
 //
 // *** Parse the command line options ***
 //
 	processName = argv[0];
 
-	while ((c = getopt (argc, argv, GETOPT_ARGS)) != -1)
+	while ((c = getopt_long (argc, argv, GETOPT_ARGS, longOptions, NULL)) != -1)
 	{
 		switch (c)
 		{
@@ -221,6 +1230,80 @@ main (int argc, char **argv)
 			case 'f':
 				imagefilename = (char *) optarg;
 				break;
+			case 'n':
+				readers = atoi (optarg);
+				if (readers < 0 || readers > READERS_MAX)
+					usageAndExit ("number of readers must be between 0 and %d",
+												READERS_MAX);
+				break;
+			case OPT_CACHE_SIZE:
+				cacheSize = parseSize (optarg);
+				break;
+			case OPT_BUFFER_POOL:
+				bufferPool = parseSize (optarg);
+				break;
+			case OPT_INVENTORY:
+				inventory = 1;
+				break;
+			case OPT_CACHE_PREFAULT:
+				cachePrefault = 1;
+				break;
+			case OPT_WRITEBACK:
+				writeBack = 1;
+				break;
+			case OPT_NO_NATIVE:
+				native = 0;
+				break;
+			case OPT_DAEMON:
+				daemonMode = 1;
+				break;
+			case OPT_IO_URING:
+				ioUring = 1;
+				break;
+			case OPT_NBD:
+				nbdSocket = (char *) optarg;
+				break;
+			case OPT_EXPORT:
+				exportName = (char *) optarg;
+				break;
+			case OPT_SIDECAR:
+				sidecarDir = optarg ? (char *) optarg : "";
+				break;
+			case OPT_PROFILE:
+				profileDir = optarg ? (char *) optarg : "";
+				break;
+			case OPT_OUTPUT:
+				exportOutput = (char *) optarg;
+				break;
+			case OPT_COMPRESS:
+				exportLevel = optarg ? atoi (optarg) : EXPORT_LEVEL_DEFAULT;
+				if (exportLevel < 1 || exportLevel > 9)
+					usageAndExit ("compression level must be between 1 and 9");
+				break;
+			case OPT_IO_THREADS:
+				ioThreads = atoi (optarg);
+				if (ioThreads < 0 || ioThreads > IO_THREADS_MAX)
+					usageAndExit ("number of I/O threads must be between 0 and %d",
+												IO_THREADS_MAX);
+				break;
+			case OPT_WRITEBACK_MAX:
+				writebackMax = parseSize (optarg);
+				break;
+			case OPT_WRITEBACK_AGE:
+				writebackAge = atoi (optarg);
+				if (writebackAge < 1)
+					usageAndExit ("write back age must be at least one second");
+				break;
+			case OPT_READAHEAD:
+				readaheadMax = parseSize (optarg);
+				break;
+			case OPT_CACHE_BLOCK:
+				cacheBlockArg = parseSize (optarg);
+				if (cacheBlockArg < BLOCKSIZE || cacheBlockArg > CACHE_BLOCK_MAX
+						|| (cacheBlockArg & (cacheBlockArg - 1)) != 0)
+					usageAndExit ("cache block must be a power of two between %d and %d",
+												BLOCKSIZE, CACHE_BLOCK_MAX);
+				break;
 			case 'd':
 				foreground = 1;
 				debug = 1;
@@ -234,35 +1317,72 @@ main (int argc, char **argv)
 //
 // *** Validate the command line ***
 //
-	if (argc != optind + 1)
+	if (nbdSocket || exportName || inventory)
+	{
+		const char *mode = nbdSocket ? "--nbd" : exportName ? "--export" : "--inventory";
+		if (!!nbdSocket + !!exportName + inventory > 1)
+			usageAndExit ("--nbd, --export and --inventory cannot be combined");
+		if (argc != optind && !inventory)
+			usageAndExit ("%s does not take a mountpoint", mode);
+		if (daemonMode)
+			usageAndExit ("%s cannot be combined with --daemon", mode);
+	}
+	else if (argc != optind + 1)
 		usageAndExit ("a single mountpoint must be specified");
-	mountpoint = argv[optind];
-	if (!mountpoint)
+	else if (!(mountpoint = argv[optind]))
 		usageAndExit ("no mountpoint specified");
-	if (!imagefilename)
+	if (inventory && (imagefilename || differencingLen))
+		usageAndExit ("--inventory takes the image files as arguments, not -f or -s");
+	if (inventory && strcmp (diskType, "auto") != 0)
+		usageAndExit ("--inventory detects the type of every image, -t cannot be used");
+	if (inventory && (cacheSize || sidecarDir || profileDir))
+		usageAndExit ("--inventory cannot be used with --cache-size, --sidecar or --profile");
+	if (inventory && verbose && !exportOutput)
+		usageAndExit ("-v would mix with the inventory on stdout, use --output");
+	if (!imagefilename && !daemonMode && !inventory)
 		usageAndExit ("no image chosen");
-	if (stat (imagefilename, &VDfile_stat) < 0)
-		usageAndExit ("cannot access imagefile");
-	if (access (imagefilename, F_OK | R_OK | ((!readonly) ? W_OK : 0)) < 0)
-		usageAndExit ("cannot access imagefile");
-	for (i = 0; i < differencingLen; i++)
-		if (access (differencing[i], F_OK | R_OK | ((readonly) ? 0 : W_OK)) < 0)
-			usageAndExit ("cannot access differencing imagefile %s",
-										differencing[i]);
+	if (differencingLen && !imagefilename)
+		usageAndExit ("snapshots (-s) need an image (-f)");
+	if (exportOutput && !exportName && !inventory)
+		usageAndExit ("--output needs --export or --inventory");
+	if (exportLevel >= 0 && !exportName)
+		usageAndExit ("--compress needs --export");
+	if (exportName && writeBack)
+		usageAndExit ("--write-back cannot be used with --export");
+	if (exportName && !exportOutput && isatty (STDOUT_FILENO))
+		usageAndExit ("refusing to write the export to a terminal");
+	if (exportName || inventory)
+		readonly = 1;								// exports never write, and read VDI natively
+	if (readers && !readonly)
+		usageAndExit ("parallel readers (-n) require a readonly (-r) mount");
+	if (writeBack && readonly)
+		usageAndExit ("--write-back cannot be used on a readonly (-r) mount");
+	if (writeBack && !cacheSize)
+		cacheSize = WRITEBACK_CACHE_DEFAULT;
+	if (profileDir && exportName)
+		usageAndExit ("--profile cannot be used with --export");
+	if (profileDir && !cacheSize)
+		usageAndExit ("--profile needs a block cache (--cache-size)");
+#ifdef NO_IO_URING
+	if (ioUring)
+		usageAndExit ("built without io_uring support");
+#endif
+#ifdef NO_ZLIB
+	if (exportLevel >= 0)
+		usageAndExit ("built without zlib support");
+#endif
 
 #define IS_TYPE(s) (strcmp (s, diskType) == 0)
 	if (!
 			(IS_TYPE ("auto") || IS_TYPE ("VDI") || IS_TYPE ("VMDK")
 			 || IS_TYPE ("VHD") || IS_TYPE ("auto")))
 		usageAndExit ("invalid disk type specified");
-	if (strcmp ("auto", diskType) == 0
-			&& detectDiskType (&diskType, imagefilename) < 0)
-		return 1;
 
 //
 // *** Open the VDI, parse the MBR + EBRs and connect to the fuse service ***
 //
 
+#ifndef NO_VBOX
     vdInterfaceError.pfnError = vdErrorCallback;
 	rc = VDInterfaceAdd (&vdInterfaceError.Core, "VD Error", VDINTERFACETYPE_ERROR,
 																	NULL, 0, &pVDifs);
@@ -271,36 +1391,68 @@ main (int argc, char **argv)
     {
         usageAndExit ("invalid initialisation of VD interface");
     }
+#endif
 
-    rc = VDCreate(&vdError, VDTYPE_HDD, &hdDisk);
-    if (RT_FAILURE(rc))
-    {
-        usageAndExit ("invalid initialisation of VD interface");
-    }
+	if (inventory)
+		return inventoryRun (argv + optind, argc - optind, exportOutput) != 0;
+
+	if (cacheSize)
+		cacheInit (cacheSize, cacheBlockArg);
+	else
+		readaheadMax = 0;						// readahead fills the block cache
+	bufferInit (bufferPool);
 
-    vbprintf ("Opening base image %s", imagefilename);
-	DISKopen (diskType, imagefilename);
+// Dirty blocks cannot be evicted, so keep enough of the cache clean for reads
 
-	for (i = 0; i < differencingLen; i++)
+	if (writeBack)
 	{
-		char *diffType;
-		char *diffFilename = differencing[i];
-		detectDiskType (&diffType, diffFilename);
-        vbprintf ("Opening Snapshot %s", diffFilename);
-		DISKopen (diffType, diffFilename);
+		if (!writebackMax || writebackMax > cacheSize / 2)
+			writebackMax = writebackMax ? cacheSize / 2 : cacheSize / 4;
+		vbprintf ("write back: up to %llu dirty bytes for %d seconds",
+							(unsigned long long) writebackMax, writebackAge);
 	}
 
-	initialisePartitionTable ();
+// In daemon mode an image given with -f is the first subdirectory, named after
+// the file without its extension
+
+	if (imagefilename)
+	{
+		char name[IMAGE_NAME_MAX + 1] = "";
+		const char *error;
+		Image *img;
+
+		if (daemonMode)
+		{
+			const char *base = strrchr (imagefilename, '/');
+			snprintf (name, sizeof (name), "%s", base ? base + 1 : imagefilename);
+			if (strrchr (name, '.') && strrchr (name, '.') != name)
+				*strrchr (name, '.') = 0;
+		}
+		if (!(img = imageOpen (name, imagefilename, differencing, differencingLen,
+													 &error)))
+			usageAndExit ("%s", error);
+		if (imageAdd (img) < 0)
+			usageAndExit ("invalid image name %s", name);
+	}
 
 	myuid = geteuid ();
 	mygid = getegid ();
+	rootStat.st_uid = myuid;
+	rootStat.st_gid = mygid;
+	rootStat.st_atime = rootStat.st_mtime = rootStat.st_ctime = time (NULL);
+
+	if (nbdSocket)
+		return nbdServe (nbdSocket, foreground) < 0;
+	if (exportName)
+		return exportStream (exportName, exportOutput) < 0;
 
 	fuse_opt_add_arg (&fuseArgs, "vdfuse");
 
 	{
-		char fsname[strlen (imagefilename) + 12];
+		const char *source = imagefilename ? imagefilename : "vdfuse";
+		char fsname[strlen (source) + 12];
 		strcpy (fsname, "-ofsname=\0");
-		strcat (fsname, imagefilename);
+		strcat (fsname, source);
 		fuse_opt_add_arg (&fuseArgs, fsname);
 	}
 
@@ -313,11 +1465,37 @@ main (int argc, char **argv)
 		fuse_opt_add_arg (&fuseArgs, "-d");
 	fuse_opt_add_arg (&fuseArgs, mountpoint);
 
-	return fuse_main (fuseArgs.argc, fuseArgs.argv, &fuseOperations
-#if FUSE_USE_VERSION >= 26
-										, NULL
-#endif
-		);
+// fuse_main is only available for the high level API, so mount and run the
+// session loop by hand.  VD_init runs from the loop, i.e. after daemonising.
+
+	{
+		struct fuse_chan *ch;
+		struct fuse_session *se;
+		char *mnt;
+		int multithreaded, fg, err = -1;
+
+		if (fuse_parse_cmdline (&fuseArgs, &mnt, &multithreaded, &fg) < 0
+				|| !(ch = fuse_mount (mnt, &fuseArgs)))
+			return 1;
+		se = fuse_lowlevel_new (&fuseArgs, &fuseOperations,
+														sizeof (fuseOperations), NULL);
+		if (se)
+		{
+			if (fuse_set_signal_handlers (se) == 0)
+			{
+				fuse_session_add_chan (se, ch);
+				if (fuse_daemonize (fg) == 0)
+					err = multithreaded ? fuse_session_loop_mt (se)
+						: fuse_session_loop (se);
+				fuse_remove_signal_handlers (se);
+				fuse_session_remove_chan (ch);
+			}
+			fuse_session_destroy (se);
+		}
+		fuse_unmount (mnt, ch);
+		fuse_opt_free_args (&fuseArgs);
+		return err ? 1 : 0;
+	}
 }
 
 //====================================================================================================
@@ -349,12 +1527,45 @@ usageAndExit (char *optFormat, ...)
 					 "underlying file systems\n"
                      "Version: %s\n\n"
 					 "USAGE: %s [options] -f image-file mountpoint\n"
+					 "       %s [options] --daemon [-f image-file] mountpoint\n"
+					 "       %s [options] --nbd=SOCKET -f image-file\n"
+					 "       %s [options] --export=PARTITION [--output=FILE] -f image-file\n"
+					 "       %s [options] --inventory [--output=FILE] [image-file...]\n"
 					 "\t-h\thelp\n" "\t-r\treadonly\n"
 #ifndef OLDAPI
 					 "\t-t\tspecify type (VDI, VMDK, VHD, or raw; default: auto)\n"
 #endif
 					 "\t-f\tVDimage file\n"
                      "\t-s\tSnapshot file(s) to load on top of the image file\n"
+					 "\t-n\tnumber of parallel read-only handles (--readers, needs -r)\n"
+					 "\t--cache-size=SIZE\tsize of the in-memory block cache (e.g. 2G)\n"
+					 "\t--cache-block=SIZE\tcache block size (default 64k)\n"
+					 "\t--cache-prefault\tfault the whole cache in at startup\n"
+					 "\t--buffer-pool=SIZE\tmemory for I/O buffers, allocated at startup\n"
+					 "\t\t\t(default 64M, 0 = allocate them per request)\n"
+					 "\t--readahead=SIZE\tmaximum sequential readahead window (default 2M, 0 = off)\n"
+					 "\t--no-native\tread VDI images through VBoxDDU even when readonly\n"
+					 "\t--io-threads=N\tworkers that read pieces of large reads in parallel\n"
+					 "\t\t\t(default 4, 0 = off)\n"
+					 "\t--io-uring\tread native VDI images through io_uring\n"
+					 "\t--sidecar[=DIR]\tkeep the image metadata in a sidecar next to the top\n"
+					 "\t\t\timage (or in DIR) to skip the scan on the next mount\n"
+					 "\t--profile[=DIR]\trecord what is read next to the top image (or in\n"
+					 "\t\t\tDIR) and prefetch it into the cache on the next mount\n"
+					 "\t--daemon\tserve many images, one subdirectory each, added and\n"
+					 "\t\t\tremoved through .vdfuse/control (-f is optional)\n"
+					 "\t--nbd=SOCKET\tserve EntireDisk and the partitions as NBD exports on\n"
+					 "\t\t\ta Unix socket instead of mounting\n"
+					 "\t--export=PARTITION\tcopy EntireDisk or a partition to --output or\n"
+					 "\t\t\tstdout instead of mounting, holes stay sparse\n"
+					 "\t--output=FILE\tfile to --export to (default stdout)\n"
+					 "\t--inventory\tdescribe each image file as a JSON line: type, size,\n"
+					 "\t\t\tparent and partitions (files from stdin if none given,\n"
+					 "\t\t\t--io-threads at a time)\n"
+					 "\t--compress[=LEVEL]\tgzip the --export (level 1-9, default 6)\n"
+					 "\t--write-back\tcollect writes in the cache, write them out on fsync or\n"
+					 "\t\t\tafter --writeback-age seconds (default 5) or once\n"
+					 "\t\t\t--writeback-max bytes are dirty (default cache-size/4)\n"
 //        "\t-s\tdifferencing disk files\n"    // prevent misuse
 					 "\t-a\tallow all users to read disk\n"
 					 "\t-w\tallow all users to read and write to disk\n"
@@ -363,7 +1574,8 @@ usageAndExit (char *optFormat, ...)
 					 "\t-d\tdebug\n\n"
 					 "NOTE: you must add the line \"user_allow_other\" (without quotes)\n"
 					 "to /etc/fuse.confand set proper permissions on /etc/fuse.conf\n"
-					 "for this to work.\n", VERSION, processName);
+					 "for this to work.\n", VERSION, processName, processName, processName, processName,
+					 processName);
 	exit (1);
 }
 
@@ -414,96 +1626,104 @@ vdErrorCallback (void *pvUser UNUSED, int rc, const char *file,
  * ====================================================================================================
  *
  * This code is algorithmically based on partRead in VBoxInternalManage.cpp plus the Wikipedia articles
- * on MBR and EBR. As in partRead, a statically allocated partition list is used same  to keep things
+ * on MBR and EBR. As in partRead, a fixed size partition list is used same  to keep things
  * simple (but up to a max 100 partitions :lol:).  Note than unlike partRead, this doesn't resort the
  * partitions.
  * 
  * int VDRead(PVBOXHDD pDisk, uint64_t uOffset, void *pvBuf, size_t cbRead, int ii );
 */
 
-void
-initialisePartitionTable (void)
+/**
+ * Parse the MBR and the EBR chain into a partition table.  Every descriptor
+ * sector is recorded in the table before it is read, so a table that could only
+ * be parsed in part still knows which sector to watch for a fix.
+ * @param t out: Partition table, holding what could be parsed on error
+ * @return NULL or an error message
+ */
+static const char *
+parsePartitionTable (Image * img, PartitionTable * t)
 {
-//uint16_t MBRsignature;
+	static char message[80];
 	int entendedFlag = UNALLOCATED;
 	int i;
 	MBRblock mbrb;
 
-	memset (partitionTable, 0, sizeof (partitionTable));
-	for (i = 0; i <= (signed) (sizeof (partitionTable) / sizeof (Partition));
-			 i++)
-		partitionTable[i].no = UNALLOCATED;
-
-	partitionTable[0].no = 0;
-	partitionTable[0].offset = 0;
-	partitionTable[0].size = DISKsize;
-	strcpy (partitionTable[0].name, "EntireDisk");
+	t->partition[0].no = 0;
+	t->partition[0].offset = 0;
+	t->partition[0].size = DISKsize (img);
+	strcpy (t->partition[0].name, "EntireDisk");
 //
 // Check that this is unformated or a DOS partitioned disk.  Sorry but other formats not supported.
 //
-	DISKread (0, &mbrb, sizeof (mbrb));
+	t->sector[t->sectors++] = 0;
+	if (RT_FAILURE (partitionTableRead (img, 0, &mbrb, sizeof (mbrb))))
+		return "Cannot read the MBR";
 	if (mbrb.signature == 0x0000)
-		return;											// an unformated disk is allowed but only EntireDisk is defined
+		return NULL;								// an unformated disk is allowed but only EntireDisk is defined
 	if (mbrb.signature != 0xaa55)
-		usageAndExit ("Invalid MBR found on image with signature 0x%04hX",
-									mbrb.signature);
+	{
+		snprintf (message, sizeof (message),
+							"Invalid MBR found on image with signature 0x%04hX",
+							mbrb.signature);
+		return message;
+	}
 
 //
 // Process the four physical partition entires in the MBR
 //
 	for (i = 1; i <= 4; i++)
 	{
-		Partition *p = partitionTable + i;
-//    MBRentry  *m = &(p->descriptor);
-	//DISKread (MBR_START + (i-1) * sizeof(MBRentry), &(p->descriptor), sizeof(MBRentry));
+		Partition *p = t->partition + i;
 		memcpy (&(p->descriptor), &mbrb.descriptor[i - 1], sizeof (MBRentry));
 		if ((p->descriptor).type == 0)
 			continue;
 		if (PARTTYPE_IS_EXTENDED ((p->descriptor).type))
 		{
 			if (entendedFlag != UNALLOCATED)
-				usageAndExit ("More than one extended partition in MBR");
+				return "More than one extended partition in MBR";
 			entendedFlag = i;
 		}
 		else
 		{
-			lastPartition = i;
+			t->last = i;
 			p->no = i;
 			p->offset = (off_t) ((p->descriptor).offset) * BLOCKSIZE;
 			p->size = (off_t) ((p->descriptor).size) * BLOCKSIZE;
 		}
 	}
 //
-// Now chain down any EBRs to process the logical partition entries
+// Now chain down any EBRs to process the logical partition entries.  Each EBR
+// describes its logical partition relative to itself, and the next EBR relative
+// to the start of the extended partition, both in sectors.
 //
 	if (entendedFlag != UNALLOCATED)
 	{
 		EBRentry ebr;
 		off_t uStart =
-			(off_t) ((partitionTable[entendedFlag].descriptor).offset) * BLOCKSIZE;
+			(off_t) ((t->partition[entendedFlag].descriptor).offset) * BLOCKSIZE;
 		off_t uOffset = 0;
 
 		if (!uStart)
-			usageAndExit ("Inconsistency for logical partition start. Aborting\n");
+			return "Inconsistency for logical partition start";
 
 		for (i = 5; i <= HOSTPARTITION_MAX; i++)
 		{
-			lastPartition++;
-			Partition *p = partitionTable + i;
+			Partition *p = t->partition + i;
 
-			DISKread (uStart + uOffset + EBR_START, &ebr, sizeof (ebr));
+			t->sector[t->sectors++] = uStart + uOffset;
+			if (RT_FAILURE (partitionTableRead (img, uStart + uOffset, &ebr, sizeof (ebr))))
+				return "Cannot read an EBR";
 
 			if (ebr.signature != 0xaa55)
-				usageAndExit ("Invalid EBR signature found on image");
+				return "Invalid EBR signature found on image";
 			if ((ebr.descriptor).type == 0)
-				usageAndExit ("Logical partition with type 0 encountered");
+				return "Logical partition with type 0 encountered";
 			if (!((ebr.descriptor).offset))
-				usageAndExit
-					("Logical partition invalid partition start offset encountered");
+				return "Logical partition invalid partition start offset encountered";
 
 			p->descriptor = ebr.descriptor;
 			p->no = i;
-			lastPartition = i;
+			t->last = i;
 			p->offset =
 				uStart + uOffset + (off_t) ((ebr.descriptor).offset) * BLOCKSIZE;
 			p->size = (off_t) ((ebr.descriptor).size) * BLOCKSIZE;
@@ -511,18 +1731,38 @@ initialisePartitionTable (void)
 			if (ebr.chain.type == 0)
 				break;
 			if (!PARTTYPE_IS_EXTENDED (ebr.chain.type))
-				usageAndExit ("Logical partition chain broken");
-			uOffset = (ebr.chain).offset;
+				return "Logical partition chain broken";
+			uOffset = (off_t) ((ebr.chain).offset) * BLOCKSIZE;
 		}
 	}
+	return NULL;
+}
+
+/**
+ * Build a new partition table from the disk
+ * @param img Image
+ * @param error out: NULL or the reason the table is incomplete
+ * @return the table or NULL if out of memory
+ */
+static PartitionTable *
+readPartitionTable (Image * img, const char **error)
+{
+	PartitionTable *t = calloc (1, sizeof (PartitionTable));
+	int i;
+
+	if (!t)
+		return NULL;
+	for (i = 0; i <= HOSTPARTITION_MAX; i++)
+		t->partition[i].no = UNALLOCATED;
+	*error = parsePartitionTable (img, t);
 //
 // Now print out the partition table
 //
 	vbprintf ("Partition       Size           Offset\n"
 						"=========       ====           ======\n");
-	for (i = 1; i <= lastPartition; i++)
+	for (i = 1; i <= t->last; i++)
 	{
-		Partition *p = partitionTable + i;
+		Partition *p = t->partition + i;
 		if (p->no != UNALLOCATED)
 		{
 			sprintf (p->name, "Partition%d", i);
@@ -530,110 +1770,6944 @@ initialisePartitionTable (void)
 		}
 	}
 	vbprintf ("\n");
+	return t;
 }
 
 /**
- * Find a partition by name
- * @param filename The name of the partition to search for
- * @return -1 on error, the partition id else
+ * Check that every partition of a table lies on a disk of the given size
+ * @param t Partition table
+ * @param size Disk size in bytes
+ * @return 1 if it does
  */
-int
-findPartition (const char *filename)
+static int
+partitionsFit (PartitionTable * t, uint64_t size)
 {
-// Use a dumb serial search since there are typically less than 3 entries
+	Partition *p;
 	int i;
-	register Partition *p = partitionTable;
-	for (i = 0; i <= lastPartition; i++, p++)
+
+	for (i = 0; i <= t->last; i++)
 	{
-		if (p->no != UNALLOCATED && strcmp (filename + 1, p->name) == 0)
-			return i;
+		p = t->partition + i;
+		if (p->no != UNALLOCATED && (p->offset < 0 || p->size > size
+																 || (uint64_t) p->offset > size - p->size))
+			return 0;
 	}
-	return -1;
+	return 1;
 }
 
-/** detects type of virtual image
- *
- * @param disktype Out: Type of the disk
- * @param filename VM Disk to test for disk type
+/**
+ * Read the partition table when an image is opened.  Unlike a rescan, any error
+ * keeps the image from being mounted.
+ * @param img Image
+ * @return NULL or an error message
  */
-int
-detectDiskType (char **disktype, char *filename)
+const char *
+initialisePartitionTable (Image * img)
 {
-	char buf[8];
-	int fd = open (filename, O_RDONLY);
-	read (fd, buf, sizeof (buf));
+	const char *error = NULL;
+	PartitionTable *t;
 
-	if (strncmp (buf, "conectix", 8) == 0)
-		*disktype = "VHD";
-	else if (strncmp (buf, "VMDK", 4) == 0)
-		*disktype = "VMDK";
+	if (img->sidecar && (void *) img->sidecar != img->vdi.indexMap
+			&& !partitionsFit (SIDECAR_TABLE (img->sidecar), DISKsize (img)))
+	{
+		vbprintf ("the sidecar's partitions do not fit on the disk, rescanning");
+		munmap (img->sidecar, img->sidecarSize);
+		img->sidecar = NULL;
+	}
+	if (img->sidecar)
+	{
+		if ((t = malloc (sizeof (PartitionTable))))
+		{
+			memcpy (t, SIDECAR_TABLE (img->sidecar), sizeof (PartitionTable));
+			t->refs = 0;
+			t->retired = NULL;
+		}
+		vbprintf ("partition table loaded from the sidecar");
+	}
+	else
+		t = readPartitionTable (img, &error);
+	if (!t)
+		return "cannot allocate the partition table";
+	if (error)
+	{
+		free (t);
+		return error;
+	}
+	__atomic_store_n (&img->partitions, t, __ATOMIC_SEQ_CST);
+	return NULL;
+}
+
+/**
+ * Free the retired partition tables that nobody can reach any more.  Nothing is
+ * freed while a thread is between partitionsEnter and partitionsExit, since it
+ * may have loaded a table just before it was retired.  A thread that enters
+ * later sees the current table, which is never freed here.
+ * @param img Image, with partMutex held
+ */
+static void
+partitionsReclaim (Image * img)
+{
+	PartitionTable **link, *t;
+
+	if (__atomic_load_n (&img->partReaders, __ATOMIC_SEQ_CST))
+		return;
+	for (link = &img->partitions->retired; (t = *link);)
+		if (__atomic_load_n (&t->refs, __ATOMIC_SEQ_CST) == 0)
+		{
+			*link = t->retired;
+			free (t);
+			__atomic_sub_fetch (&img->partRetired, 1, __ATOMIC_RELAXED);
+		}
+		else
+			link = &t->retired;
+}
+
+/**
+ * Start looking at the partition table.  The table and its partitions stay valid
+ * until partitionsExit.
+ * @param img Image
+ * @return the current table
+ */
+static PartitionTable *
+partitionsEnter (Image * img)
+{
+	__atomic_add_fetch (&img->partReaders, 1, __ATOMIC_SEQ_CST);
+	return PARTITIONS (img);
+}
+
+/**
+ * Done looking at the partition table, see partitionsEnter
+ * @param img Image
+ */
+static void
+partitionsExit (Image * img)
+{
+	if (__atomic_sub_fetch (&img->partReaders, 1, __ATOMIC_SEQ_CST) == 0
+			&& __atomic_load_n (&img->partRetired, __ATOMIC_RELAXED)
+			&& pthread_mutex_trylock (&img->partMutex) == 0)
+	{
+		partitionsReclaim (img);
+		pthread_mutex_unlock (&img->partMutex);
+	}
+}
+
+/**
+ * Keep a table beyond partitionsExit, for an open handle or an NBD export.  Call
+ * it before partitionsExit.
+ * @param t Table returned by partitionsEnter
+ */
+static void
+partitionsHold (PartitionTable * t)
+{
+	__atomic_add_fetch (&t->refs, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Drop a reference taken with partitionsHold
+ * @param img Image
+ * @param t Table
+ */
+static void
+partitionsDrop (Image * img, PartitionTable * t)
+{
+	if (__atomic_sub_fetch (&t->refs, 1, __ATOMIC_SEQ_CST) == 0
+			&& __atomic_load_n (&img->partRetired, __ATOMIC_RELAXED))
+	{
+		pthread_mutex_lock (&img->partMutex);
+		partitionsReclaim (img);
+		pthread_mutex_unlock (&img->partMutex);
+	}
+}
+
+/**
+ * Publish a fresh partition table after the MBR or an EBR was written.  A
+ * partitioning tool may be halfway through its writes, so a table that does not
+ * parse completely is published with the partitions found so far.  The old
+ * table stays valid for everybody who still uses it, and is freed by
+ * partitionsReclaim once they are done.
+ */
+void
+rescanPartitionTable (Image * img)
+{
+	const char *error;
+	PartitionTable *t;
+
+	pthread_mutex_lock (&img->partMutex);
+	vbprintf ("partition table changed, rescanning");
+	if ((t = readPartitionTable (img, &error)))
+	{
+		if (error)
+			fprintf (stderr, "vdfuse: %s, using the partitions found so far\n", error);
+		t->retired = img->partitions;
+		__atomic_store_n (&img->partitions, t, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch (&img->partRetired, 1, __ATOMIC_RELAXED);
+		partitionsReclaim (img);
+	}
+	pthread_mutex_unlock (&img->partMutex);
+}
+
+/**
+ * Check whether a range of the disk overlaps the MBR or one of the EBRs
+ * @param img Image
+ * @param offset Absolute disk offset
+ * @param len Length of the range
+ * @return 1 if a descriptor sector was touched, 0 else
+ */
+int
+partitionDescriptorTouched (Image * img, uint64_t offset, size_t len)
+{
+	PartitionTable *t = partitionsEnter (img);
+	int i, touched = 0;
+
+	for (i = 0; i < t->sectors && !touched; i++)
+		if (offset < (uint64_t) t->sector[i] + BLOCKSIZE
+				&& offset + len > (uint64_t) t->sector[i])
+			touched = 1;
+	partitionsExit (img);
+	return touched;
+}
+
+/**
+ * Read for the partition scan, through the block cache if there is one so that
+ * descriptors still held back by write back are seen
+ * @param img Image
+ * @param offset Offset into the disk in bytes
+ * @param buf out: Data read
+ * @param len Number of bytes to read
+ * @return VBox status code
+ */
+static int
+partitionTableRead (Image * img, uint64_t offset, void *buf, size_t len)
+{
+	return cacheSize ? cacheRead (img, offset, buf, len)
+		: poolRead (img, offset, buf, len);
+}
+
+/**
+ * Find a partition by name
+ * @param t Partition table
+ * @param filename The name of the partition to search for, without a path
+ * @return -1 on error, the partition id else
+ */
+int
+findPartition (PartitionTable * t, const char *filename)
+{
+// Use a dumb serial search since there are typically less than 3 entries
+	int i;
+	register Partition *p = t->partition;
+	for (i = 0; i <= t->last; i++, p++)
+	{
+		if (p->no != UNALLOCATED && strcmp (filename, p->name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/** detects type of virtual image
+ *
+ * @param disktype Out: Type of the disk
+ * @param filename VM Disk to test for disk type
+ * @return 0 or -1 if the type is unknown
+ */
+int
+detectDiskType (char **disktype, char *filename)
+{
+	char buf[8] = "";
+	int fd = open (filename, O_RDONLY);
+
+	if (fd >= 0)
+	{
+		if (read (fd, buf, sizeof (buf)) < 0)
+			buf[0] = 0;
+		close (fd);
+	}
+	if (strncmp (buf, "conectix", 8) == 0)
+		*disktype = "VHD";
+	else if (strncmp (buf, "VMDK", 4) == 0)
+		*disktype = "VMDK";
 	else if (strncmp (buf, "KDMV", 4) == 0)
 		*disktype = "VMDK";
 	else if (strncmp (buf, "<<<", 3) == 0)
 		*disktype = "VDI";
 	else
-		usageAndExit ("cannot autodetect disk type of %s", filename);
+		return -1;
+
+	vbprintf ("disktype is %s", *disktype);
+	return 0;
+}
+
+//====================================================================================================
+//                                          VBoxDDU backend
+//====================================================================================================
+
+#ifndef NO_VBOX
+static int
+vboxRead (Image * img, uint64_t offset, void *buf, size_t len)
+{
+	return VDRead (img->hdDisk, offset, buf, len);
+}
+
+static int
+vboxWrite (Image * img, uint64_t offset, const void *buf, size_t len)
+{
+	return VDWrite (img->hdDisk, offset, buf, len);
+}
+
+static int
+vboxFlush (Image * img)
+{
+	return VDFlush (img->hdDisk);
+}
+
+static uint64_t
+vboxSize (Image * img)
+{
+	return VDGetSize (img->hdDisk, 0);
+}
+
+static void
+vboxClose (Image * img)
+{
+	int i;
+	VDDestroy (img->hdDisk);
+	for (i = 0; i < img->readPoolSize; i++)
+	{
+		VDDestroy (img->readPool[i].disk);
+		pthread_mutex_destroy (&img->readPool[i].mutex);
+	}
+}
+
+static DiskBackend vboxBackend = {
+	.name = "VBoxDDU",
+	.read = vboxRead,
+	.write = vboxWrite,
+	.flush = vboxFlush,
+	.size = vboxSize,
+	.close = vboxClose,
+	.concurrent = 0
+};
+
+/**
+ * Create a VD container and open the base image plus all snapshots on top of it
+ * @param img Image
+ * @param disk Out: the new container
+ * @param flags VD_OPEN_FLAGS_* used for every image in the chain
+ * @return 0 or -1 if an image cannot be opened
+ */
+int
+openDiskChain (Image * img, PVBOXHDD * disk, unsigned flags)
+{
+	int i;
+
+	if (RT_FAILURE (VDCreate (&vdError, VDTYPE_HDD, disk)))
+		return -1;
+
+	vbprintf ("Opening base image %s", img->filename);
+	if (RT_FAILURE (VDOpen (*disk, img->diskType, img->filename, flags, NULL)))
+	{
+		VDDestroy (*disk);
+		return -1;
+	}
+
+	for (i = 0; i < img->differencingLen; i++)
+	{
+		vbprintf ("Opening Snapshot %s", img->differencing[i]);
+		if (RT_FAILURE (VDOpen (*disk, img->differencingType[i], img->differencing[i],
+														flags, NULL)))
+		{
+			VDDestroy (*disk);
+			return -1;
+		}
+	}
+	return 0;
+}
+#endif
+
+/**
+ * Read from the disk, spreading concurrent callers over the read pool
+ * @param img Image
+ * @param offset Offset into the disk in bytes
+ * @param buf out: Data read
+ * @param len Number of bytes to read
+ * @return VBox status code
+ */
+int
+poolRead (Image * img, uint64_t offset, void *buf, size_t len)
+{
+	int ret;
+
+	if (img->backend->concurrent)
+		return DISKread (img, offset, buf, len);
+
+#ifndef NO_VBOX
+	if (img->readPoolSize)
+	{
+		int size = img->readPoolSize;
+		int i, n = 0;
+
+// The hint is per thread, not per image; it only has to spread the threads out
+
+		if (readPoolHint < 0)
+			readPoolHint = __sync_fetch_and_add (&img->readPoolNext, 1);
+
+		for (i = 0; i < size; i++)
+		{
+			n = (readPoolHint + i) % size;
+			if (pthread_mutex_trylock (&img->readPool[n].mutex) == 0)
+				break;
+		}
+		if (i == size)
+		{
+			n = readPoolHint % size;
+			traceLock (&img->readPool[n].mutex);
+		}
+		readPoolHint = n;
+
+		ret = TRACE_BACKEND (VDRead (img->readPool[n].disk, offset, buf, len));
+		pthread_mutex_unlock (&img->readPool[n].mutex);
+		return ret;
+	}
+#endif
+
+	traceLock (&img->diskMutex);
+	ret = DISKread (img, offset, buf, len);
+	pthread_mutex_unlock (&img->diskMutex);
+	return ret;
+}
+
+//====================================================================================================
+//                                          Backing file I/O
+//====================================================================================================
+//
+// The native VDI reader turns a read into extents of its layer files, which
+// ioRead fills in.  With --io-uring every thread sets up its own ring the first
+// time it reads and submits all extents of a read with one system call, so a
+// read over scattered blocks has all of them in flight at once.  Otherwise, and
+// if the kernel turns out to lack io_uring, each extent is a pread.
+
+/**
+ * Read one extent with pread
+ * @param ext Extent, not a hole
+ * @param buf out: Data read
+ * @return 0 or -1 on error
+ */
+static int
+ioPread (const DiskExtent * ext, char *buf)
+{
+	return (pread (ext->fd, buf, ext->len, ext->pos) == (ssize_t) ext->len) ? 0 : -1;
+}
+
+#ifndef NO_IO_URING
+/**
+ * Unmap and close a ring
+ * @param arg IoRing
+ */
+static void
+ioRingFree (void *arg)
+{
+	IoRing *r = arg;
+
+	if (r->sqes)
+		munmap (r->sqes, r->sqesSize);
+	if (r->cqRing && r->cqRing != r->sqRing)
+		munmap (r->cqRing, r->cqRingSize);
+	if (r->sqRing)
+		munmap (r->sqRing, r->sqRingSize);
+	close (r->fd);
+	free (r);
+}
+
+/**
+ * Map a region of a ring
+ * @return address or NULL
+ */
+static void *
+ioRingMap (int fd, size_t size, off_t offset)
+{
+	void *p = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+									fd, offset);
+	return (p == MAP_FAILED) ? NULL : p;
+}
+
+/**
+ * @return the ring of this thread, or NULL if none can be set up
+ */
+static IoRing *
+ioRingGet (void)
+{
+	struct io_uring_params p;
+	IoRing *r;
+	char *sq, *cq;
+
+	if (ioRing)
+		return ioRing;
+	if (!(r = calloc (1, sizeof (IoRing))))
+		return NULL;
+	memset (&p, 0, sizeof (p));
+	if ((r->fd = syscall (__NR_io_uring_setup, IO_BATCH_MAX, &p)) < 0)
+	{
+		free (r);
+		return NULL;
+	}
+	r->sqRingSize = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	r->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) && r->cqRingSize > r->sqRingSize)
+		r->sqRingSize = r->cqRingSize;
+	r->sqesSize = p.sq_entries * sizeof (struct io_uring_sqe);
+	if (!(r->sqRing = ioRingMap (r->fd, r->sqRingSize, IORING_OFF_SQ_RING))
+			|| !(r->cqRing = (p.features & IORING_FEAT_SINGLE_MMAP) ? r->sqRing
+					 : ioRingMap (r->fd, r->cqRingSize, IORING_OFF_CQ_RING))
+			|| !(r->sqes = ioRingMap (r->fd, r->sqesSize, IORING_OFF_SQES)))
+	{
+		ioRingFree (r);
+		return NULL;
+	}
+	sq = r->sqRing;
+	cq = r->cqRing;
+	r->sqTail = (unsigned *) (sq + p.sq_off.tail);
+	r->sqMask = (unsigned *) (sq + p.sq_off.ring_mask);
+	r->sqArray = (unsigned *) (sq + p.sq_off.array);
+	r->cqHead = (unsigned *) (cq + p.cq_off.head);
+	r->cqTail = (unsigned *) (cq + p.cq_off.tail);
+	r->cqMask = (unsigned *) (cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	pthread_setspecific (ioRingKey, r);
+	return ioRing = r;
+}
+
+/**
+ * Read extents through this thread's ring.  Everything is submitted at once and
+ * the function returns when all of it has completed.  Short reads are finished
+ * with pread, and so is everything if there is no ring.  If the kernel rejects
+ * the read opcode, io_uring is switched off for good.  If it cannot take the
+ * batch at all, the ring is dropped and every extent is read again with pread.
+ * @param ext Extents, at most IO_BATCH_MAX
+ * @param count Number of extents
+ * @param dest Where each extent goes
+ * @return 0 or -1 on error
+ */
+static int
+ioUringRead (const DiskExtent * ext, int count, char **dest)
+{
+	IoRing *r = ioRingGet ();
+	unsigned tail, head, submit = 0, pending;
+	int i, got, ret = 0;
+
+	if (!r)
+	{
+		for (i = 0; i < count; i++)
+			if (ext[i].fd >= 0 && ioPread (ext + i, dest[i]) < 0)
+				return -1;
+		return 0;
+	}
+
+	tail = *r->sqTail;
+	for (i = 0; i < count; i++)
+	{
+		unsigned slot = tail & *r->sqMask;
+		struct io_uring_sqe *sqe = r->sqes + slot;
+
+		if (ext[i].fd < 0)
+			continue;
+		memset (sqe, 0, sizeof (*sqe));
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = ext[i].fd;
+		sqe->off = ext[i].pos;
+		sqe->addr = (uintptr_t) dest[i];
+		sqe->len = ext[i].len;
+		sqe->user_data = i;
+		r->sqArray[slot] = slot;
+		tail++;
+		submit++;
+	}
+	__atomic_store_n (r->sqTail, tail, __ATOMIC_RELEASE);
+	__sync_fetch_and_add (&ioBatches, 1);
+	__sync_fetch_and_add (&ioRequests, submit);
+
+	for (pending = submit; pending;)
+	{
+		got = syscall (__NR_io_uring_enter, r->fd, submit, 1, IORING_ENTER_GETEVENTS,
+									 NULL, 0);
+		if (got < 0)
+		{
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue;
+			// The ring may still hold our entries, so it cannot be reused
+			pthread_setspecific (ioRingKey, NULL);
+			ioRing = NULL;
+			ioRingFree (r);
+			for (ret = 0, i = 0; i < count; i++)
+				if (ext[i].fd >= 0 && ioPread (ext + i, dest[i]) < 0)
+					ret = -1;
+			return ret;
+		}
+		submit -= ((unsigned) got < submit) ? (unsigned) got : submit;
+
+		for (head = *r->cqHead; head != __atomic_load_n (r->cqTail, __ATOMIC_ACQUIRE);
+				 head++, pending--)
+		{
+			struct io_uring_cqe *cqe = r->cqes + (head & *r->cqMask);
+			DiskExtent rest = ext[cqe->user_data];
+			char *to = dest[cqe->user_data];
+
+			if (cqe->res == (int) rest.len)
+				continue;
+			if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP)
+				__atomic_store_n (&ioUringActive, 0, __ATOMIC_RELAXED);
+			else if (cqe->res < 0)
+			{
+				ret = -1;
+				continue;
+			}
+			else
+			{
+				rest.pos += cqe->res;
+				rest.len -= cqe->res;
+				to += cqe->res;
+			}
+			if (ioPread (&rest, to) < 0)
+				ret = -1;
+		}
+		__atomic_store_n (r->cqHead, head, __ATOMIC_RELEASE);
+	}
+	return ret;
+}
+#endif
+
+/**
+ * Read extents into consecutive parts of a buffer
+ * @param ext Extents, at most IO_BATCH_MAX.  Holes (fd -1) read as zeros.
+ * @param count Number of extents
+ * @param buf out: Data read
+ * @return 0 or -1 on error
+ */
+static int
+ioRead (const DiskExtent * ext, int count, char *buf)
+{
+	char *dest[IO_BATCH_MAX];
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		dest[i] = buf;
+		buf += ext[i].len;
+		if (ext[i].fd < 0)
+			memset (dest[i], 0, ext[i].len);
+	}
+
+#ifndef NO_IO_URING
+	if (count > 1 && __atomic_load_n (&ioUringActive, __ATOMIC_RELAXED))
+		return ioUringRead (ext, count, dest);
+#endif
+	for (i = 0; i < count; i++)
+		if (ext[i].fd >= 0 && ioPread (ext + i, dest[i]) < 0)
+			return -1;
+	return 0;
+}
+
+/**
+ * @return the engine that ioRead uses at the moment, for the stats file
+ */
+static const char *
+ioEngine (void)
+{
+#ifndef NO_IO_URING
+	if (__atomic_load_n (&ioUringActive, __ATOMIC_RELAXED))
+		return "io_uring";
+#endif
+	return "pread";
+}
+
+//====================================================================================================
+//                                        Native VDI backend
+//====================================================================================================
+//
+// Readonly mounts of VDI images bypass VBoxDDU, including chains of VDI snapshots.
+// The headers and block maps are parsed once and merged into an index of which
+// layer owns each block.  After that a read is a pread straight from the owning
+// layer into the caller's buffer, and unallocated blocks are zero filled without
+// touching any file.  pread is thread safe, so no locking is needed at all.
+//
+// VBoxDDU looks for a block in every layer from the top down, which gets slow
+// with dozens of snapshots.  So writable VDI chains use the index for reads too,
+// and only writes go through VBoxDDU.  When a write allocates a block in the top
+// layer, the index entry is reloaded from that layer's block map.  Those reads
+// are serialised with the writes under diskMutex rather than relying on how
+// VBoxDDU orders its updates of the file: a discard moves blocks and shortens
+// the file, and readahead holds no range that would keep it away.
+
+/**
+ * Describe where a range of the native VDI image's disk is stored.  Blocks that
+ * are adjacent in the same file are merged into one extent, as are runs of
+ * unallocated blocks and anything beyond the end of a truncated fixed image.
+ * @param img Image
+ * @param offset Offset into the disk in bytes
+ * @param len Length of the range
+ * @param ext out: Extents, in disk order
+ * @param max Room in ext
+ * @return number of extents, which may cover less than len if max is reached,
+ * or -1 if the range is outside the disk
+ */
+static int
+vdiMap (Image * img, uint64_t offset, size_t len, DiskExtent * ext, int max)
+{
+	VDIimage *vdi = &img->vdi;
+	int count = 0;
+
+	if (offset + len > vdi->diskSize)
+		return -1;
+
+	while (len && count < max)
+	{
+		uint32_t block = offset / vdi->blockSize;
+		uint32_t within = offset % vdi->blockSize;
+		uint64_t index = __atomic_load_n (vdi->index + block, __ATOMIC_ACQUIRE);
+		uint32_t entry = (uint32_t) index;
+		VDIlayer *l = vdi->layer + (index >> 32);
+		uint64_t fileSize = __atomic_load_n (&l->fileSize, __ATOMIC_RELAXED);
+		size_t n = vdi->blockSize - within;
+		uint64_t pos = 0;
+
+		if (entry < VDI_BLOCK_ZERO)
+			pos = l->dataOffset
+				+ (uint64_t) entry * (vdi->blockSize + l->blockExtra) + l->blockExtra
+				+ within;
+
+		if (entry >= VDI_BLOCK_ZERO || pos >= fileSize)
+		{
+			while (n < len && block + 1 < vdi->blocks
+						 && (uint32_t) vdi->index[block + 1] >= VDI_BLOCK_ZERO)
+			{
+				block++;
+				n += vdi->blockSize;
+			}
+			ext[count].fd = -1;
+		}
+		else
+		{
+			if (!l->blockExtra)
+				while (n < len && block + 1 < vdi->blocks
+							 && vdi->index[block + 1] == vdi->index[block] + 1)
+				{
+					block++;
+					n += vdi->blockSize;
+				}
+			if (pos + n > fileSize)
+				n = fileSize - pos;		// truncated fixed image
+			ext[count].fd = l->fd;
+		}
+		if (n > len)
+			n = len;
+		ext[count].pos = pos;
+		ext[count].len = n;
+		count++;
+		offset += n;
+		len -= n;
+	}
+	return count;
+}
+
+/**
+ * Read from the virtual disk of the native VDI image, IO_BATCH_MAX extents at
+ * a time
+ * @param img Image
+ * @param offset Offset into the disk in bytes
+ * @param buf out: Data read
+ * @param len Number of bytes to read
+ * @return 0 or -1 on error
+ */
+static int
+vdiRead (Image * img, uint64_t offset, void *buf, size_t len)
+{
+	DiskExtent ext[IO_BATCH_MAX];
+	char *out = buf;
+	int count, i;
+
+	while (len)
+	{
+		if ((count = vdiMap (img, offset, len, ext, IO_BATCH_MAX)) < 0
+				|| ioRead (ext, count, out) < 0)
+			return -1;
+		for (i = 0; i < count; i++)
+		{
+			out += ext[i].len;
+			offset += ext[i].len;
+			len -= ext[i].len;
+		}
+	}
+	return 0;
+}
+
+static int
+vdiWrite (Image * img UNUSED, uint64_t offset UNUSED, const void *buf UNUSED, size_t len UNUSED)
+{
+	return -1;
+}
+
+static int
+vdiFlush (Image * img UNUSED)
+{
+	return 0;
+}
+
+static uint64_t
+vdiSize (Image * img)
+{
+	return img->vdi.diskSize;
+}
+
+static void
+vdiClose (Image * img)
+{
+	int i;
+
+	for (i = 0; i < img->vdi.layers; i++)
+	{
+		if (img->vdi.layer[i].cacheId)
+			cacheFilePut (img->vdi.layer[i].cacheId);
+		img->vdi.layer[i].cacheId = 0;
+		close (img->vdi.layer[i].fd);
+	}
+	img->vdi.cacheByFile = 0;
+	if (img->vdi.indexMap)
+	{
+		munmap (img->vdi.indexMap, img->vdi.indexMapSize);
+		if ((void *) img->sidecar == img->vdi.indexMap)
+			img->sidecar = NULL;
+	}
+	else
+		free (img->vdi.index);
+	free (img->vdi.owner);
+	img->vdi.layers = 0;
+	img->vdi.index = NULL;
+	img->vdi.indexMap = NULL;
+	img->vdi.owner = NULL;
+}
+
+static DiskBackend vdiBackend = {
+	.name = "VDI",
+	.read = vdiRead,
+	.map = vdiMap,
+	.write = vdiWrite,
+	.flush = vdiFlush,
+	.size = vdiSize,
+	.close = vdiClose,
+	.concurrent = 1
+};
+
+#ifndef NO_VBOX
+/**
+ * Write through VBoxDDU, then point the index at the top layer for every block
+ * of the range that VBoxDDU allocated there.  Writes are serialised by
+ * the image's diskMutex, so this is the only thread changing its index.
+ * @param img Image
+ * @param offset Offset into the disk in bytes
+ * @param buf Data to write
+ * @param len Number of bytes to write
+ * @return VBox status code
+ */
+static int
+vdiChainWrite (Image * img, uint64_t offset, const void *buf, size_t len)
+{
+	VDIimage *vdi = &img->vdi;
+	int top = vdi->layers - 1;
+	VDIlayer *l = vdi->layer + top;
+	uint32_t block, last;
+	struct stat st;
+	int ret = vboxWrite (img, offset, buf, len);
+
+	if (RT_FAILURE (ret) || !len)
+		return ret;
+
+// New blocks are appended, so the file must be known to be long enough before the
+// index sends readers there
+
+	if (fstat (l->fd, &st) == 0)
+		__atomic_store_n (&l->fileSize, st.st_size, __ATOMIC_RELEASE);
+	last = (offset + len - 1) / vdi->blockSize;
+	for (block = offset / vdi->blockSize; block <= last; block++)
+	{
+		uint64_t index = vdi->index[block];
+		uint32_t entry;
+
+		if ((index >> 32) == (uint64_t) top && (uint32_t) index < VDI_BLOCK_ZERO)
+			continue;
+		if (pread (l->fd, &entry, sizeof (entry),
+							 l->blocksOffset + (uint64_t) block * sizeof (entry)) == sizeof (entry)
+				&& entry != VDI_BLOCK_FREE)
+		{
+			__atomic_store_n (vdi->index + block, VDI_INDEX (top, entry),
+												__ATOMIC_RELEASE);
+			if (vdi->owner && entry < vdi->blocks)
+			{
+				vdi->owner[entry] = block;
+				if (entry >= vdi->slots)
+					vdi->slots = entry + 1;
+			}
+		}
+	}
+	return ret;
+}
+
+static void
+vdiChainClose (Image * img)
+{
+	vdiClose (img);
+	vboxClose (img);
+}
+
+// What a writable chain falls back to, see vdiChainLost.  It has no discard, and
+// closing it still closes the native files.
+
+static DiskBackend vdiLostBackend = {
+	.name = "VBoxDDU",
+	.read = vboxRead,
+	.write = vboxWrite,
+	.flush = vboxFlush,
+	.size = vboxSize,
+	.close = vdiChainClose,
+	.concurrent = 0
+};
+
+/**
+ * Read the number of blocks allocated in a VDI file from its header
+ * @param l Layer
+ * @param slots out: Blocks allocated
+ * @return 0 or -1 on error
+ */
+static int
+vdiSlots (VDIlayer * l, uint32_t * slots)
+{
+	return pread (l->fd, slots, sizeof (*slots), sizeof (VDIpreHeader)
+								+ offsetof (VDIheader, blocksAllocated)) == sizeof (*slots) ? 0 : -1;
+}
+
+/**
+ * Build the reverse of the index for the base image, which slot of the file
+ * holds which block of the disk, so that a discard can tell which blocks
+ * VBoxDDU moved.  Writes keep it up to date from then on.
+ * @param img Image, with diskMutex held
+ * @return 0 or -1 on error
+ */
+static int
+vdiOwners (Image * img)
+{
+	VDIimage *vdi = &img->vdi;
+	uint32_t b, slot;
+
+	if (vdi->owner)
+		return 0;
+	if (vdiSlots (vdi->layer, &vdi->slots) < 0 || vdi->slots > vdi->blocks
+			|| !(vdi->owner = malloc ((size_t) vdi->blocks * sizeof (uint32_t))))
+		return -1;
+	memset (vdi->owner, 0xff, (size_t) vdi->blocks * sizeof (uint32_t));	// VDI_BLOCK_FREE
+	for (b = 0; b < vdi->blocks; b++)
+		if ((slot = (uint32_t) vdi->index[b]) < VDI_BLOCK_ZERO)
+		{
+			if (slot >= vdi->slots)
+			{
+				free (vdi->owner);
+				vdi->owner = NULL;
+				return -1;
+			}
+			vdi->owner[slot] = b;
+		}
+	return 0;
+}
+
+/**
+ * Reload the index entries of a run of blocks from the block map on disk
+ * @param img Image
+ * @param first First block
+ * @param count Number of blocks
+ * @param slots Blocks allocated in the file now
+ * @return 0, or -1 if the map cannot be read or points past the file
+ */
+static int
+vdiReload (Image * img, uint32_t first, uint32_t count, uint32_t slots)
+{
+	VDIimage *vdi = &img->vdi;
+	uint32_t map[1024];
+	uint32_t b, i, n, old;
+
+	for (b = first; b < first + count; b += n)
+	{
+		n = (first + count - b < 1024) ? first + count - b : 1024;
+		if (pread (vdi->layer->fd, map, n * sizeof (uint32_t),
+							 vdi->layer->blocksOffset + (uint64_t) b * sizeof (uint32_t))
+				!= (ssize_t) (n * sizeof (uint32_t)))
+			return -1;
+		for (i = 0; i < n; i++)
+		{
+			if (map[i] < VDI_BLOCK_ZERO && map[i] >= slots)
+				return -1;
+			old = (uint32_t) vdi->index[b + i];
+			if (old < VDI_BLOCK_ZERO && vdi->owner[old] == b + i)
+				vdi->owner[old] = VDI_BLOCK_FREE;
+			if (map[i] < VDI_BLOCK_ZERO)
+				vdi->owner[map[i]] = b + i;
+			__atomic_store_n (vdi->index + b + i, VDI_INDEX (0, map[i]), __ATOMIC_RELEASE);
+		}
+	}
+	return 0;
+}
+
+/**
+ * Give up on the native index of a writable chain and read through VBoxDDU,
+ * which always knows where its blocks are
+ * @param img Image, with diskMutex held
+ */
+static void
+vdiChainLost (Image * img)
+{
+	fprintf (stderr, "vdfuse: cannot follow a discard in the block map of %s, "
+					 "reading through VBoxDDU from now on\n", img->filename);
+	img->discard = 0;
+	__atomic_store_n (&img->backend, &vdiLostBackend, __ATOMIC_RELEASE);
+}
+
+/**
+ * Free whole blocks through VBoxDDU, which fills each hole with the block from
+ * the end of the file and shortens it.  Only the index entries that can have
+ * changed are reloaded from the block map on disk: those of the range and those
+ * of the blocks that were stored in the slots now cut off, found through
+ * vdi->owner.  Blocks that moved are dropped from the cache, where readahead,
+ * which holds no range, may have read them from their old place.  If the index
+ * cannot be brought up to date, reads go through VBoxDDU from then on, see
+ * vdiChainLost.  Discarding is only enabled without snapshots, so layer 0 is the
+ * whole chain.
+ * @param img Image, with diskMutex held
+ * @param offset Offset into the disk in bytes, a multiple of the block size
+ * @param len Length of the range, a multiple of the block size
+ * @return VBox status code
+ */
+static int
+vdiChainDiscard (Image * img, uint64_t offset, size_t len)
+{
+	VDIimage *vdi = &img->vdi;
+	VDIlayer *l = vdi->layer;
+	RTRANGE range = { offset, len };
+	uint32_t first = offset / vdi->blockSize, count = len / vdi->blockSize;
+	uint32_t slot, slots, old, b;
+	struct stat st;
+	int ret, lost;
+
+	if (vdiOwners (img) < 0)
+	{
+		vdiChainLost (img);
+		return VDDiscardRanges (img->hdDisk, &range, 1);
+	}
+	old = vdi->slots;
+
+// Even a failed discard may have freed and moved some of the blocks
+
+	ret = VDDiscardRanges (img->hdDisk, &range, 1);
+	lost = vdiSlots (l, &slots) < 0 || slots > old
+		|| vdiReload (img, first, count, slots) < 0;
+	for (slot = slots; slot < old && !lost; slot++)
+		if ((b = vdi->owner[slot]) != VDI_BLOCK_FREE)
+		{
+			lost = vdiReload (img, b, 1, slots) < 0;
+			cacheForget (img, (uint64_t) b * vdi->blockSize, vdi->blockSize, 0);
+		}
+	if (lost)
+		vdiChainLost (img);
+	else
+		vdi->slots = slots;
+	if (fstat (l->fd, &st) == 0)
+		__atomic_store_n (&l->fileSize, st.st_size, __ATOMIC_RELEASE);
+	return ret;
+}
+
+static DiskBackend vdiWritableBackend = {
+	.name = "VDI+VBoxDDU",
+	.read = vdiRead,
+	.map = vdiMap,
+	.write = vdiChainWrite,
+	.discard = vdiChainDiscard,
+	.flush = vboxFlush,
+	.size = vdiSize,
+	.close = vdiChainClose,
+	.concurrent = 0								// reads share diskMutex with VBoxDDU's writes
+};
+#endif
+
+/**
+ * Open one image of a VDI chain and merge its block map into the index.  Every
+ * block that the layer has allocated, or marked as zero, now belongs to it.
+ * @param img Image
+ * @param filename VDI image file
+ * @param n Layer number, 0 for the base image
+ * @param header out: The image header
+ * @return 0, or -1 if the image cannot be handled natively
+ */
+static int
+vdiOpenLayer (Image * img, const char *filename, int n, VDIheader * header)
+{
+	VDIimage *vdi = &img->vdi;
+	VDIlayer *l = vdi->layer + n;
+	VDIpreHeader pre;
+	struct stat st;
+	uint32_t *map, i;
+	size_t mapSize;
+
+	if ((l->fd = open (filename, O_RDONLY)) < 0)
+		return -1;
+	if (fstat (l->fd, &st) < 0)
+	{
+		close (l->fd);
+		return -1;
+	}
+	l->fileSize = st.st_size;
+	if (pread (l->fd, &pre, sizeof (pre), 0) != sizeof (pre)
+			|| pread (l->fd, header, sizeof (*header), sizeof (pre)) != sizeof (*header)
+			|| pre.signature != VDI_SIGNATURE || pre.version != VDI_VERSION
+			|| header->headerSize < sizeof (VDIheader)
+			|| (n == 0 && header->type != VDI_TYPE_NORMAL
+					&& header->type != VDI_TYPE_FIXED)
+			|| (n > 0 && header->type != VDI_TYPE_DIFF)
+			|| header->blockSize == 0 || (header->blockSize & (header->blockSize - 1))
+			|| (uint64_t) header->blocks * header->blockSize < header->diskSize
+			|| (n > 0 && (header->blockSize != vdi->blockSize
+										|| header->blocks != vdi->blocks)))
+	{
+		vbprintf ("%s: not a plain VDI 1.1 image or snapshot, not using the native backend",
+							filename);
+		close (l->fd);
+		return -1;
+	}
+
+	if (n == 0)
+	{
+		vdi->diskSize = header->diskSize;
+		vdi->blockSize = header->blockSize;
+		vdi->blocks = header->blocks;
+		if (!(vdi->index = malloc ((size_t) vdi->blocks * sizeof (uint64_t))))
+		{
+			close (l->fd);
+			return -1;
+		}
+	}
+	l->blockExtra = header->blockExtra;
+	l->dataOffset = header->dataOffset;
+	l->blocksOffset = header->blocksOffset;
+
+	mapSize = (size_t) header->blocks * sizeof (uint32_t);
+	if (!(map = malloc (mapSize))
+			|| pread (l->fd, map, mapSize, header->blocksOffset) != (ssize_t) mapSize)
+	{
+		vbprintf ("%s: cannot read the VDI block map", filename);
+		free (map);
+		close (l->fd);
+		return -1;
+	}
+	for (i = 0; i < vdi->blocks; i++)
+		if (n == 0 || map[i] != VDI_BLOCK_FREE)
+			vdi->index[i] = VDI_INDEX (n, map[i]);
+	free (map);
+
+	vbprintf ("VDI layer %d: %llu bytes, %u blocks of %u bytes, %u allocated", n,
+						(unsigned long long) header->diskSize, header->blocks,
+						header->blockSize, header->blocksAllocated);
+	return 0;
+}
+
+/**
+ * Open a VDI image and its snapshots with the native backend.  Each snapshot
+ * must be a differencing image of the one below it.  On success the image's
+ * backend is set.
+ * @param img Image, with the base file and the snapshots, bottom up
+ * @param writable Whether writes go to VBoxDDU, which must have opened the chain
+ * @return 0, or -1 if the chain cannot be handled natively
+ */
+int
+vdiOpen (Image * img, int writable)
+{
+	VDIimage *vdi = &img->vdi;
+	char **snapshots = img->differencing;
+	int count = img->differencingLen;
+	VDIheader header;
+	uint8_t parent[16];
+	uint64_t start = traceClock ();
+	int n;
+
+// With a valid sidecar there is nothing to read
+
+	for (n = (sidecarVdi (img) == 0) ? count + 1 : 0; n <= count; n++)
+	{
+		if (vdiOpenLayer (img, n ? snapshots[n - 1] : img->filename, n, &header) < 0)
+			break;
+		vdi->layers = n + 1;
+		if (n > 0 && memcmp (header.uuidLinkage, parent, sizeof (parent)) != 0)
+		{
+			vbprintf ("%s is not a snapshot of %s, not using the native backend",
+								snapshots[n - 1], n > 1 ? snapshots[n - 2] : img->filename);
+			break;
+		}
+		memcpy (parent, header.uuidCreate, sizeof (parent));
+	}
+	if (n <= count)
+	{
+		vdiClose (img);
+		return -1;
+	}
+
+	vbprintf ("VDI index: %d layers, %llu KiB, %s in %.1f ms", vdi->layers,
+						((unsigned long long) vdi->blocks * sizeof (uint64_t) + 1023) / 1024,
+						vdi->indexMap ? "loaded from the sidecar" : "built",
+						(traceClock () - start) / 1e6);
+
+// Nothing ever changes a readonly chain, so its blocks can be cached by where
+// they are stored and shared with other images on the same files
+
+	if (!writable && cacheSize && vdi->blockSize % cacheBlock == 0)
+	{
+		struct stat st;
+
+		for (n = 0; n < vdi->layers; n++)
+			if (fstat (vdi->layer[n].fd, &st) < 0
+					|| !(vdi->layer[n].cacheId = cacheFileGet (&st)))
+				break;
+		vdi->cacheByFile = (n == vdi->layers);
+	}
+#ifndef NO_VBOX
+	if (writable)
+	{
+		img->backend = &vdiWritableBackend;
+		return 0;
+	}
+#endif
+	img->backend = &vdiBackend;
+	return 0;
+}
+
+/**
+ * Parse a size argument with an optional k, m, g or t suffix (powers of 1024)
+ * @param s Size string, e.g. "64k" or "2G"
+ * @return size in bytes
+ */
+uint64_t
+parseSize (const char *s)
+{
+	char *end;
+	uint64_t size = strtoull (s, &end, 10);
+
+	switch (tolower (*end))
+	{
+		case 't':
+			size <<= 10;
+			// fall through
+		case 'g':
+			size <<= 10;
+			// fall through
+		case 'm':
+			size <<= 10;
+			// fall through
+		case 'k':
+			size <<= 10;
+			end++;
+			// fall through
+		case '\0':
+			break;
+		default:
+			usageAndExit ("invalid size %s", s);
+	}
+	if (*end != '\0' && tolower (*end) != 'b')
+		usageAndExit ("invalid size %s", s);
+	return size;
+}
+
+//====================================================================================================
+//                                            Buffer pool
+//====================================================================================================
+//
+// Cache misses read a run of blocks into a bounce buffer, and FUSE reads, NBD
+// requests and write back runs each need one too.  Instead of going to malloc for
+// every request, they take BUFFER_SIZE buffers from a pool that is allocated and
+// faulted in once at startup, --buffer-pool bytes in all.  A thread keeps the
+// last BUFFER_STASH buffers it freed and takes those first, so a busy thread
+// reuses its own buffers without touching the pool lock.
+//
+// The pool is not a cap.  Longer requests, and requests that find the pool
+// empty, get their buffer from posix_memalign and are counted as fallbacks.
+// Waiting for a pool buffer instead could deadlock, since a request may hold one
+// buffer while it asks for another (a FUSE read and the cache miss under it),
+// and failing would turn load into I/O errors.  The block cache keeps its blocks
+// in an arena mapped the same way but faulted in as it fills, see cacheInit.
+
+/**
+ * Map memory for buffers.  Reserved huge pages are used if there are enough
+ * of them, otherwise transparent huge pages are asked for.
+ * @param size Bytes to map
+ * @param prefault Whether to fault it all in now rather than under load
+ * @param pages out: BUFFER_PAGES_xxx, the kind of pages used
+ * @return page aligned memory or NULL
+ */
+void *
+bufferArena (uint64_t size, int prefault, int *pages)
+{
+	void *p;
+
+// Shared, so that the fork when daemonising does not copy huge pages on write,
+// which fails with SIGBUS if the reserve runs out.  The huge pages are reserved
+// by mmap, so faulting them in later cannot fail either.
+
+	p = mmap (NULL, size, PROT_READ | PROT_WRITE,
+						MAP_SHARED | MAP_ANONYMOUS | MAP_HUGETLB | (prefault ? MAP_POPULATE : 0),
+						-1, 0);
+	if (p != MAP_FAILED)
+	{
+		*pages = BUFFER_PAGES_HUGETLB;
+		return p;
+	}
+	p = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	*pages = (madvise (p, size, MADV_HUGEPAGE) == 0) ? BUFFER_PAGES_THP : BUFFER_PAGES_SMALL;
+	if (prefault)
+		memset (p, 0, size);
+	return p;
+}
+
+/**
+ * Hand the stash of an exiting thread back to the pool
+ * @param u UNUSED
+ */
+static void
+bufferRelease (void *u UNUSED)
+{
+	pthread_mutex_lock (&bufferMutex);
+	while (bufferStashed)
+	{
+		char *buf = bufferStash[--bufferStashed];
+		*(char **) buf = bufferFree;
+		bufferFree = buf;
+	}
+	pthread_mutex_unlock (&bufferMutex);
+}
+
+/**
+ * Allocate the buffer pool
+ * @param size Memory for the pool in bytes, rounded down to whole buffers
+ */
+void
+bufferInit (uint64_t size)
+{
+	uint64_t i;
+
+	bufferCount = size / BUFFER_SIZE;
+	if (!bufferCount || pthread_key_create (&bufferKey, bufferRelease) != 0
+			|| !(bufferStart = bufferArena (bufferCount * BUFFER_SIZE, 1, &bufferPages)))
+	{
+		bufferCount = 0;
+		return;
+	}
+	bufferEnd = bufferStart + bufferCount * BUFFER_SIZE;
+	for (i = bufferCount; i-- > 0;)
+	{
+		*(char **) (bufferStart + i * BUFFER_SIZE) = bufferFree;
+		bufferFree = bufferStart + i * BUFFER_SIZE;
+	}
+	vbprintf ("buffer pool: %llu buffers of %d bytes in %s pages",
+						(unsigned long long) bufferCount, BUFFER_SIZE, bufferPageNames[bufferPages]);
+}
+
+/**
+ * Get a page aligned buffer, from the pool if it is short enough
+ * @param len Bytes needed
+ * @return buffer to give back with bufferPut, or NULL
+ */
+char *
+bufferGet (size_t len)
+{
+	char *buf = NULL;
+	void *p;
+	uint64_t used;
+
+	if (len <= BUFFER_SIZE && bufferCount)
+	{
+		if (bufferStashed)
+			buf = bufferStash[--bufferStashed];
+		else
+		{
+			pthread_mutex_lock (&bufferMutex);
+			if ((buf = bufferFree))
+				bufferFree = *(char **) buf;
+			pthread_mutex_unlock (&bufferMutex);
+		}
+		if (buf)
+		{
+			used = __sync_add_and_fetch (&bufferUsed, 1);
+			if (used > __atomic_load_n (&bufferPeak, __ATOMIC_RELAXED))
+				__atomic_store_n (&bufferPeak, used, __ATOMIC_RELAXED);
+			return buf;
+		}
+	}
+	__sync_fetch_and_add (&bufferFallbacks, 1);
+	return (posix_memalign (&p, BUFFER_ALIGN, len ? len : 1) == 0) ? p : NULL;
+}
+
+/**
+ * Give back a buffer from bufferGet
+ * @param buf Buffer or NULL
+ */
+void
+bufferPut (char *buf)
+{
+	static __thread int registered = 0;
+
+	if ((uintptr_t) buf < (uintptr_t) bufferStart || (uintptr_t) buf >= (uintptr_t) bufferEnd)
+	{
+		free (buf);
+		return;
+	}
+	__sync_fetch_and_sub (&bufferUsed, 1);
+	if (bufferStashed < BUFFER_STASH)
+	{
+		if (!registered)
+			registered = (pthread_setspecific (bufferKey, bufferStash) == 0);
+		bufferStash[bufferStashed++] = buf;
+		return;
+	}
+	pthread_mutex_lock (&bufferMutex);
+	*(char **) buf = bufferFree;
+	bufferFree = buf;
+	pthread_mutex_unlock (&bufferMutex);
+}
+
+//====================================================================================================
+//                                            Block cache
+//====================================================================================================
+//
+// The cache is shared by all images.  Entries are looked up by the key from
+// cacheKey, which puts an id above a block number, so the shards stay spread by
+// block.  For most images that is the image id and the disk block.  Readonly VDI
+// chains use the layer file that stores the block and the block's place in that
+// file instead, so linked clones of one base image, whether snapshots given with
+// -s or other images in daemon mode, read and keep each base block only once.
+
+/**
+ * Allocate the cache shards, and all block buffers in one arena
+ * @param size Total cache size in bytes
+ * @param block Cache block size in bytes (power of two)
+ */
+void
+cacheInit (uint64_t size, size_t block)
+{
+	int i, j;
+	int perShard = size / block / CACHE_SHARDS;
+	char *arena;
+
+	if (perShard < 1)
+		perShard = 1;
+	cacheBlock = block;
+	cacheSize = (uint64_t) perShard * CACHE_SHARDS * block;
+	if (!(arena = bufferArena (cacheSize, cachePrefault, &cachePages)))
+		usageAndExit ("cannot allocate block cache");
+
+	for (i = 0; i < CACHE_SHARDS; i++)
+	{
+		CacheShard *s = cacheShards + i;
+		pthread_mutex_init (&s->mutex, NULL);
+		pthread_cond_init (&s->filled, NULL);
+		s->nEntries = perShard;
+		s->entries = calloc (perShard, sizeof (CacheEntry));
+		s->buckets = malloc (perShard * sizeof (int));
+		if (!s->entries || !s->buckets)
+			usageAndExit ("cannot allocate block cache");
+		for (j = 0; j < perShard; j++)
+		{
+			s->entries[j].data = arena + ((uint64_t) i * perShard + j) * block;
+			s->entries[j].next = -1;
+			s->buckets[j] = -1;
+		}
+	}
+	vbprintf ("block cache: %llu bytes in %d byte blocks, %d shards, %s pages",
+						(unsigned long long) cacheSize, (int) cacheBlock, CACHE_SHARDS,
+						bufferPageNames[cachePages]);
+}
+
+#define CACHE_SHARD(k) (cacheShards + ((k) % CACHE_SHARDS))
+#define CACHE_BUCKET(s,k) (((k) / CACHE_SHARDS) % (s)->nEntries)
+
+/**
+ * Get the id under which the blocks of a layer file are cached, the same for
+ * every image that opens the file
+ * @param st Attributes of the open file
+ * @return id, or 0 if out of memory
+ */
+unsigned
+cacheFileGet (const struct stat *st)
+{
+	CacheFile *f;
+	unsigned id = 0;
+
+	pthread_mutex_lock (&cacheFilesMutex);
+	for (f = cacheFiles; f; f = f->next)
+		if (f->dev == st->st_dev && f->ino == st->st_ino)
+			break;
+	if (!f && (f = calloc (1, sizeof (CacheFile))))
+	{
+		f->dev = st->st_dev;
+		f->ino = st->st_ino;
+		f->id = __sync_add_and_fetch (&imageIds, 1) & 0xffffff;
+		f->next = cacheFiles;
+		cacheFiles = f;
+	}
+	if (f)
+	{
+		f->refs++;
+		id = f->id;
+	}
+	pthread_mutex_unlock (&cacheFilesMutex);
+	return id;
+}
+
+/**
+ * Drop a reference taken with cacheFileGet.  Blocks of a file that no image has
+ * open any more are removed from the cache, since the file may change now.
+ * @param id Cache id of the file
+ */
+void
+cacheFilePut (unsigned id)
+{
+	CacheFile **link, *f = NULL;
+
+	pthread_mutex_lock (&cacheFilesMutex);
+	for (link = &cacheFiles; *link; link = &(*link)->next)
+		if ((*link)->id == id)
+		{
+			if (--(*link)->refs == 0)
+			{
+				f = *link;
+				*link = f->next;
+			}
+			break;
+		}
+	pthread_mutex_unlock (&cacheFilesMutex);
+	if (f)
+	{
+		cachePurge (id);
+		free (f);
+	}
+}
+
+/**
+ * Cache key of a disk block
+ * @param img Image
+ * @param b Block number on the disk
+ * @return the image id and b, or for a block of a readonly VDI chain that is
+ * stored in a layer file, that file's id and the block's place in it
+ */
+static uint64_t
+cacheKey (Image * img, uint64_t b)
+{
+	VDIimage *vdi = &img->vdi;
+	uint64_t offset = b * cacheBlock;
+	uint64_t index;
+	uint32_t entry;
+
+	if (!vdi->cacheByFile || offset >= vdi->diskSize)
+		return CACHE_KEY (img, b);
+	index = vdi->index[offset / vdi->blockSize];
+	entry = (uint32_t) index;
+	if (entry >= VDI_BLOCK_ZERO)
+		return CACHE_KEY (img, b);
+	return CACHE_KEY_ID (vdi->layer[index >> 32].cacheId,
+											 (uint64_t) entry * (vdi->blockSize / cacheBlock)
+											 + offset % vdi->blockSize / cacheBlock);
+}
+
+/**
+ * Find a block in its shard. The shard mutex must be held.
+ * @return the entry or NULL
+ */
+static CacheEntry *
+cacheLookup (CacheShard * s, uint64_t key)
+{
+	int e;
+	for (e = s->buckets[CACHE_BUCKET (s, key)]; e >= 0; e = s->entries[e].next)
+		if (s->entries[e].key == key)
+			return s->entries + e;
+	return NULL;
+}
+
+/**
+ * Check whether a prefetch is reading a block.  The shard mutex must be held.
+ * @return 1 if the block is pending
+ */
+static int
+cachePending (CacheShard * s, uint64_t key)
+{
+	int i;
+	for (i = 0; i < s->pendingCount; i++)
+		if (s->pending[i] == key)
+			return 1;
+	return 0;
+}
+
+/**
+ * Unhook a valid entry from its hash chain and mark it invalid.  The shard mutex
+ * must be held.
+ */
+static void
+cacheUnlink (CacheShard * s, CacheEntry * e)
+{
+	int *link;
+
+	for (link = s->buckets + CACHE_BUCKET (s, e->key); *link != e - s->entries;
+			 link = &s->entries[*link].next)
+		;
+	*link = e->next;
+	e->valid = 0;
+}
+
+/**
+ * Pick an entry to reuse with CLOCK and unhook it from its hash chain.  Dirty
+ * blocks and blocks being written back are never evicted.  The shard mutex
+ * must be held.
+ * @return an invalid entry or NULL if none is available
+ */
+static CacheEntry *
+cacheVictim (CacheShard * s)
+{
+	CacheEntry *e;
+	int tries;
+
+	for (tries = 2 * s->nEntries; tries >= 0; tries--)
+	{
+		e = s->entries + s->hand;
+		s->hand = (s->hand + 1) % s->nEntries;
+		if (!e->valid)
+			break;
+		if (e->dirty || e->writing)
+			continue;
+		if (!e->referenced)
+		{
+			cacheUnlink (s, e);
+			s->evictions++;
+			break;
+		}
+		e->referenced = 0;
+	}
+	return (tries < 0) ? NULL : e;
+}
+
+/**
+ * Make an entry returned by cacheVictim hold a block. The shard mutex must be held.
+ */
+static void
+cacheLink (CacheShard * s, CacheEntry * e, uint64_t key)
+{
+	e->key = key;
+	e->valid = 1;
+	e->referenced = 1;
+	e->next = s->buckets[CACHE_BUCKET (s, key)];
+	s->buckets[CACHE_BUCKET (s, key)] = e - s->entries;
+}
+
+/**
+ * Add a freshly read block to the cache, evicting with CLOCK if needed.  The
+ * block is dropped if the shard changed since the caller started reading it
+ * from disk, as a concurrent write may then have made the data stale.
+ * @param key Cache key of the block
+ * @param data cacheBlock bytes of block data
+ * @param generation Shard generation sampled before the disk read
+ * @param referenced 0 for speculative reads, which are then evicted first
+ */
+static void
+cacheInsert (uint64_t key, const char *data, unsigned generation,
+						 int referenced)
+{
+	CacheShard *s = CACHE_SHARD (key);
+	CacheEntry *e;
+
+	pthread_mutex_lock (&s->mutex);
+	if (s->generation != generation || cacheLookup (s, key)
+			|| !(e = cacheVictim (s)))
+	{
+		pthread_mutex_unlock (&s->mutex);
+		return;
+	}
+	memcpy (e->data, data, cacheBlock);
+	cacheLink (s, e, key);
+	e->referenced = referenced;
+	pthread_mutex_unlock (&s->mutex);
+}
+
+/**
+ * Read a run of blocks missing from the cache with a single disk request, add
+ * them to the cache and copy the requested part to the caller.
+ * @param img Image
+ * @param start First block of the run
+ * @param count Number of blocks in the run
+ * @param generations Shard generations sampled when each block missed
+ * @param offset Offset of the caller's buffer on the disk
+ * @param buf out: caller's buffer, NULL for readahead
+ * @param len Size of the caller's buffer
+ * @return VBox status code
+ */
+static int
+cacheFill (Image * img, uint64_t start, int count, const unsigned *generations,
+					 uint64_t offset, char *buf, size_t len)
+{
+	uint64_t runOffset = start * cacheBlock;
+	size_t runLen = count * cacheBlock;
+	size_t diskLen = runLen;
+	uint64_t diskSize = DISKsize (img);
+	uint64_t from, to;
+	char *run = bufferGet (runLen);
+	int i, ret;
+
+	if (!run)
+		return -1;
+	if (runOffset + diskLen > diskSize)
+	{
+		diskLen = diskSize - runOffset;
+		memset (run + diskLen, 0, runLen - diskLen);
+	}
+	ret = splitRead (img, runOffset, run, diskLen);
+	if (RT_SUCCESS (ret))
+	{
+		for (i = 0; i < count; i++)
+			cacheInsert (cacheKey (img, start + i), run + i * cacheBlock,
+									 generations[i], buf != NULL);
+		if (buf)
+		{
+			from = (runOffset > offset) ? runOffset : offset;
+			to = (runOffset + runLen < offset + len) ? runOffset + runLen : offset + len;
+			memcpy (buf + (from - offset), run + (from - runOffset), to - from);
+		}
+	}
+	bufferPut (run);
+	return ret;
+}
+
+/**
+ * Read through the block cache. Cached blocks are copied out directly, runs of
+ * missing blocks are read from the disk with one request each.
+ * @param img Image
+ * @param offset Offset into the disk in bytes
+ * @param buf out: Data read
+ * @param len Number of bytes to read
+ * @return VBox status code
+ */
+int
+cacheRead (Image * img, uint64_t offset, char *buf, size_t len)
+{
+	uint64_t first = offset / cacheBlock;
+	uint64_t last = (offset + len - 1) / cacheBlock;
+	uint64_t b = first;
+	int ret;
+
+	while (b <= last)
+	{
+		unsigned generations[CACHE_RUN_MAX];
+		uint64_t runStart = b;
+		int missing = 0;
+
+		for (; b <= last && missing < CACHE_RUN_MAX; b++)
+		{
+			uint64_t key = cacheKey (img, b);
+			CacheShard *s = CACHE_SHARD (key);
+			CacheEntry *e;
+
+			pthread_mutex_lock (&s->mutex);
+			if ((e = cacheLookup (s, key)))
+			{
+				uint64_t from, to;
+				if (missing)
+				{
+					pthread_mutex_unlock (&s->mutex);
+					break;							// fill the run first, this block is revisited
+				}
+				from = (b == first) ? offset : b * cacheBlock;
+				to = (b == last) ? offset + len : (b + 1) * cacheBlock;
+				memcpy (buf + (from - offset), e->data + (from - b * cacheBlock),
+								to - from);
+				e->referenced = 1;
+				s->hits++;
+			}
+			else if (cachePending (s, key))
+			{
+				if (missing)
+				{
+					pthread_mutex_unlock (&s->mutex);
+					break;							// fill the run first, this block is revisited
+				}
+
+// The prefetch would be done before a read of our own, so wait for it and look
+// again.  If it dropped the block, that is a miss after all.
+
+				s->pendingWaits++;
+				while (cachePending (s, key))
+					pthread_cond_wait (&s->filled, &s->mutex);
+				pthread_mutex_unlock (&s->mutex);
+				b--;
+				continue;
+			}
+			else
+			{
+				if (!missing)
+					runStart = b;
+				generations[missing++] = s->generation;
+				s->misses++;
+			}
+			pthread_mutex_unlock (&s->mutex);
+		}
+
+		if (missing)
+		{
+			ret = cacheFill (img, runStart, missing, generations, offset, buf, len);
+			if (RT_FAILURE (ret))
+				return ret;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Read for a bulk pass without disturbing the cache.  Cached blocks, which may
+ * be dirty under write back, are copied out; everything else is read from the
+ * disk and not added.  Neither counts as a hit or miss or as a reference.
+ * @param img Image
+ * @param offset Offset into the disk in bytes
+ * @param buf out: Data read
+ * @param len Number of bytes to read
+ * @return VBox status code
+ */
+int
+cacheScan (Image * img, uint64_t offset, char *buf, size_t len)
+{
+	uint64_t first = offset / cacheBlock;
+	uint64_t last = (offset + len - 1) / cacheBlock;
+	uint64_t b, from, to, missFrom = offset;
+	int missing = 0, cached, ret;
+
+	for (b = first; b <= last; b++)
+	{
+		uint64_t key = cacheKey (img, b);
+		CacheShard *s = CACHE_SHARD (key);
+		CacheEntry *e;
+
+		from = (b == first) ? offset : b * cacheBlock;
+		to = (b == last) ? offset + len : (b + 1) * cacheBlock;
+		pthread_mutex_lock (&s->mutex);
+		if ((cached = ((e = cacheLookup (s, key)) != NULL)))
+			memcpy (buf + (from - offset), e->data + (from - b * cacheBlock), to - from);
+		pthread_mutex_unlock (&s->mutex);
+
+		if (cached && missing)
+		{
+			ret = splitRead (img, missFrom, buf + (missFrom - offset), from - missFrom);
+			if (RT_FAILURE (ret))
+				return ret;
+			missing = 0;
+		}
+		else if (!cached && !missing)
+		{
+			missFrom = from;
+			missing = 1;
+		}
+	}
+	return missing ? splitRead (img, missFrom, buf + (missFrom - offset),
+															offset + len - missFrom) : 0;
+}
+
+/**
+ * Mark a block as being prefetched.  The shard mutex must be held.
+ * @return 0 or -1 if out of memory
+ */
+static int
+cachePendingAdd (CacheShard * s, uint64_t key)
+{
+	if (s->pendingCount == s->pendingRoom)
+	{
+		int room = s->pendingRoom ? 2 * s->pendingRoom : CACHE_RUN_MAX;
+		uint64_t *more = realloc (s->pending, room * sizeof (uint64_t));
+		if (!more)
+			return -1;
+		s->pending = more;
+		s->pendingRoom = room;
+	}
+	s->pending[s->pendingCount++] = key;
+	return 0;
+}
+
+/**
+ * Clear the pending marks of a prefetched run and wake the readers waiting for
+ * any of its blocks
+ * @param keys Cache keys of the run
+ * @param count Number of keys
+ */
+static void
+cachePendingDone (const uint64_t * keys, int count)
+{
+	int i, j;
+
+	for (i = 0; i < count; i++)
+	{
+		CacheShard *s = CACHE_SHARD (keys[i]);
+		pthread_mutex_lock (&s->mutex);
+		for (j = 0; j < s->pendingCount; j++)
+			if (s->pending[j] == keys[i])
+			{
+				s->pending[j] = s->pending[--s->pendingCount];
+				break;
+			}
+		pthread_cond_broadcast (&s->filled);
+		pthread_mutex_unlock (&s->mutex);
+	}
+}
+
+/**
+ * Load blocks into the cache ahead of a sequential reader.  Blocks already
+ * cached or being prefetched are skipped and nothing is counted as a hit or
+ * miss.  The blocks of the run being read are marked as pending meanwhile, so
+ * that a reader who catches up waits for them instead of reading them again.
+ * @param img Image
+ * @param offset Offset into the disk in bytes
+ * @param len Number of bytes to load
+ */
+void
+cachePrefetch (Image * img, uint64_t offset, size_t len)
+{
+	uint64_t b = offset / cacheBlock;
+	uint64_t last = (offset + len - 1) / cacheBlock;
+	int ret;
+
+	while (b <= last)
+	{
+		unsigned generations[CACHE_RUN_MAX];
+		uint64_t keys[CACHE_RUN_MAX];
+		uint64_t runStart = b;
+		int missing = 0;
+		int present;
+
+		for (; b <= last && missing < CACHE_RUN_MAX; b++)
+		{
+			uint64_t key = cacheKey (img, b);
+			CacheShard *s = CACHE_SHARD (key);
+			pthread_mutex_lock (&s->mutex);
+			present = cacheLookup (s, key) || cachePending (s, key)
+				|| cachePendingAdd (s, key) < 0;
+			if (!present)
+			{
+				if (!missing)
+					runStart = b;
+				keys[missing] = key;
+				generations[missing++] = s->generation;
+			}
+			pthread_mutex_unlock (&s->mutex);
+			if (present && missing)
+			{
+				b++;
+				break;
+			}
+		}
+
+		if (missing)
+		{
+			ret = cacheFill (img, runStart, missing, generations, 0, NULL, 0);
+			cachePendingDone (keys, missing);
+			if (RT_FAILURE (ret))
+				return;
+		}
+	}
+}
+
+/**
+ * Keep cached blocks coherent after a successful write to the disk
+ * @param img Image
+ * @param offset Offset into the disk in bytes
+ * @param buf Data written
+ * @param len Number of bytes written
+ */
+void
+cacheUpdate (Image * img, uint64_t offset, const char *buf, size_t len)
+{
+	uint64_t first = offset / cacheBlock;
+	uint64_t last = (offset + len - 1) / cacheBlock;
+	uint64_t b;
+
+	for (b = first; b <= last; b++)
+	{
+		CacheShard *s = CACHE_SHARD (CACHE_KEY (img, b));
+		CacheEntry *e;
+		uint64_t start = (b == first) ? offset : b * cacheBlock;
+		uint64_t end = (b == last) ? offset + len : (b + 1) * cacheBlock;
+
+		pthread_mutex_lock (&s->mutex);
+		s->generation++;
+		if ((e = cacheLookup (s, CACHE_KEY (img, b))))
+			memcpy (e->data + (start - b * cacheBlock), buf + (start - offset),
+							end - start);
+		pthread_mutex_unlock (&s->mutex);
+	}
+}
+
+/**
+ * Keep cached blocks coherent after the backend changed a range of the disk
+ * without a write
+ * @param img Image
+ * @param offset Offset into the disk in bytes
+ * @param len Length of the range
+ * @param zero 1 if the range now reads as zeros, 0 to drop the clean blocks
+ * that hold any of it.  Dirty blocks are newer than the disk and stay.
+ */
+void
+cacheForget (Image * img, uint64_t offset, uint64_t len, int zero)
+{
+	uint64_t first = offset / cacheBlock;
+	uint64_t last = (offset + len - 1) / cacheBlock;
+	uint64_t b;
+
+	for (b = first; b <= last && len && cacheSize; b++)
+	{
+		CacheShard *s = CACHE_SHARD (CACHE_KEY (img, b));
+		CacheEntry *e;
+		uint64_t start = (b == first) ? offset : b * cacheBlock;
+		uint64_t end = (b == last) ? offset + len : (b + 1) * cacheBlock;
+
+		pthread_mutex_lock (&s->mutex);
+		s->generation++;
+		if ((e = cacheLookup (s, CACHE_KEY (img, b))))
+		{
+			if (zero)
+				memset (e->data + (start - b * cacheBlock), 0, end - start);
+			else if (!e->dirty && !e->writing)
+				cacheUnlink (s, e);
+		}
+		pthread_mutex_unlock (&s->mutex);
+	}
+}
+
+/**
+ * Drop every block of an image or layer file from the cache, including dirty
+ * blocks that could not be written back.  Called when the image is closed.
+ * @param id Image id or cache id of the file
+ */
+void
+cachePurge (unsigned id)
+{
+	int i, j;
+
+	for (i = 0; i < CACHE_SHARDS && cacheSize; i++)
+	{
+		CacheShard *s = cacheShards + i;
+		pthread_mutex_lock (&s->mutex);
+		for (j = 0; j < s->nEntries; j++)
+		{
+			CacheEntry *e = s->entries + j;
+			if (!e->valid || (e->key >> CACHE_KEY_SHIFT) != id)
+				continue;
+			if (e->dirty)
+			{
+				e->dirty = 0;
+				__sync_fetch_and_sub (&writebackDirty, 1);
+			}
+			cacheUnlink (s, e);
+		}
+		s->generation++;
+		pthread_mutex_unlock (&s->mutex);
+	}
+}
+
+//====================================================================================================
+//                                     Write back and group commit
+//====================================================================================================
+//
+// In write-back mode VD_write only modifies cache blocks and marks them dirty.
+// Dirty blocks are pinned in the cache until writebackFlush sorts them and writes
+// runs of adjacent blocks with one VDWrite each.  This happens on fsync, when
+// more than writebackMax bytes are dirty or when the oldest dirty block is
+// older than writebackAge seconds.  writebackMax is shared by all images, the
+// age is tracked per image.
+
+/**
+ * Modify one cache block and mark it dirty.  A block that is not cached is read
+ * from the disk first unless it is overwritten completely.
+ * @param img Image
+ * @param block Block number
+ * @param offset Disk offset of the write
+ * @param buf Data to write
+ * @param len Length of the write
+ * @return 0, -1 if the disk read failed or -2 if the shard has no clean entry
+ */
+static int
+cacheDirty (Image * img, uint64_t block, uint64_t offset, const char *buf,
+						size_t len)
+{
+	uint64_t key = CACHE_KEY (img, block);
+	CacheShard *s = CACHE_SHARD (key);
+	CacheEntry *e;
+	uint64_t blockStart = block * cacheBlock;
+	uint64_t from = (offset > blockStart) ? offset : blockStart;
+	uint64_t to = (offset + len < blockStart + cacheBlock) ? offset + len
+		: blockStart + cacheBlock;
+	int whole = (from == blockStart && to == blockStart + cacheBlock);
+	unsigned generation = 0;
+	char *base = NULL;
+
+	for (;;)
+	{
+		pthread_mutex_lock (&s->mutex);
+		e = cacheLookup (s, key);
+
+// The disk copy read below is only usable if nothing touched the shard since
+
+		if (!e && (whole || (base && s->generation == generation)))
+		{
+			if (!(e = cacheVictim (s)))
+			{
+				pthread_mutex_unlock (&s->mutex);
+				free (base);
+				return -2;
+			}
+			if (base)
+				memcpy (e->data, base, cacheBlock);
+			cacheLink (s, e, key);
+		}
+		if (e)
+		{
+			memcpy (e->data + (from - blockStart), buf + (from - offset), to - from);
+			e->referenced = 1;
+			s->generation++;
+			if (!e->dirty)
+			{
+				e->dirty = 1;
+				__sync_fetch_and_add (&writebackDirty, 1);
+				if (__sync_fetch_and_add (&img->writebackDirty, 1) == 0)
+					__atomic_store_n (&img->writebackOldest, time (NULL), __ATOMIC_RELAXED);
+			}
+			pthread_mutex_unlock (&s->mutex);
+			free (base);
+			return 0;
+		}
+		generation = s->generation;
+		pthread_mutex_unlock (&s->mutex);
+
+		if (!base && !(base = malloc (cacheBlock)))
+			return -1;
+		{
+			uint64_t diskSize = DISKsize (img);
+			size_t diskLen = (blockStart + cacheBlock > diskSize)
+				? diskSize - blockStart : cacheBlock;
+			memset (base + diskLen, 0, cacheBlock - diskLen);
+			if (RT_FAILURE (poolRead (img, blockStart, base, diskLen)))
+			{
+				free (base);
+				return -1;
+			}
+		}
+	}
+}
+
+/**
+ * Write to the disk through the cache in write-back mode
+ * @param img Image
+ * @param offset Offset into the disk in bytes
+ * @param buf Data to write
+ * @param len Number of bytes to write
+ * @return VBox status code
+ */
+int
+cacheWriteBack (Image * img, uint64_t offset, const char *buf, size_t len)
+{
+	uint64_t first = offset / cacheBlock;
+	uint64_t last = (offset + len - 1) / cacheBlock;
+	uint64_t b, dirty;
+	int ret;
+
+	for (b = first; b <= last; b++)
+	{
+		while ((ret = cacheDirty (img, b, offset, buf, len)) == -2)
+			if (RT_FAILURE (writebackFlushAll ()))
+				return -1;
+		if (ret < 0)
+			return -1;
+	}
+
+// Over twice the budget, the writer pays for its own image and the thread for
+// the others
+
+	dirty = (uint64_t) __atomic_load_n (&writebackDirty, __ATOMIC_RELAXED) * cacheBlock;
+	if (dirty >= writebackMax)
+	{
+		pthread_mutex_lock (&writebackWakeMutex);
+		writebackWakes++;
+		pthread_cond_signal (&writebackCond);
+		pthread_mutex_unlock (&writebackWakeMutex);
+	}
+	if (dirty >= 2 * writebackMax)
+		return writebackFlush (img);
+	return 0;
+}
+
+static int
+compareBlocks (const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Write one run of adjacent dirty blocks to the disk
+ * @param img Image
+ * @param start First block of the run
+ * @param count Number of blocks
+ * @param run Buffer of count * cacheBlock bytes
+ * @return VBox status code
+ */
+static int
+writebackRun (Image * img, uint64_t start, int count, char *run)
+{
+	uint64_t diskSize = DISKsize (img);
+	uint64_t offset = start * cacheBlock;
+	size_t len = count * cacheBlock;
+	int i, ret;
+
+	for (i = 0; i < count; i++)
+	{
+		uint64_t key = CACHE_KEY (img, start + i);
+		CacheShard *s = CACHE_SHARD (key);
+		CacheEntry *e;
+		pthread_mutex_lock (&s->mutex);
+		e = cacheLookup (s, key);
+		memcpy (run + i * cacheBlock, e->data, cacheBlock);
+		e->dirty = 0;
+		e->writing = 1;
+		__sync_fetch_and_sub (&writebackDirty, 1);
+		__sync_fetch_and_sub (&img->writebackDirty, 1);
+		pthread_mutex_unlock (&s->mutex);
+	}
+
+	if (offset + len > diskSize)
+		len = diskSize - offset;
+
+// Zeros over space that the image does not store would only grow it
+
+	if (isZero (run, len) && !diskAllocated (img, offset, len))
+	{
+		__sync_fetch_and_add (&zeroSkipped, 1);
+		ret = 0;
+	}
+	else
+	{
+		traceLock (&img->diskMutex);
+		ret = DISKwrite (img, offset, run, len);
+		pthread_mutex_unlock (&img->diskMutex);
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		uint64_t key = CACHE_KEY (img, start + i);
+		CacheShard *s = CACHE_SHARD (key);
+		CacheEntry *e;
+		pthread_mutex_lock (&s->mutex);
+		e = cacheLookup (s, key);
+		e->writing = 0;
+		if (RT_FAILURE (ret) && !e->dirty)
+		{
+			e->dirty = 1;							// keep it, the next flush retries
+			__sync_fetch_and_add (&writebackDirty, 1);
+			__sync_fetch_and_add (&img->writebackDirty, 1);
+		}
+		pthread_mutex_unlock (&s->mutex);
+	}
+	if (RT_SUCCESS (ret))
+	{
+		img->writebackRuns++;
+		img->writebackBytes += len;
+	}
+	return ret;
+}
+
+/**
+ * Write all dirty blocks of an image to the disk, merging adjacent blocks into
+ * runs of up to WRITEBACK_RUN_MAX bytes.  Does not flush the disk itself, see
+ * groupCommit.
+ * @param img Image
+ * @return VBox status code of the first failed write or 0
+ */
+int
+writebackFlush (Image * img)
+{
+	int maxRun = WRITEBACK_RUN_MAX / cacheBlock;
+	char *run;
+	int i, j, n = 0;
+	int ret = 0, rc;
+
+	if (!writeBack)
+		return 0;
+	if (!(run = bufferGet ((maxRun ? maxRun : 1) * cacheBlock)))
+		return -1;
+	if (!maxRun)
+		maxRun = 1;
+
+	pthread_mutex_lock (&img->writebackMutex);
+
+// Only images that are written to need the block list, so it is allocated here
+
+	if (!img->writebackBlocks
+			&& !(img->writebackBlocks = malloc (cacheSize / cacheBlock * sizeof (uint64_t))))
+	{
+		pthread_mutex_unlock (&img->writebackMutex);
+		bufferPut (run);
+		return -1;
+	}
+	for (i = 0; i < CACHE_SHARDS; i++)
+	{
+		CacheShard *s = cacheShards + i;
+		pthread_mutex_lock (&s->mutex);
+		for (j = 0; j < s->nEntries; j++)
+			if (s->entries[j].valid && s->entries[j].dirty
+					&& (s->entries[j].key >> CACHE_KEY_SHIFT) == img->id)
+				img->writebackBlocks[n++] = CACHE_KEY_BLOCK (s->entries[j].key);
+		pthread_mutex_unlock (&s->mutex);
+	}
+	qsort (img->writebackBlocks, n, sizeof (uint64_t), compareBlocks);
+
+	for (i = 0; i < n; i = j)
+	{
+		for (j = i + 1; j < n && j - i < maxRun
+				 && img->writebackBlocks[j] == img->writebackBlocks[j - 1] + 1; j++)
+			;
+		rc = writebackRun (img, img->writebackBlocks[i], j - i, run);
+		if (RT_FAILURE (rc) && RT_SUCCESS (ret))
+			ret = rc;
+	}
+	if (__atomic_load_n (&img->writebackDirty, __ATOMIC_RELAXED))
+		__atomic_store_n (&img->writebackOldest, time (NULL), __ATOMIC_RELAXED);
+	pthread_mutex_unlock (&img->writebackMutex);
+
+	bufferPut (run);
+	return ret;
+}
+
+/**
+ * Write the dirty blocks of every image to the disk
+ * @return VBox status code of the first failed write or 0
+ */
+int
+writebackFlushAll (void)
+{
+	Image **list = malloc (IMAGES_MAX * sizeof (Image *));
+	int i, n, ret = 0, rc;
+
+	if (!list)
+		return -1;
+	n = imageList (list);
+	for (i = 0; i < n; i++)
+	{
+		if (__atomic_load_n (&list[i]->writebackDirty, __ATOMIC_RELAXED))
+		{
+			rc = writebackFlush (list[i]);
+			if (RT_FAILURE (rc) && RT_SUCCESS (ret))
+				ret = rc;
+		}
+		imageRelease (list[i]);
+	}
+	free (list);
+	return ret;
+}
+
+/**
+ * Background flusher, writes dirty blocks out on the size and age thresholds
+ * @param u UNUSED
+ */
+static void *
+writebackThread (void *u UNUSED)
+{
+	struct timespec wake;
+	Image **list = malloc (IMAGES_MAX * sizeof (Image *));
+	uint64_t seen = 0;
+	int i, n;
+
+// A writer that finds the budget exceeded counts a wake-up under
+// writebackWakeMutex, so one that comes while a pass runs is not lost
+
+	for (; list;)
+	{
+		clock_gettime (CLOCK_REALTIME, &wake);
+		wake.tv_sec++;
+		pthread_mutex_lock (&writebackWakeMutex);
+		if (writebackWakes == seen && !writebackStop)
+			pthread_cond_timedwait (&writebackCond, &writebackWakeMutex, &wake);
+		seen = writebackWakes;
+		if (writebackStop)
+		{
+			pthread_mutex_unlock (&writebackWakeMutex);
+			break;
+		}
+		pthread_mutex_unlock (&writebackWakeMutex);
+
+		if (!__atomic_load_n (&writebackDirty, __ATOMIC_RELAXED))
+			continue;
+		n = imageList (list);
+		for (i = 0; i < n; i++)
+		{
+			Image *img = list[i];
+
+			if ((uint64_t) __atomic_load_n (&writebackDirty, __ATOMIC_RELAXED) * cacheBlock
+					>= writebackMax
+					|| (__atomic_load_n (&img->writebackDirty, __ATOMIC_RELAXED)
+							&& time (NULL) - __atomic_load_n (&img->writebackOldest, __ATOMIC_RELAXED)
+							>= writebackAge))
+				writebackFlush (img);
+			imageRelease (img);
+		}
+	}
+	free (list);
+	return NULL;
+}
+
+/**
+ * Make everything written to an image so far durable: write back dirty blocks
+ * and flush the disk.  Callers that arrive while a commit is running wait for it
+ * and are then served together by a single following commit.
+ * @param img Image
+ * @return VBox status code
+ */
+int
+groupCommit (Image * img)
+{
+	uint64_t ticket, batch;
+	int ret;
+
+	pthread_mutex_lock (&img->commitMutex);
+	ticket = ++img->commitRequested;
+	while (img->commitDone < ticket)
+	{
+		if (img->committing)
+		{
+			pthread_cond_wait (&img->commitCond, &img->commitMutex);
+			continue;
+		}
+		img->committing = 1;
+		batch = img->commitRequested;
+		pthread_mutex_unlock (&img->commitMutex);
+
+		ret = writebackFlush (img);
+		traceLock (&img->diskMutex);
+		if (RT_SUCCESS (ret))
+			ret = DISKflush (img);
+		else
+			DISKflush (img);
+		pthread_mutex_unlock (&img->diskMutex);
+
+		pthread_mutex_lock (&img->commitMutex);
+		img->committing = 0;
+		img->commitDone = batch;
+		img->commitResult = ret;
+		img->commitFlushes++;
+		pthread_cond_broadcast (&img->commitCond);
+	}
+	ret = img->commitResult;
+	pthread_mutex_unlock (&img->commitMutex);
+	return ret;
+}
+
+/**
+ * Format the cache counters for the stats file.  The write back and commit
+ * counters are summed over all images.
+ * @param buf out: text, one "name value" pair per line
+ * @param size Size of buf
+ * @return number of characters written
+ */
+size_t
+cacheStats (char *buf, size_t size)
+{
+	uint64_t hits = 0, misses = 0, evictions = 0, waits = 0;
+	uint64_t runs = 0, bytes = 0, requests = 0, flushes = 0;
+	Image **list = malloc (IMAGES_MAX * sizeof (Image *));
+	CacheFile *f;
+	size_t len = 0;
+	int i, n = 0, files = 0;
+
+	for (i = 0; i < CACHE_SHARDS && cacheSize; i++)
+	{
+		pthread_mutex_lock (&cacheShards[i].mutex);
+		hits += cacheShards[i].hits;
+		misses += cacheShards[i].misses;
+		evictions += cacheShards[i].evictions;
+		waits += cacheShards[i].pendingWaits;
+		pthread_mutex_unlock (&cacheShards[i].mutex);
+	}
+	if (list)
+		n = imageList (list);
+	for (i = 0; i < n; i++)
+	{
+		runs += list[i]->writebackRuns;
+		bytes += list[i]->writebackBytes;
+		requests += list[i]->commitRequested;
+		flushes += list[i]->commitFlushes;
+		imageRelease (list[i]);
+	}
+	free (list);
+	pthread_mutex_lock (&cacheFilesMutex);
+	for (f = cacheFiles; f; f = f->next)
+		files++;
+	pthread_mutex_unlock (&cacheFilesMutex);
+
+	if (daemonMode)
+		len = snprintf (buf, size, "images %d\n", n);
+	return len + snprintf (buf + len, size - len,
+												 "cache.size %llu\n"
+												 "cache.block %llu\n"
+												 "cache.hits %llu\n"
+												 "cache.misses %llu\n"
+												 "cache.evictions %llu\n"
+												 "cache.prefetch_waits %llu\n"
+												 "cache.files %d\n"
+												 "cache.pages %s\n"
+												 "writeback.dirty %llu\n"
+												 "writeback.runs %llu\n"
+												 "writeback.bytes %llu\n"
+												 "commit.requests %llu\n"
+												 "commit.flushes %llu\n",
+												 (unsigned long long) cacheSize,
+												 (unsigned long long) cacheBlock,
+												 (unsigned long long) hits,
+												 (unsigned long long) misses,
+												 (unsigned long long) evictions,
+												 (unsigned long long) waits,
+												 files,
+												 bufferPageNames[cachePages],
+												 (unsigned long long) __atomic_load_n (&writebackDirty,
+																															 __ATOMIC_RELAXED) * cacheBlock,
+												 (unsigned long long) runs,
+												 (unsigned long long) bytes,
+												 (unsigned long long) requests,
+												 (unsigned long long) flushes);
+}
+
+//====================================================================================================
+//                                     Background workers and readahead
+//====================================================================================================
+
+/**
+ * Worker thread: run queued tasks forever
+ * @param u UNUSED
+ */
+static void *
+taskWorker (void *u UNUSED)
+{
+	Task *t;
+
+	for (;;)
+	{
+		pthread_mutex_lock (&taskMutex);
+		while (!taskHead)
+			pthread_cond_wait (&taskCond, &taskMutex);
+		t = taskHead;
+		if (!(taskHead = t->next))
+			taskTail = NULL;
+		taskRunning++;
+		pthread_mutex_unlock (&taskMutex);
+
+		t->run (t->arg);
+		free (t);
+
+		pthread_mutex_lock (&taskMutex);
+		if (--taskRunning == 0 && !taskHead)
+			pthread_cond_broadcast (&taskIdleCond);
+		pthread_mutex_unlock (&taskMutex);
+	}
+	return NULL;
+}
+
+/**
+ * Wait until every queued task has run, including the tasks those queue.  The
+ * caller must make sure nothing else queues tasks meanwhile.
+ */
+static void
+taskDrain (void)
+{
+	pthread_mutex_lock (&taskMutex);
+	while (taskHead || taskRunning)
+		pthread_cond_wait (&taskIdleCond, &taskMutex);
+	pthread_mutex_unlock (&taskMutex);
+}
+
+/**
+ * Start the background worker threads.  Must be called after fuse has
+ * daemonised, since threads do not survive the fork.
+ * @param threads Number of worker threads
+ */
+void
+taskInit (int threads)
+{
+	pthread_t tid;
+
+	for (; threads > 0; threads--)
+	{
+		if (pthread_create (&tid, NULL, taskWorker, NULL) != 0)
+			break;
+		pthread_detach (tid);
+		taskThreads++;
+	}
+}
+
+/**
+ * Queue a function for one of the background workers
+ * @param run Function to call
+ * @param arg Argument, owned by run from now on
+ * @return 0 or -1 if there are no workers or no memory
+ */
+int
+taskSubmit (void (*run) (void *), void *arg)
+{
+	Task *t;
+
+	if (!taskThreads || !(t = malloc (sizeof (Task))))
+		return -1;
+	t->run = run;
+	t->arg = arg;
+	t->next = NULL;
+
+	pthread_mutex_lock (&taskMutex);
+	if (taskTail)
+		taskTail->next = t;
+	else
+		taskHead = t;
+	taskTail = t;
+	pthread_cond_signal (&taskCond);
+	pthread_mutex_unlock (&taskMutex);
+	return 0;
+}
+
+//
+// Reads that span several blocks of the image are split on the block boundaries,
+// so that a VDI or VHD image whose blocks are scattered over its file is read at
+// a queue depth above one.  The caller queues a task per extra piece and then
+// claims pieces itself like any worker.  Nobody ever waits for a piece that has
+// not been started, so a worker may split a read too (readahead does).  Only
+// reads are split: writes all go through the single writable VBoxDDU handle.
+//
+
+/**
+ * Drop a reference to a split read and free it with the last one
+ * @param s Split read
+ */
+static void
+splitRelease (SplitRead * s)
+{
+	if (__sync_sub_and_fetch (&s->refs, 1) == 0)
+	{
+		pthread_mutex_destroy (&s->mutex);
+		pthread_cond_destroy (&s->cond);
+		free (s);
+	}
+}
+
+/**
+ * Read pieces of a split read until there are none left to claim
+ * @param s Split read
+ */
+static void
+splitRun (SplitRead * s)
+{
+	uint64_t block = s->image->splitBlock;
+	uint64_t from, to;
+	int i, ret;
+
+	while ((i = __sync_fetch_and_add (&s->next, 1)) < s->pieces)
+	{
+		from = (s->first + i * s->per) * block;
+		to = from + s->per * block;
+		if (from < s->offset)
+			from = s->offset;
+		if (to > s->offset + s->len)
+			to = s->offset + s->len;
+		ret = poolRead (s->image, from, s->buf + (from - s->offset), to - from);
+
+		pthread_mutex_lock (&s->mutex);
+		if (RT_FAILURE (ret) && RT_SUCCESS (s->result))
+			s->result = ret;
+		if (++s->done == s->pieces)
+			pthread_cond_signal (&s->cond);
+		pthread_mutex_unlock (&s->mutex);
+	}
+}
+
+/**
+ * Worker side of a split read
+ * @param arg SplitRead
+ */
+static void
+splitWorker (void *arg)
+{
+	splitRun (arg);
+	splitRelease (arg);
+}
+
+/**
+ * How many reads of an image can usefully run at once
+ * @param img Image
+ * @return 1 if reads are serialised anyway
+ */
+static int
+splitWays (Image * img)
+{
+	int ways = taskThreads ? ioThreads + 1 : 1;
+
+#ifndef NO_IO_URING
+	if (img->backend->map && __atomic_load_n (&ioUringActive, __ATOMIC_RELAXED))
+		return 1;								// a single ring read has every block in flight
+#endif
+	if (img->backend->concurrent)
+		return ways;
+#ifndef NO_VBOX
+	if (img->readPoolSize > 1)
+		return (img->readPoolSize < ways) ? img->readPoolSize : ways;
+#endif
+	return 1;
+}
+
+/**
+ * Read from the disk, in parallel pieces if the read spans several blocks of
+ * the image
+ * @param img Image
+ * @param offset Offset into the disk in bytes
+ * @param buf out: Data read
+ * @param len Number of bytes to read
+ * @return VBox status code
+ */
+int
+splitRead (Image * img, uint64_t offset, char *buf, size_t len)
+{
+	uint64_t block = img->splitBlock;
+	uint64_t blocks = len ? (offset + len - 1) / block - offset / block + 1 : 0;
+	int ways = splitWays (img);
+	SplitRead *s;
+	int i, ret;
+
+	if (ways < 2 || blocks < 2 || !(s = calloc (1, sizeof (SplitRead))))
+		return poolRead (img, offset, buf, len);
+	s->image = img;
+	s->offset = offset;
+	s->buf = buf;
+	s->len = len;
+	s->first = offset / block;
+	s->per = (blocks + ways - 1) / ways;
+	s->pieces = (blocks + s->per - 1) / s->per;
+	s->result = 0;
+	s->refs = 1;
+	pthread_mutex_init (&s->mutex, NULL);
+	pthread_cond_init (&s->cond, NULL);
+
+	for (i = 1; i < s->pieces; i++)
+	{
+		__sync_fetch_and_add (&s->refs, 1);
+		if (taskSubmit (splitWorker, s) < 0)
+		{
+			__sync_fetch_and_sub (&s->refs, 1);
+			break;
+		}
+	}
+	splitRun (s);
+
+	pthread_mutex_lock (&s->mutex);
+	while (s->done < s->pieces)
+		pthread_cond_wait (&s->cond, &s->mutex);
+	ret = s->result;
+	pthread_mutex_unlock (&s->mutex);
+
+	__sync_fetch_and_add (&splitReads, 1);
+	__sync_fetch_and_add (&splitPieces, s->pieces);
+	splitRelease (s);
+	return ret;
+}
+
+/**
+ * Worker side of readahead
+ * @param arg ReadaheadJob
+ */
+static void
+readaheadRun (void *arg)
+{
+	ReadaheadJob *job = arg;
+	cachePrefetch (job->image, job->offset, job->len);
+	imageRelease (job->image);
+	free (job);
+	__sync_fetch_and_sub (&readaheadQueued, 1);
+}
+
+/**
+ * Track the access pattern of a handle after a read and queue readahead.  A
+ * handle turns sequential after READAHEAD_TRIGGER reads that each start where
+ * the previous one ended.  The window then starts at twice the read size and
+ * doubles every time it is refilled, up to readaheadMax.  Any other access
+ * turns readahead off again.
+ * @param fh Handle the read was made through
+ * @param offset Offset of the read into the partition
+ * @param len Length of the read
+ */
+void
+readaheadUpdate (FileHandle * fh, uint64_t offset, size_t len)
+{
+	Partition *p = fh->partition;
+	ReadaheadJob *job;
+	uint64_t end = offset + len;
+	uint64_t target, start;
+
+	pthread_mutex_lock (&fh->mutex);
+	if (offset != fh->nextOffset)
+	{
+		fh->sequential = 0;
+		fh->raWindow = 0;
+		fh->raEnd = 0;
+	}
+	else
+		fh->sequential++;
+	fh->nextOffset = end;
+
+	if (fh->sequential < READAHEAD_TRIGGER)
+	{
+		pthread_mutex_unlock (&fh->mutex);
+		return;
+	}
+
+	if (!fh->raWindow)
+		fh->raWindow = (2 * len > readaheadMax) ? readaheadMax : 2 * len;
+	target = end + fh->raWindow;
+	if (target > p->size)
+		target = p->size;
+	start = (fh->raEnd > end) ? fh->raEnd : end;
+
+// Refill once the reader has eaten into the second half of the window
+
+	if (target <= start || target - start < fh->raWindow / 2)
+	{
+		pthread_mutex_unlock (&fh->mutex);
+		return;
+	}
+
+// With the workers behind, more jobs would only queue up prefetches that the
+// reader overtakes.  The window is left as it is, so the next read tries again.
+
+	if (__sync_add_and_fetch (&readaheadQueued, 1) > READAHEAD_QUEUE_MAX)
+	{
+		__sync_fetch_and_sub (&readaheadQueued, 1);
+		__sync_fetch_and_add (&readaheadSkipped, 1);
+		pthread_mutex_unlock (&fh->mutex);
+		return;
+	}
+	fh->raEnd = target;
+	if (fh->raWindow < readaheadMax)
+		fh->raWindow = (2 * fh->raWindow > readaheadMax) ? readaheadMax : 2 * fh->raWindow;
+	pthread_mutex_unlock (&fh->mutex);
+
+	if (!(job = malloc (sizeof (ReadaheadJob))))
+	{
+		__sync_fetch_and_sub (&readaheadQueued, 1);
+		return;
+	}
+	job->image = fh->image;
+	job->offset = p->offset + start;
+	job->len = target - start;
+	__sync_fetch_and_add (&job->image->refs, 1);
+	if (taskSubmit (readaheadRun, job) < 0)
+	{
+		imageRelease (job->image);
+		free (job);
+		__sync_fetch_and_sub (&readaheadQueued, 1);
+		return;
+	}
+	__sync_fetch_and_add (&readaheadJobs, 1);
+	__sync_fetch_and_add (&readaheadBytes, target - start);
+}
+
+/**
+ * Start the worker, tracing and write back threads, and the profile replay of
+ * the images opened so far.  Must be called after daemonising.
+ */
+void
+backgroundInit (void)
+{
+	int i;
+
+	traceInit ();
+	taskInit ((readaheadMax ? READAHEAD_THREADS : 0) + ioThreads);
+#ifndef NO_IO_URING
+	if (ioUring && pthread_key_create (&ioRingKey, ioRingFree) == 0)
+		ioUringActive = 1;
+#endif
+	if (writeBack && pthread_create (&writebackTid, NULL, writebackThread, NULL) == 0)
+		writebackStarted = 1;
+	for (i = 0; i < imageCount; i++)
+		if (images[i])
+			profileStart (images[i]);
+}
+
+/**
+ * Stop the write back thread and let the workers finish the queued tasks, so
+ * that no background work holds on to an image any more.  Requests must have
+ * stopped coming in.
+ */
+void
+backgroundStop (void)
+{
+	if (writebackStarted)
+	{
+		pthread_mutex_lock (&writebackWakeMutex);
+		writebackStop = 1;
+		pthread_cond_signal (&writebackCond);
+		pthread_mutex_unlock (&writebackWakeMutex);
+		pthread_join (writebackTid, NULL);
+		writebackStarted = 0;
+	}
+	taskDrain ();
+}
+
+//====================================================================================================
+//                                              Tracing
+//====================================================================================================
+//
+// The FUSE callbacks must not block on tracing, so every thread writes events
+// into a ring of its own, and a background thread drains the rings into
+// per-operation, per-partition latency histograms of each image (and prints the
+// events with -v).  A ring has one writer, its thread, and one reader, whoever holds
+// traceMutex, so head and tail are all the synchronisation it needs.  When a
+// ring is full the event is dropped and counted.  Rings are never freed; the
+// ring of a thread that exits is taken over by the next new thread.
+
+/**
+ * @return monotonic time in nanoseconds
+ */
+uint64_t
+traceClock (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Lock a mutex, adding the time spent waiting for it to the current operation
+ * @param m Mutex
+ */
+void
+traceLock (pthread_mutex_t * m)
+{
+	uint64_t start;
+
+	if (pthread_mutex_trylock (m) == 0)
+		return;
+	start = traceClock ();
+	pthread_mutex_lock (m);
+	traceLockNs += traceClock () - start;
+}
+
+/**
+ * Start timing an operation on this thread
+ * @return start time for traceEnd
+ */
+uint64_t
+traceBegin (void)
+{
+	traceLockNs = 0;
+	traceBackendNs = 0;
+	return traceClock ();
+}
+
+/**
+ * Give up the ring of an exiting thread
+ * @param ring TraceRing
+ */
+static void
+traceRingRelease (void *ring)
+{
+	__atomic_store_n (&((TraceRing *) ring)->owned, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @return the ring of this thread, or NULL if none can be allocated
+ */
+static TraceRing *
+traceRingGet (void)
+{
+	TraceRing *r;
+
+	if (traceRing)
+		return traceRing;
+	for (r = __atomic_load_n (&traceRings, __ATOMIC_ACQUIRE); r; r = r->next)
+		if (!__atomic_load_n (&r->owned, __ATOMIC_RELAXED)
+				&& __sync_bool_compare_and_swap (&r->owned, 0, 1))
+			break;
+	if (!r)
+	{
+		if (!(r = calloc (1, sizeof (TraceRing))))
+			return NULL;
+		r->owned = 1;
+		do
+			r->next = __atomic_load_n (&traceRings, __ATOMIC_RELAXED);
+		while (!__sync_bool_compare_and_swap (&traceRings, r->next, r));
+	}
+	pthread_setspecific (traceKey, r);
+	return traceRing = r;
+}
+
+/**
+ * Record a finished operation
+ * @param op TRACE_xxx
+ * @param img Image the operation was on or NULL
+ * @param slot Partition number or TRACE_OTHER
+ * @param ino Inode the operation was on
+ * @param offset Offset of a read or write
+ * @param len Length of a read or write
+ * @param error errno the request was answered with
+ * @param start Result of traceBegin
+ */
+void
+traceEnd (int op, Image * img, int slot, uint64_t ino, uint64_t offset,
+					size_t len, int error, uint64_t start)
+{
+	TraceRing *r = traceRingGet ();
+	TraceEvent *e;
+	uint64_t head;
+
+	if (!r)
+	{
+		__sync_fetch_and_add (&traceDropped, 1);
+		return;
+	}
+	head = r->head;
+	if (head - __atomic_load_n (&r->tail, __ATOMIC_ACQUIRE) >= TRACE_RING)
+	{
+		__sync_fetch_and_add (&traceDropped, 1);
+		return;
+	}
+	e = r->events + head % TRACE_RING;
+	e->op = op;
+	e->slot = slot;
+	e->error = error;
+	e->len = len;
+	e->image = img ? img->id : 0;
+	e->ino = ino;
+	e->offset = offset;
+	e->latency = traceClock () - start;
+	e->lockWait = traceLockNs;
+	e->backend = traceBackendNs;
+	__atomic_store_n (&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Find the histogram an event belongs to.  The inode tells the slot of the
+ * image, the id makes sure it is still the same image.  Operations outside any
+ * image count for the single image, or globally in daemon mode.  traceMutex and
+ * imagesLock must be held.
+ * @param e Event
+ * @return histogram or NULL if the image is gone
+ */
+static TraceHistogram *
+traceHistogram (TraceEvent * e)
+{
+	int slot = INO_SLOT (e->ino);
+	Image *img;
+
+	if (!e->image && daemonMode)
+		return &traceGlobal[e->op];
+	if (!(img = images[slot < 0 ? 0 : slot]) || (e->image && e->image != img->id))
+		return NULL;
+	if (!img->traceHistograms
+			&& !(img->traceHistograms = calloc (TRACE_OPS, sizeof (*img->traceHistograms))))
+		return NULL;
+	return &img->traceHistograms[e->op][e->slot];
+}
+
+/**
+ * Move all queued events into the histograms.  traceMutex must be held.
+ */
+static void
+traceDrain (void)
+{
+	TraceRing *r;
+
+	pthread_rwlock_rdlock (&imagesLock);
+	for (r = __atomic_load_n (&traceRings, __ATOMIC_ACQUIRE); r; r = r->next)
+	{
+		uint64_t head = __atomic_load_n (&r->head, __ATOMIC_ACQUIRE);
+		uint64_t tail = r->tail;
+
+		for (; tail < head; tail++)
+		{
+			TraceEvent *e = r->events + tail % TRACE_RING;
+			TraceHistogram *h = traceHistogram (e);
+			uint64_t us = e->latency / 1000;
+			int b = 0;
+
+			traceEvents++;
+			if (verbose)
+				printf ("%s: ino %llu, offset=%llu, length=%u: %d (%lluus, lock wait %lluus, backend %lluus)\n",
+								traceOpNames[e->op], (unsigned long long) e->ino,
+								(unsigned long long) e->offset, e->len, e->error,
+								(unsigned long long) e->latency / 1000,
+								(unsigned long long) e->lockWait / 1000,
+								(unsigned long long) e->backend / 1000);
+			if (!h)
+				continue;
+			while (us && b < TRACE_BUCKETS - 1)
+			{
+				us >>= 1;
+				b++;
+			}
+			h->buckets[b]++;
+			h->count++;
+			h->total += e->latency;
+			h->lockWait += e->lockWait;
+			h->backend += e->backend;
+			if (e->latency > h->max)
+				h->max = e->latency;
+		}
+		__atomic_store_n (&r->tail, tail, __ATOMIC_RELEASE);
+	}
+	pthread_rwlock_unlock (&imagesLock);
+	if (verbose)
+		fflush (stdout);
+}
+
+/**
+ * Background drainer
+ * @param u UNUSED
+ */
+static void *
+traceThread (void *u UNUSED)
+{
+	struct timespec interval = { 0, TRACE_INTERVAL_MS * 1000000 };
+
+	for (;;)
+	{
+		nanosleep (&interval, NULL);
+		pthread_mutex_lock (&traceMutex);
+		traceDrain ();
+		pthread_mutex_unlock (&traceMutex);
+	}
+	return NULL;
+}
+
+/**
+ * Start the drainer.  Must be called after fuse has daemonised.
+ */
+void
+traceInit (void)
+{
+	pthread_t tid;
+
+	pthread_key_create (&traceKey, traceRingRelease);
+	if (pthread_create (&tid, NULL, traceThread, NULL) == 0)
+		pthread_detach (tid);
+}
+
+/**
+ * Upper bound of the histogram bucket that holds a percentile
+ * @param h Histogram
+ * @param percent Percentile
+ * @return latency in microseconds
+ */
+static uint64_t
+tracePercentile (TraceHistogram * h, int percent)
+{
+	uint64_t rank = (h->count * percent + 99) / 100;
+	uint64_t seen = 0;
+	int b;
+
+	for (b = 0; b < TRACE_BUCKETS - 1; b++)
+		if ((seen += h->buckets[b]) >= rank)
+			break;
+	return (uint64_t) 1 << b;
+}
+
+/**
+ * @return number of histograms with data, to size the stats buffer
+ */
+static int
+traceSeries (void)
+{
+	int i, op, slot, n = 0;
+
+	pthread_mutex_lock (&traceMutex);
+	pthread_rwlock_rdlock (&imagesLock);
+	for (op = 0; op < TRACE_OPS; op++)
+		if (traceGlobal[op].count)
+			n++;
+	for (i = 0; i < imageCount; i++)
+		if (images[i] && images[i]->traceHistograms)
+			for (op = 0; op < TRACE_OPS; op++)
+				for (slot = 0; slot < TRACE_SLOTS; slot++)
+					if (images[i]->traceHistograms[op][slot].count)
+						n++;
+	pthread_rwlock_unlock (&imagesLock);
+	pthread_mutex_unlock (&traceMutex);
+	return n;
+}
+
+/**
+ * Print one latency histogram: the number of operations, total, maximum and
+ * percentile latencies, the parts of the total spent waiting for the disk lock
+ * (or a read handle) and inside the backend, and the bucket counts, bucket b
+ * counting latencies below 2^b microseconds.
+ * @param buf out: Text
+ * @param size Size of buf
+ * @param series Name of the series
+ * @param h Histogram
+ * @return length of the text
+ */
+static size_t
+traceFormat (char *buf, size_t size, const char *series, TraceHistogram * h)
+{
+	size_t len;
+	int b, last;
+
+	len = snprintf (buf, size,
+									"%s.count %llu\n"
+									"%s.total_us %llu\n"
+									"%s.max_us %llu\n"
+									"%s.p50_us %llu\n"
+									"%s.p99_us %llu\n"
+									"%s.lockwait_us %llu\n"
+									"%s.backend_us %llu\n"
+									"%s.histogram",
+									series, (unsigned long long) h->count,
+									series, (unsigned long long) h->total / 1000,
+									series, (unsigned long long) h->max / 1000,
+									series, (unsigned long long) tracePercentile (h, 50),
+									series, (unsigned long long) tracePercentile (h, 99),
+									series, (unsigned long long) h->lockWait / 1000,
+									series, (unsigned long long) h->backend / 1000,
+									series);
+	for (last = TRACE_BUCKETS - 1; last > 0 && !h->buckets[last]; last--)
+		;
+	for (b = 0; b <= last && len < size; b++)
+		len += snprintf (buf + len, size - len, " %llu",
+										 (unsigned long long) h->buckets[b]);
+	if (len < size)
+		len += snprintf (buf + len, size - len, "\n");
+	return len;
+}
+
+/**
+ * Print the latency histograms of all images.  In daemon mode the series names
+ * include the image name.
+ * @param buf out: Text
+ * @param size Size of buf
+ * @return length of the text
+ */
+size_t
+traceStats (char *buf, size_t size)
+{
+	size_t len = 0;
+	int i, op, slot;
+
+	pthread_mutex_lock (&traceMutex);
+	traceDrain ();
+	pthread_rwlock_rdlock (&imagesLock);
+	for (op = 0; op < TRACE_OPS && len < size; op++)
+	{
+		char series[64 + IMAGE_NAME_MAX];
+
+		if (traceGlobal[op].count)
+		{
+			snprintf (series, sizeof (series), "latency.%s.other", traceOpNames[op]);
+			len += traceFormat (buf + len, size - len, series, &traceGlobal[op]);
+		}
+		for (i = 0; i < imageCount && len < size; i++)
+		{
+			Image *img = images[i];
+			char prefix[IMAGE_NAME_MAX + 2] = "";
+
+			if (!img || !img->traceHistograms)
+				continue;
+			if (daemonMode)
+				snprintf (prefix, sizeof (prefix), "%s.", img->name);
+			for (slot = 0; slot < TRACE_SLOTS && len < size; slot++)
+			{
+				TraceHistogram *h = &img->traceHistograms[op][slot];
+
+				if (!h->count)
+					continue;
+				if (slot == TRACE_OTHER)
+					snprintf (series, sizeof (series), "latency.%s.%sother",
+										traceOpNames[op], prefix);
+				else if (slot == 0)
+					snprintf (series, sizeof (series), "latency.%s.%sEntireDisk",
+										traceOpNames[op], prefix);
+				else
+					snprintf (series, sizeof (series), "latency.%s.%sPartition%d",
+										traceOpNames[op], prefix, slot);
+				len += traceFormat (buf + len, size - len, series, h);
+			}
+		}
+	}
+	pthread_rwlock_unlock (&imagesLock);
+	if (len >= size)
+	{
+		pthread_mutex_unlock (&traceMutex);
+		return size - 1;
+	}
+	len += snprintf (buf + len, size - len,
+									 "trace.events %llu\n"
+									 "trace.dropped %llu\n",
+									 (unsigned long long) traceEvents,
+									 (unsigned long long) traceDropped);
+	pthread_mutex_unlock (&traceMutex);
+	return (len >= size) ? size - 1 : len;
+}
+
+//====================================================================================================
+//                                        Statistics virtual file
+//====================================================================================================
+
+/**
+ * Take a snapshot of all counters for a reader of STATSFILE.  The contents are
+ * generated once at open time so that a reader sees a consistent view.
+ * @return handle holding the text or NULL
+ */
+FileHandle *
+statsOpen (void)
+{
+	FileHandle *fh = calloc (1, sizeof (FileHandle));
+	size_t size = 4096 + traceSeries () * 1024;
+
+	if (!fh || !(fh->data = malloc (size)))
+	{
+		free (fh);
+		return NULL;
+	}
+	fh->size = cacheStats (fh->data, size);
+	fh->size += snprintf (fh->data + fh->size, size - fh->size,
+												"readahead.max %llu\n"
+												"readahead.jobs %llu\n"
+												"readahead.bytes %llu\n"
+												"readahead.skipped %llu\n"
+												"split.reads %llu\n"
+												"split.pieces %llu\n"
+												"io.engine %s\n"
+												"io.uring.batches %llu\n"
+												"io.uring.requests %llu\n"
+												"hash.engine %s\n"
+												"hash.blocks %llu\n"
+												"hash.holes %llu\n"
+												"hash.reused %llu\n"
+												"range.waits %llu\n"
+												"zero.skipped %llu\n"
+												"discard.bytes %llu\n"
+												"profile.recorded %llu\n"
+												"profile.replayed %llu\n"
+												"buffer.size %d\n"
+												"buffer.count %llu\n"
+												"buffer.used %llu\n"
+												"buffer.peak %llu\n"
+												"buffer.fallbacks %llu\n"
+												"buffer.pages %s\n",
+												(unsigned long long) readaheadMax,
+												(unsigned long long) readaheadJobs,
+												(unsigned long long) readaheadBytes,
+												(unsigned long long) readaheadSkipped,
+												(unsigned long long) splitReads,
+												(unsigned long long) splitPieces,
+												ioEngine (),
+												(unsigned long long) ioBatches,
+												(unsigned long long) ioRequests,
+												(sha256Engine > 0) ? "sha-ni" : "c",
+												(unsigned long long) hashBlocks,
+												(unsigned long long) hashHoles,
+												(unsigned long long) hashReused,
+												(unsigned long long) rangeWaits,
+												(unsigned long long) zeroSkipped,
+												(unsigned long long) discardBytes,
+												(unsigned long long) profileRecorded,
+												(unsigned long long) profileReplayed,
+												BUFFER_SIZE,
+												(unsigned long long) bufferCount,
+												(unsigned long long) bufferUsed,
+												(unsigned long long) bufferPeak,
+												(unsigned long long) bufferFallbacks,
+												bufferPageNames[bufferPages]);
+	fh->size += traceStats (fh->data + fh->size, size - fh->size);
+	return fh;
+}
+
+//====================================================================================================
+//                                       Images and the control file
+//====================================================================================================
+//
+// images[] is only changed under the write lock of imagesLock.  Anyone who
+// uses an image after dropping the lock holds a reference, and the image is
+// closed when the last one goes.  In daemon mode, writing "add NAME FILE
+// [SNAPSHOT...]" or "remove NAME" to CONTROLFILE adds or removes an image, one
+// command per line.
+
+static __thread char imageError[256];	// message returned by imageOpen
+
+/**
+ * Open an image and read its partition table.  The image is not visible until
+ * it is added with imageAdd.
+ * @param name Subdirectory in daemon mode, ignored otherwise
+ * @param filename Base image file
+ * @param snapshots Snapshot files to load on top of it, bottom up
+ * @param count Number of snapshots, at most DIFFERENCING_MAX
+ * @param error out: the reason if the image cannot be opened
+ * @return the image or NULL
+ */
+Image *
+imageOpen (const char *name, const char *filename, char **snapshots, int count,
+					 const char **error)
+{
+	Image *img = calloc (1, sizeof (Image));
+	int i;
+
+	*error = "out of memory";
+	if (!img)
+		return NULL;
+	snprintf (img->name, sizeof (img->name), "%s", name);
+	img->id = __sync_add_and_fetch (&imageIds, 1) & 0xffffff;
+	img->diskType = diskType;
+	pthread_mutex_init (&img->diskMutex, NULL);
+	pthread_mutex_init (&img->partMutex, NULL);
+	pthread_mutex_init (&img->rangeMutex, NULL);
+	pthread_cond_init (&img->rangeCond, NULL);
+	pthread_mutex_init (&img->hashMutex, NULL);
+	pthread_mutex_init (&img->writebackMutex, NULL);
+	pthread_mutex_init (&img->commitMutex, NULL);
+	pthread_cond_init (&img->commitCond, NULL);
+	pthread_mutex_init (&img->profileMutex, NULL);
+	if (!(img->filename = strdup (filename)))
+		goto fail;
+	for (i = 0; i < count; i++)
+	{
+		if (!(img->differencing[i] = strdup (snapshots[i])))
+			goto fail;
+		img->differencingLen = i + 1;
+	}
+
+	*error = imageError;
+	if (stat (filename, &img->fileStat) < 0
+			|| access (filename, F_OK | R_OK | ((!readonly) ? W_OK : 0)) < 0)
+	{
+		snprintf (imageError, sizeof (imageError), "cannot access imagefile %s",
+							filename);
+		goto fail;
+	}
+	for (i = 0; i < count; i++)
+		if (access (snapshots[i], F_OK | R_OK | ((readonly) ? 0 : W_OK)) < 0)
+		{
+			snprintf (imageError, sizeof (imageError),
+								"cannot access differencing imagefile %s", snapshots[i]);
+			goto fail;
+		}
+	sidecarLoad (img);
+	if (strcmp ("auto", img->diskType) == 0
+			&& sidecarDiskType (img, 0, &img->diskType) < 0
+			&& detectDiskType (&img->diskType, img->filename) < 0)
+	{
+		snprintf (imageError, sizeof (imageError),
+							"cannot autodetect disk type of %s", filename);
+		goto fail;
+	}
+
+// Plain VDI images mounted readonly are read directly, everything else goes
+// through VBoxDDU
+
+	if (native && readonly && strcmp (img->diskType, "VDI") == 0
+			&& vdiOpen (img, 0) == 0)
+	{
+		vbprintf ("using native VDI backend");
+	}
+	else
+	{
+#ifdef NO_VBOX
+		*error = "built without VBoxDDU, only readonly plain VDI images are supported";
+		goto fail;
+#else
+		for (i = 0; i < count; i++)
+			if (sidecarDiskType (img, i + 1, &img->differencingType[i]) < 0
+					&& detectDiskType (&img->differencingType[i], img->differencing[i]) < 0)
+			{
+				snprintf (imageError, sizeof (imageError),
+									"cannot autodetect disk type of %s", snapshots[i]);
+				goto fail;
+			}
+
+// A single writable image is opened for discarding if its backend supports it.
+// Write back does not discard: a discard would have to write back and flush
+// everything dirty first, which is what write back is there to put off.
+
+		*error = "opening vbox image failed";
+		if (!readonly && !count && !writeBack
+				&& openDiskChain (img, &img->hdDisk,
+													VD_OPEN_FLAGS_NORMAL | VD_OPEN_FLAGS_DISCARD) == 0)
+			img->discard = 1;
+		else if (openDiskChain (img, &img->hdDisk,
+														readonly ? VD_OPEN_FLAGS_READONLY : VD_OPEN_FLAGS_NORMAL) < 0)
+			goto fail;
+		img->backend = &vboxBackend;
+
+// The read pool handles see the same chain as hdDisk but are only ever read from.
+// Opening them writable would leave their cached block maps stale after a write
+// on hdDisk, which is why -n is restricted to readonly mounts.
+
+		for (i = 0; i < readers; i++)
+		{
+			vbprintf ("Opening read handle %d", i + 1);
+			if (openDiskChain (img, &img->readPool[i].disk, VD_OPEN_FLAGS_READONLY) < 0)
+				goto fail;
+			pthread_mutex_init (&img->readPool[i].mutex, NULL);
+			img->readPoolSize = i + 1;
+		}
+
+// Writable VDI chains are still written by VBoxDDU, but read natively
+
+		if (native && !readonly && strcmp (img->diskType, "VDI") == 0
+				&& vdiOpen (img, 1) == 0)
+			vbprintf ("using native VDI backend for reads");
+
+// Without the native index there is no block size to align discards to
+
+		img->discard = img->discard && img->backend->discard;
+		if (img->discard)
+			vbprintf ("freeing zeroed and discarded blocks");
+#endif
+	}
+
+	img->splitBlock = img->vdi.layers ? img->vdi.blockSize : SPLIT_BLOCK_DEFAULT;
+	*error = "out of memory";
+	if (!readonly
+			&& !(img->changed = calloc ((DISKsize (img) / ALLOCMAP_BLOCK + 64) / 64,
+																	sizeof (uint64_t))))
+		goto fail;
+	if ((*error = initialisePartitionTable (img)))
+		goto fail;
+	if (sidecarDir && readonly && !img->sidecar)
+		sidecarSave (img);
+	else if (sidecarDir && !readonly)
+		sidecarRemove (img);
+	if (img->sidecar && (void *) img->sidecar != img->vdi.indexMap)
+		munmap (img->sidecar, img->sidecarSize);
+	img->sidecar = NULL;
+	if (profileDir)
+		profileLoad (img);
+	return img;
+
+fail:
+	imageClose (img);
+	return NULL;
+}
+
+/**
+ * Write back and close an image and free it
+ * @param img Image, no longer in images[]
+ */
+static void
+imageClose (Image * img)
+{
+	int i;
+
+	if (img->replayJoin)
+	{
+		__atomic_store_n (&img->replayStop, 1, __ATOMIC_RELAXED);
+		pthread_join (img->replayThread, NULL);
+	}
+	if (img->backend)
+	{
+		if (writeBack)
+			groupCommit (img);
+		if (img->profileSeen)
+			profileSave (img);
+		cachePurge (img->id);
+		DISKclose (img);
+	}
+	if (img->sidecar)
+		munmap (img->sidecar, img->sidecarSize);	// opening failed
+	while (img->partitions)
+	{
+		PartitionTable *t = img->partitions;
+		img->partitions = t->retired;
+		free (t);
+	}
+	while (img->hashMaps)
+	{
+		HashMap *m = img->hashMaps;
+		img->hashMaps = m->next;
+		free (m->hash);
+		free (m->valid);
+		free (m);
+	}
+	for (i = 0; i < img->differencingLen; i++)
+		free (img->differencing[i]);
+	pthread_mutex_destroy (&img->diskMutex);
+	pthread_mutex_destroy (&img->partMutex);
+	pthread_mutex_destroy (&img->rangeMutex);
+	pthread_cond_destroy (&img->rangeCond);
+	pthread_mutex_destroy (&img->hashMutex);
+	pthread_mutex_destroy (&img->writebackMutex);
+	pthread_mutex_destroy (&img->commitMutex);
+	pthread_cond_destroy (&img->commitCond);
+	pthread_mutex_destroy (&img->profileMutex);
+	free (img->changed);
+	free (img->profileSeen);
+	free (img->profile);
+	free (img->replay);
+	free (img->writebackBlocks);
+	free (img->traceHistograms);
+	free (img->filename);
+	free (img);
+}
+
+/**
+ * Make an opened image visible.  In daemon mode the name must be a valid file
+ * name that is not in use yet.
+ * @param img Image returned by imageOpen
+ * @return 0 or -EINVAL, -EEXIST or -ENOSPC
+ */
+int
+imageAdd (Image * img)
+{
+	int i, slot = -1;
+
+	if (daemonMode
+			&& (!img->name[0] || strchr (img->name, '/') || strcmp (img->name, ".") == 0
+					|| strcmp (img->name, "..") == 0 || strcmp (img->name, STATSDIR) == 0))
+		return -EINVAL;
+
+	pthread_rwlock_wrlock (&imagesLock);
+	for (i = 0; i < imageCount; i++)
+	{
+		if (!images[i])
+		{
+			if (slot < 0)
+				slot = i;
+		}
+		else if (strcmp (images[i]->name, img->name) == 0)
+		{
+			pthread_rwlock_unlock (&imagesLock);
+			return -EEXIST;
+		}
+	}
+	if (slot < 0)
+	{
+		if (imageCount == IMAGES_MAX || (!daemonMode && imageCount))
+		{
+			pthread_rwlock_unlock (&imagesLock);
+			return -ENOSPC;
+		}
+		slot = imageCount++;
+	}
+	img->slot = slot;
+	img->refs = 1;
+	images[slot] = img;
+	pthread_rwlock_unlock (&imagesLock);
+	if (daemonMode)
+		vbprintf ("image %s added: %s, %s backend", img->name, img->filename,
+							img->backend->name);
+	return 0;
+}
+
+/**
+ * @param slot Index into images[]
+ * @return the image with a reference held or NULL
+ */
+Image *
+imageGet (int slot)
+{
+	Image *img = NULL;
+
+	pthread_rwlock_rdlock (&imagesLock);
+	if (slot >= 0 && slot < imageCount && (img = images[slot]))
+		__sync_fetch_and_add (&img->refs, 1);
+	pthread_rwlock_unlock (&imagesLock);
+	return img;
+}
+
+/**
+ * @param name Image name
+ * @return the image with a reference held or NULL
+ */
+static Image *
+imageFind (const char *name)
+{
+	Image *img = NULL;
+	int i;
+
+	pthread_rwlock_rdlock (&imagesLock);
+	for (i = 0; i < imageCount && !img; i++)
+		if (images[i] && strcmp (images[i]->name, name) == 0)
+			__sync_fetch_and_add (&(img = images[i])->refs, 1);
+	pthread_rwlock_unlock (&imagesLock);
+	return img;
+}
+
+/**
+ * Take a reference on every image
+ * @param list out: Images, room for IMAGES_MAX
+ * @return number of images
+ */
+int
+imageList (Image ** list)
+{
+	int i, n = 0;
+
+	pthread_rwlock_rdlock (&imagesLock);
+	for (i = 0; i < imageCount; i++)
+		if (images[i])
+		{
+			__sync_fetch_and_add (&images[i]->refs, 1);
+			list[n++] = images[i];
+		}
+	pthread_rwlock_unlock (&imagesLock);
+	return n;
+}
+
+/**
+ * Drop a reference, closing the image if it was the last one
+ * @param img Image
+ */
+void
+imageRelease (Image * img)
+{
+	if (__sync_sub_and_fetch (&img->refs, 1) == 0)
+		imageClose (img);
+}
+
+/**
+ * Remove an image.  It is closed once the last handle on it is released.
+ * @param name Image name
+ * @return 0 or -ENOENT
+ */
+int
+imageRemove (const char *name)
+{
+	Image *img = NULL;
+	int i;
+
+	pthread_rwlock_wrlock (&imagesLock);
+	for (i = 0; i < imageCount && !img; i++)
+		if (images[i] && strcmp (images[i]->name, name) == 0)
+		{
+			img = images[i];
+			images[i] = NULL;
+		}
+	pthread_rwlock_unlock (&imagesLock);
+	if (!img)
+		return -ENOENT;
+	vbprintf ("image %s removed", name);
+	imageRelease (img);
+	return 0;
+}
+
+/**
+ * List the images for a reader of CONTROLFILE, one "name file backend" line each
+ * @return handle holding the text or NULL
+ */
+FileHandle *
+controlOpen (void)
+{
+	FileHandle *fh = calloc (1, sizeof (FileHandle));
+	Image **list = malloc (IMAGES_MAX * sizeof (Image *));
+	size_t size = 1;
+	int i, n;
+
+	if (!fh || !list)
+	{
+		free (fh);
+		free (list);
+		return NULL;
+	}
+	n = imageList (list);
+	for (i = 0; i < n; i++)
+		size += strlen (list[i]->name) + strlen (list[i]->filename)
+			+ strlen (list[i]->backend->name) + 3;
+	if ((fh->data = malloc (size)))
+		for (i = 0; i < n; i++)
+			fh->size += sprintf (fh->data + fh->size, "%s %s %s\n", list[i]->name,
+													 list[i]->filename, list[i]->backend->name);
+	for (i = 0; i < n; i++)
+		imageRelease (list[i]);
+	free (list);
+	if (!fh->data)
+	{
+		free (fh);
+		return NULL;
+	}
+	fh->control = 1;
+	return fh;
+}
+
+/**
+ * Run one control command
+ * @param line Command, split up in place
+ * @return 0 or an errno value
+ */
+static int
+controlCommand (char *line)
+{
+	char *argv[DIFFERENCING_MAX + 3];
+	char *save, *word;
+	const char *error;
+	Image *img;
+	int argc = 0, ret;
+
+	for (word = strtok_r (line, " \t", &save); word; word = strtok_r (NULL, " \t", &save))
+	{
+		if (argc == DIFFERENCING_MAX + 3)
+			return EINVAL;
+		argv[argc++] = word;
+	}
+	if (argc == 0)
+		return 0;
+	if (strcmp (argv[0], "remove") == 0 && argc == 2)
+		return -imageRemove (argv[1]);
+	if (strcmp (argv[0], "add") != 0 || argc < 3)
+		return EINVAL;
+	if (strlen (argv[1]) > IMAGE_NAME_MAX)
+		return EINVAL;
+	if ((img = imageFind (argv[1])))
+	{
+		imageRelease (img);
+		return EEXIST;
+	}
+	if (!(img = imageOpen (argv[1], argv[2], argv + 3, argc - 3, &error)))
+	{
+		fprintf (stderr, "vdfuse: %s: %s\n", argv[1], error);
+		return EIO;
+	}
+	if ((ret = imageAdd (img)) < 0)
+	{
+		imageClose (img);
+		return -ret;
+	}
+	profileStart (img);
+	return 0;
+}
+
+/**
+ * Run the commands written to CONTROLFILE, one per line.  Commands run one at a
+ * time; if one fails, the rest of the write is ignored.
+ * @param data Written data
+ * @param len Length of data
+ * @return 0 or an errno value: EINVAL for a malformed command, EEXIST or ENOENT
+ * for a name that is in use or unknown, ENOSPC if there are too many images and
+ * EIO if the image cannot be opened
+ */
+int
+controlWrite (const char *data, size_t len)
+{
+	char *text, *line, *save;
+	int ret = 0;
+
+	if (len > CONTROL_LINE_MAX)
+		return EINVAL;
+	if (!(text = malloc (len + 1)))
+		return ENOMEM;
+	memcpy (text, data, len);
+	text[len] = 0;
+	pthread_mutex_lock (&controlMutex);
+	for (line = strtok_r (text, "\n", &save); line && !ret;
+			 line = strtok_r (NULL, "\n", &save))
+		ret = controlCommand (line);
+	pthread_mutex_unlock (&controlMutex);
+	free (text);
+	return ret;
+}
+
+//====================================================================================================
+//                                      Allocation map virtual file
+//====================================================================================================
+//
+// Next to every partition there is a readonly <name>.allocmap file.  Bit i (LSB
+// first within each byte) is set when any of the ALLOCMAP_BLOCK bytes at
+// i * ALLOCMAP_BLOCK into the partition is stored in the image; clear bits are
+// known to read as zeros.  Backends that cannot map the disk report everything
+// as allocated.
+
+/**
+ * Size of the allocation map of a partition
+ * @param p Partition
+ * @return size in bytes
+ */
+uint64_t
+allocmapSize (Partition * p)
+{
+	uint64_t bits = (p->size + ALLOCMAP_BLOCK - 1) / ALLOCMAP_BLOCK;
+	return (bits + 7) / 8;
+}
+
+/**
+ * Set the bits of an allocation map that cover a byte range of the partition
+ * @param map Allocation map
+ * @param start First byte of the range
+ * @param end End of the range, exclusive
+ */
+static void
+allocmapSet (unsigned char *map, uint64_t start, uint64_t end)
+{
+	uint64_t bit;
+
+	for (bit = start / ALLOCMAP_BLOCK; bit < (end + ALLOCMAP_BLOCK - 1) / ALLOCMAP_BLOCK;
+			 bit++)
+		map[bit / 8] |= 1 << (bit % 8);
+}
+
+/**
+ * Generate the allocation map of a partition for a reader
+ * @param img Image
+ * @param p Partition
+ * @return handle holding the bitmap or NULL
+ */
+FileHandle *
+allocmapOpen (Image * img, Partition * p)
+{
+	FileHandle *fh = calloc (1, sizeof (FileHandle));
+	DiskExtent ext[SPLICE_EXTENTS_MAX];
+	uint64_t offset = 0;
+	int count, i;
+
+	if (!fh)
+		return NULL;
+	fh->size = allocmapSize (p);
+	if (!(fh->data = calloc (1, fh->size + 1)))	// data is never NULL for a virtual file
+	{
+		free (fh);
+		return NULL;
+	}
+	if (!img->backend->map)
+	{
+		allocmapSet ((unsigned char *) fh->data, 0, p->size);
+		return fh;
+	}
+
+	while (offset < p->size)
+	{
+		uint64_t len = p->size - offset;
+		if (len > (1 << 30))
+			len = 1 << 30;
+		count = img->backend->map (img, p->offset + offset, len, ext,
+															 SPLICE_EXTENTS_MAX);
+		if (count <= 0)
+		{
+			allocmapSet ((unsigned char *) fh->data, offset, p->size);
+			break;
+		}
+		for (i = 0; i < count; i++)
+		{
+			if (ext[i].fd >= 0)
+				allocmapSet ((unsigned char *) fh->data, offset, offset + ext[i].len);
+			offset += ext[i].len;
+		}
+	}
+	return fh;
+}
+
+//====================================================================================================
+//                                   Changed block map virtual file
+//====================================================================================================
+//
+// Next to every partition there is also a readonly <name>.changemap file, laid
+// out like the allocation map, for incremental backups.  A bit is set when its
+// ALLOCMAP_BLOCK bytes of the partition may differ from what the image's parents
+// hold, or were written since the image was opened.  The first is the part of the
+// native VDI index that points into the top snapshot; a chain opened through
+// VBoxDDU only has all bits set.  The second is a bit per ALLOCMAP_BLOCK of the
+// whole disk that diskStore and diskDiscard set, so a partition that does not
+// start on such a boundary may see a neighbouring block as changed too.  A
+// partition file is just a window into the disk, so the map is only a bit OR per
+// block and reading a range of it is all it takes to find the dirty extents.
+
+/**
+ * Note that a range of the disk was written
+ * @param img Image
+ * @param offset Offset into the disk in bytes
+ * @param len Length of the range
+ */
+static void
+changemapMark (Image * img, uint64_t offset, uint64_t len)
+{
+	uint64_t bit, end;
+
+	if (!img->changed || !len)
+		return;
+	end = (offset + len + ALLOCMAP_BLOCK - 1) / ALLOCMAP_BLOCK;
+	for (bit = offset / ALLOCMAP_BLOCK; bit < end; bit++)
+		if (!(__atomic_load_n (img->changed + bit / 64, __ATOMIC_RELAXED)
+					& (1ull << (bit % 64))))
+			__atomic_fetch_or (img->changed + bit / 64, 1ull << (bit % 64),
+												 __ATOMIC_RELAXED);
+}
+
+/**
+ * Set the bits of a partition's changed block map that cover a range of the disk
+ * @param map Changed block map
+ * @param p Partition
+ * @param from Offset into the disk in bytes
+ * @param to End of the range, exclusive
+ */
+static void
+changemapSet (unsigned char *map, Partition * p, uint64_t from, uint64_t to)
+{
+	uint64_t start = p->offset, end = p->offset + p->size;
+
+	if (from < start)
+		from = start;
+	if (to > end)
+		to = end;
+	if (from < to)
+		allocmapSet (map, from - start, to - start);
+}
+
+/**
+ * Generate the changed block map of a partition for a reader
+ * @param img Image
+ * @param p Partition
+ * @return handle holding the bitmap or NULL
+ */
+FileHandle *
+changemapOpen (Image * img, Partition * p)
+{
+	FileHandle *fh = calloc (1, sizeof (FileHandle));
+	VDIimage *vdi = &img->vdi;
+	uint64_t start = p->offset, end = p->offset + p->size;
+	uint64_t bit, last, word;
+	unsigned char *map;
+
+	if (!fh)
+		return NULL;
+	fh->size = allocmapSize (p);
+	if (!(fh->data = calloc (1, fh->size + 1)))	// data is never NULL for a virtual file
+	{
+		free (fh);
+		return NULL;
+	}
+	map = (unsigned char *) fh->data;
+
+// Blocks that the top snapshot holds, whether allocated or zeroed
+
+	if (vdi->layers > 1)
+	{
+		for (bit = start / vdi->blockSize; bit < vdi->blocks && bit * vdi->blockSize < end;
+				 bit++)
+			if (__atomic_load_n (vdi->index + bit, __ATOMIC_ACQUIRE) >> 32
+					== (uint64_t) vdi->layers - 1)
+				changemapSet (map, p, bit * vdi->blockSize, (bit + 1) * vdi->blockSize);
+	}
+	else if (img->differencingLen)
+	{
+		allocmapSet (map, 0, p->size);
+		return fh;
+	}
+
+// Blocks written since the image was opened, a word of the disk map at a time
+
+	if (img->changed && p->size)
+	{
+		last = (end - 1) / ALLOCMAP_BLOCK;
+		for (bit = start / ALLOCMAP_BLOCK; bit <= last; bit = (bit | 63) + 1)
+		{
+			if (!(word = __atomic_load_n (img->changed + bit / 64, __ATOMIC_RELAXED)))
+				continue;
+			for (; bit <= last; bit++)
+			{
+				if (word & (1ull << (bit % 64)))
+					changemapSet (map, p, bit * ALLOCMAP_BLOCK, (bit + 1) * ALLOCMAP_BLOCK);
+				if (bit % 64 == 63)
+					break;
+			}
+		}
+	}
+	return fh;
+}
+
+//====================================================================================================
+//                                            Disk access
+//====================================================================================================
+//
+// Shared by the FUSE callbacks and the NBD server.  EntireDisk and the
+// partitions are all views of the same disk and may be open at the same time.
+// Every read and write holds its range of the disk, in absolute offsets, while
+// it runs: reads of a range can share it, while a write has it to itself.  So
+// overlapping requests happen in the order they arrived, whichever file they
+// came through, and requests for different ranges never wait for each other.
+// Only the backend write itself is still serialised on diskMutex, as VBoxDDU
+// is not thread safe.  A hold must not be taken while holding another one.
+
+/**
+ * Wait until a range of the disk can be used
+ * @param img Image
+ * @param h out: Hold, to be given to rangeUnlock
+ * @param offset Offset into the disk in bytes
+ * @param len Length of the range
+ * @param write 1 to use the range alone
+ */
+static void
+rangeLock (Image * img, RangeHold * h, uint64_t offset, size_t len, int write)
+{
+	RangeHold **link, *o;
+	uint64_t start = 0;
+
+	h->start = offset;
+	h->end = offset + len;
+	h->write = write;
+	h->next = NULL;
+	traceLock (&img->rangeMutex);
+	for (link = &img->ranges; *link; link = &(*link)->next)
+		;
+	*link = h;
+	for (;;)
+	{
+		for (o = img->ranges; o != h; o = o->next)
+			if ((o->write || write) && o->start < h->end && h->start < o->end)
+				break;
+		if (o == h)
+			break;
+		if (!start)
+		{
+			start = traceClock ();
+			__sync_fetch_and_add (&rangeWaits, 1);
+		}
+		pthread_cond_wait (&img->rangeCond, &img->rangeMutex);
+	}
+	pthread_mutex_unlock (&img->rangeMutex);
+	if (start)
+		traceLockNs += traceClock () - start;
+}
+
+/**
+ * Give back a range taken with rangeLock
+ * @param img Image
+ * @param h Hold
+ */
+static void
+rangeUnlock (Image * img, RangeHold * h)
+{
+	RangeHold **link;
+
+	pthread_mutex_lock (&img->rangeMutex);
+	for (link = &img->ranges; *link != h; link = &(*link)->next)
+		;
+	*link = h->next;
+	if (img->ranges)
+		pthread_cond_broadcast (&img->rangeCond);
+	pthread_mutex_unlock (&img->rangeMutex);
+}
+
+/**
+ * Read from the disk, through the block cache if there is one
+ * @param img Image
+ * @param offset Offset into the disk in bytes
+ * @param buf out: Data read
+ * @param len Number of bytes to read
+ * @return VBox status code
+ */
+static int
+diskRead (Image * img, uint64_t offset, char *buf, size_t len)
+{
+	int busy = __atomic_load_n (&img->replaying, __ATOMIC_RELAXED);
+	RangeHold hold;
+	int ret;
+
+	if (busy)
+		__sync_fetch_and_add (&img->foreground, 1);
+	if (img->profileSeen)
+		profileRecord (img, offset, len);
+	rangeLock (img, &hold, offset, len, 0);
+	ret = cacheSize ? cacheRead (img, offset, buf, len)
+		: splitRead (img, offset, buf, len);
+	rangeUnlock (img, &hold);
+	if (busy)
+		__sync_fetch_and_sub (&img->foreground, 1);
+	return ret;
+}
+
+/**
+ * Read from the disk for a bulk pass such as hashing.  It sees what diskRead
+ * would, but is not recorded in the access profile and does not load the block
+ * cache, so it neither skews the next replay nor evicts the working set.
+ * @param img Image
+ * @param offset Offset into the disk in bytes
+ * @param buf out: Data read
+ * @param len Number of bytes to read
+ * @return VBox status code
+ */
+static int
+diskScan (Image * img, uint64_t offset, char *buf, size_t len)
+{
+	RangeHold hold;
+	int ret;
+
+	rangeLock (img, &hold, offset, len, 0);
+	ret = cacheSize ? cacheScan (img, offset, buf, len)
+		: splitRead (img, offset, buf, len);
+	rangeUnlock (img, &hold);
+	return ret;
+}
+
+/**
+ * Write to the disk, or only to the cache in write-back mode.  The partition
+ * table is rescanned if the write touched it.  Zeros are not written where the
+ * image does not store the range.
+ * @param img Image
+ * @param offset Offset into the disk in bytes
+ * @param buf Data to write
+ * @param len Number of bytes to write
+ * @return VBox status code
+ */
+static int
+diskStore (Image * img, uint64_t offset, const char *buf, size_t len)
+{
+	int busy = __atomic_load_n (&img->replaying, __ATOMIC_RELAXED);
+	RangeHold hold;
+	int ret;
+
+	if (busy)
+		__sync_fetch_and_add (&img->foreground, 1);
+	rangeLock (img, &hold, offset, len, 1);
+	if (writeBack)
+		ret = cacheWriteBack (img, offset, buf, len);
+	else if (isZero (buf, len) && !diskAllocated (img, offset, len))
+	{
+		__sync_fetch_and_add (&zeroSkipped, 1);
+		ret = 0;
+		if (cacheSize)
+			cacheForget (img, offset, len, 1);
+	}
+	else
+	{
+		traceLock (&img->diskMutex);
+		ret = DISKwrite (img, offset, buf, len);
+		pthread_mutex_unlock (&img->diskMutex);
+
+// The cache block may be shared with a write to a different range, but each
+// only copies its own bytes
+
+		if (RT_SUCCESS (ret) && cacheSize)
+			cacheUpdate (img, offset, buf, len);
+	}
+	if (RT_SUCCESS (ret))
+	{
+		sha256mapInvalidate (img, offset, len);
+		changemapMark (img, offset, len);
+	}
+	rangeUnlock (img, &hold);
+	if (busy)
+		__sync_fetch_and_sub (&img->foreground, 1);
+	if (RT_SUCCESS (ret) && partitionDescriptorTouched (img, offset, len))
+		rescanPartitionTable (img);
+	return ret;
+}
+
+/**
+ * Write to the disk.  A write of zeros that covers whole blocks frees them if
+ * the image can discard, so that guests zeroing free space do not grow it.
+ * @param img Image
+ * @param offset Offset into the disk in bytes
+ * @param buf Data to write
+ * @param len Number of bytes to write
+ * @return VBox status code
+ */
+static int
+diskWrite (Image * img, uint64_t offset, const char *buf, size_t len)
+{
+	if (img->discard && len >= img->vdi.blockSize && isZero (buf, len))
+		return diskZero (img, offset, len);
+	return diskStore (img, offset, buf, len);
+}
+
+/**
+ * Check whether any of a range of the disk is stored in the image
+ * @param img Image
+ * @param offset Offset into the disk in bytes
+ * @param len Length of the range
+ * @return 0 if the range is known to read as zeros, 1 otherwise
+ */
+static int
+diskAllocated (Image * img, uint64_t offset, uint64_t len)
+{
+	DiskExtent ext[SPLICE_EXTENTS_MAX];
+	int count, i;
+
+	if (!img->backend->map)
+		return 1;
+	while (len)
+	{
+		if ((count = img->backend->map (img, offset, len, ext, SPLICE_EXTENTS_MAX)) <= 0)
+			return 1;
+		for (i = 0; i < count; i++)
+		{
+			if (ext[i].fd >= 0)
+				return 1;
+			offset += ext[i].len;
+			len -= ext[i].len;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @param buf Data
+ * @param len Length of data
+ * @return 1 if every byte is zero
+ */
+static int
+isZero (const char *buf, size_t len)
+{
+	size_t i;
+
+// Compare the head byte by byte, then the rest against the head shifted along
+
+	for (i = 0; i < len && i < 16; i++)
+		if (buf[i])
+			return 0;
+	return len <= 16 || memcmp (buf, buf + 16, len - 16) == 0;
+}
+
+/**
+ * Free whole blocks of the disk in the image.  Other blocks may move in the
+ * image file meanwhile, so the whole disk is held.  Once the backend was asked,
+ * the range is treated as changed even if it failed, since part of it may have
+ * been freed anyway.
+ * @param img Image, with discard set
+ * @param offset Offset into the disk in bytes, a multiple of the block size
+ * @param len Length of the range, a multiple of the block size
+ * @return VBox status code, or 1 if the image cannot discard any more and the
+ * range has to be written with zeros instead
+ */
+static int
+diskDiscard (Image * img, uint64_t offset, uint64_t len)
+{
+	RangeHold hold;
+	int ret, tried = 0;
+
+	rangeLock (img, &hold, 0, DISKsize (img), 1);
+	ret = writebackFlush (img);		// nothing dirty may be written over the holes later
+	if (RT_SUCCESS (ret))
+	{
+		traceLock (&img->diskMutex);
+		if ((tried = (img->backend->discard != NULL)))
+			ret = TRACE_BACKEND (img->backend->discard (img, offset, len));
+		else
+			ret = 1;									// see vdiChainLost
+		pthread_mutex_unlock (&img->diskMutex);
+	}
+	if (tried)
+	{
+		cacheForget (img, offset, len, 1);
+		sha256mapInvalidate (img, offset, len);
+		changemapMark (img, offset, len);
+	}
+	if (tried && RT_SUCCESS (ret))
+		__sync_fetch_and_add (&discardBytes, len);
+	rangeUnlock (img, &hold);
+	if (tried && partitionDescriptorTouched (img, offset, len))
+		rescanPartitionTable (img);
+	return ret;
+}
+
+/**
+ * Make a range of the disk read as zeros.  If the image can discard, the whole
+ * blocks in the range are freed and only the partial blocks at either end are
+ * written.  Otherwise zeros are written, which diskWrite drops where the image
+ * does not store the range anyway.
+ * @param img Image
+ * @param offset Offset into the disk in bytes
+ * @param len Length of the range
+ * @return VBox status code
+ */
+static int
+diskZero (Image * img, uint64_t offset, uint64_t len)
+{
+	uint64_t end = offset + len, head = end, tail = end;
+	uint64_t piece[2][2], o;
+	size_t chunk;
+	char *zeros = NULL;
+	int ret = 0, i;
+
+	if (img->discard)
+	{
+		head = (offset + img->vdi.blockSize - 1) / img->vdi.blockSize * img->vdi.blockSize;
+		tail = end / img->vdi.blockSize * img->vdi.blockSize;
+		if (head >= tail)
+			head = tail = end;
+	}
+	if (head < tail && RT_FAILURE (ret = diskDiscard (img, head, tail - head)))
+		return ret;
+	if (ret > 0)
+	{
+		head = tail = end;
+		ret = 0;
+	}
+
+// Write the partial blocks, which are all of the range without discarding
+
+	piece[0][0] = offset;
+	piece[0][1] = head;
+	piece[1][0] = tail;
+	piece[1][1] = end;
+	for (i = 0; i < 2 && RT_SUCCESS (ret); i++)
+		for (o = piece[i][0]; o < piece[i][1] && RT_SUCCESS (ret); o += chunk)
+		{
+			chunk = (piece[i][1] - o < ZERO_CHUNK) ? piece[i][1] - o : ZERO_CHUNK;
+			if (!zeros && !(zeros = calloc (1, ZERO_CHUNK)))
+				return -1;
+			ret = diskStore (img, o, zeros, chunk);
+		}
+	free (zeros);
+	return ret;
+}
+
+//====================================================================================================
+//                                     Block hash virtual file
+//====================================================================================================
+//
+// Next to every partition there is a readonly <name>.sha256map file.  It starts
+// with "digest-of-blocks " and a digest of the whole partition, followed by a
+// line for every SHA256MAP_BLOCK bytes with the offset in hex and the SHA-256 of
+// the block.  The digest is the SHA-256 of the binary block hashes in order, not
+// of the partition, so a hole costs one precomputed hash no matter how large it
+// is.  Opening the file hashes the blocks in parallel on the workers, see
+// diskScan for why that does not go through diskRead.
+// The hashes are kept until a write touches their block, so opening it again
+// only rehashes what changed.
+
+static const uint32_t sha256K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x,n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/**
+ * Run the SHA-256 compression function over 64 byte blocks in plain C
+ * @param state Hash state
+ * @param data Blocks
+ * @param blocks Number of blocks
+ */
+static void
+sha256BlocksC (uint32_t * state, const unsigned char *data, size_t blocks)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (; blocks; blocks--, data += 64)
+	{
+		for (i = 0; i < 16; i++)
+			w[i] = (uint32_t) data[4 * i] << 24 | (uint32_t) data[4 * i + 1] << 16
+				| (uint32_t) data[4 * i + 2] << 8 | data[4 * i + 3];
+		for (; i < 64; i++)
+			w[i] = w[i - 16] + (ROR (w[i - 15], 7) ^ ROR (w[i - 15], 18) ^ (w[i - 15] >> 3))
+				+ w[i - 7] + (ROR (w[i - 2], 17) ^ ROR (w[i - 2], 19) ^ (w[i - 2] >> 10));
+		a = state[0];
+		b = state[1];
+		c = state[2];
+		d = state[3];
+		e = state[4];
+		f = state[5];
+		g = state[6];
+		h = state[7];
+		for (i = 0; i < 64; i++)
+		{
+			t1 = h + (ROR (e, 6) ^ ROR (e, 11) ^ ROR (e, 25)) + ((e & f) ^ (~e & g))
+				+ sha256K[i] + w[i];
+			t2 = (ROR (a, 2) ^ ROR (a, 13) ^ ROR (a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		state[5] += f;
+		state[6] += g;
+		state[7] += h;
+	}
+}
+
+#undef ROR
+
+#ifdef SHA_NI
+/**
+ * Run the SHA-256 compression function over 64 byte blocks with the SHA
+ * extensions, four rounds per pair of sha256rnds2
+ * @param state Hash state
+ * @param data Blocks
+ * @param blocks Number of blocks
+ */
+__attribute__ ((target ("sha,sse4.1")))
+static void
+sha256BlocksNi (uint32_t * state, const unsigned char *data, size_t blocks)
+{
+	const __m128i mask = _mm_set_epi64x (0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i state0, state1, saved0, saved1, msg, tmp, w[4];
+	int i;
+
+// The instructions want the state as ABEF and CDGH
+
+	tmp = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *) state), 0xb1);
+	state1 = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *) (state + 4)), 0x1b);
+	state0 = _mm_alignr_epi8 (tmp, state1, 8);
+	state1 = _mm_blend_epi16 (state1, tmp, 0xf0);
+
+	for (; blocks; blocks--, data += 64)
+	{
+		saved0 = state0;
+		saved1 = state1;
+		for (i = 0; i < 16; i++)
+		{
+			if (i < 4)
+				w[i] = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (data + 16 * i)),
+																 mask);
+			else
+			{
+				tmp = _mm_sha256msg1_epu32 (w[i % 4], w[(i + 1) % 4]);
+				tmp = _mm_add_epi32 (tmp, _mm_alignr_epi8 (w[(i + 3) % 4], w[(i + 2) % 4], 4));
+				w[i % 4] = _mm_sha256msg2_epu32 (tmp, w[(i + 3) % 4]);
+			}
+			msg = _mm_add_epi32 (w[i % 4], _mm_loadu_si128 ((const __m128i *) (sha256K + 4 * i)));
+			state1 = _mm_sha256rnds2_epu32 (state1, state0, msg);
+			state0 = _mm_sha256rnds2_epu32 (state0, state1, _mm_shuffle_epi32 (msg, 0x0e));
+		}
+		state0 = _mm_add_epi32 (state0, saved0);
+		state1 = _mm_add_epi32 (state1, saved1);
+	}
+
+	tmp = _mm_shuffle_epi32 (state0, 0x1b);
+	state1 = _mm_shuffle_epi32 (state1, 0xb1);
+	_mm_storeu_si128 ((__m128i *) state, _mm_blend_epi16 (tmp, state1, 0xf0));
+	_mm_storeu_si128 ((__m128i *) (state + 4), _mm_alignr_epi8 (state1, tmp, 8));
+}
+#endif
+
+/**
+ * Run the SHA-256 compression function, with the SHA extensions if the CPU
+ * has them
+ * @param state Hash state
+ * @param data Blocks
+ * @param blocks Number of 64 byte blocks
+ */
+static void
+sha256Blocks (uint32_t * state, const unsigned char *data, size_t blocks)
+{
+#ifdef SHA_NI
+	if (__atomic_load_n (&sha256Engine, __ATOMIC_RELAXED) < 0)
+	{
+		unsigned a, b, c, d;
+		__atomic_store_n (&sha256Engine, __get_cpuid_count (7, 0, &a, &b, &c, &d)
+											&& (b & (1 << 29)), __ATOMIC_RELAXED);
+	}
+	if (sha256Engine > 0)
+	{
+		sha256BlocksNi (state, data, blocks);
+		return;
+	}
+#endif
+	sha256BlocksC (state, data, blocks);
+}
+
+/**
+ * Start a hash
+ * @param h Hash
+ */
+static void
+sha256Init (Sha256 * h)
+{
+	static const uint32_t initial[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	memcpy (h->state, initial, sizeof (initial));
+	h->length = 0;
+}
+
+/**
+ * Add data to a hash
+ * @param h Hash
+ * @param data Data
+ * @param len Length of data
+ */
+static void
+sha256Update (Sha256 * h, const void *data, size_t len)
+{
+	const unsigned char *in = data;
+	size_t used = h->length % 64, n;
+
+	h->length += len;
+	if (used)
+	{
+		n = (len < 64 - used) ? len : 64 - used;
+		memcpy (h->buf + used, in, n);
+		in += n;
+		len -= n;
+		if (used + n < 64)
+			return;
+		sha256Blocks (h->state, h->buf, 1);
+	}
+	sha256Blocks (h->state, in, len / 64);
+	memcpy (h->buf, in + len / 64 * 64, len % 64);
+}
+
+/**
+ * Finish a hash
+ * @param h Hash
+ * @param out out: SHA256_SIZE bytes of hash
+ */
+static void
+sha256Final (Sha256 * h, unsigned char *out)
+{
+	unsigned char pad[72] = { 0x80 };
+	uint64_t bits = h->length * 8;
+	size_t n = 64 - (h->length + 8) % 64;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		pad[n + i] = bits >> (56 - 8 * i);
+	sha256Update (h, pad, n + 8);
+	for (i = 0; i < 8; i++)
+	{
+		out[4 * i] = h->state[i] >> 24;
+		out[4 * i + 1] = h->state[i] >> 16;
+		out[4 * i + 2] = h->state[i] >> 8;
+		out[4 * i + 3] = h->state[i];
+	}
+}
+
+/**
+ * Hash a buffer
+ * @param data Data
+ * @param len Length of data
+ * @param out out: SHA256_SIZE bytes of hash
+ */
+static void
+sha256 (const void *data, size_t len, unsigned char *out)
+{
+	Sha256 h;
+
+	sha256Init (&h);
+	sha256Update (&h, data, len);
+	sha256Final (&h, out);
+}
+
+/**
+ * Hash len zero bytes without looking at them, once per length
+ * @param len Length
+ * @param out out: SHA256_SIZE bytes of hash
+ * @return 0 or -1 if out of memory
+ */
+static int
+sha256Zeros (size_t len, unsigned char *out)
+{
+	static unsigned char block[SHA256_SIZE];
+	static int blockDone = 0;
+	static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+	char *zeros;
+
+	if (len == SHA256MAP_BLOCK && __atomic_load_n (&blockDone, __ATOMIC_ACQUIRE))
+	{
+		memcpy (out, block, SHA256_SIZE);
+		return 0;
+	}
+	if (!(zeros = calloc (1, len)))
+		return -1;
+	sha256 (zeros, len, out);
+	free (zeros);
+	if (len == SHA256MAP_BLOCK)
+	{
+		pthread_mutex_lock (&mutex);
+		if (!blockDone)
+		{
+			memcpy (block, out, SHA256_SIZE);
+			__atomic_store_n (&blockDone, 1, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock (&mutex);
+	}
+	return 0;
+}
+
+/**
+ * Size of the block hash file of a partition
+ * @param p Partition
+ * @return size in bytes
+ */
+uint64_t
+sha256mapSize (Partition * p)
+{
+	return SHA256MAP_HEAD
+		+ (p->size + SHA256MAP_BLOCK - 1) / SHA256MAP_BLOCK * SHA256MAP_LINE;
+}
+
+/**
+ * Forget the hashes of blocks that a write touched
+ * @param img Image
+ * @param offset Offset into the disk in bytes
+ * @param len Length of the write
+ */
+void
+sha256mapInvalidate (Image * img, uint64_t offset, size_t len)
+{
+	HashMap *m;
+	uint64_t b, end;
+
+	if (!__atomic_load_n (&img->hashMaps, __ATOMIC_RELAXED) || !len)
+		return;
+	pthread_mutex_lock (&img->hashMutex);
+	for (m = img->hashMaps; m; m = m->next)
+	{
+		if (offset >= m->offset + m->size || offset + len <= m->offset)
+			continue;
+		b = (offset > m->offset) ? (offset - m->offset) / SHA256MAP_BLOCK : 0;
+		end = (offset + len - m->offset + SHA256MAP_BLOCK - 1) / SHA256MAP_BLOCK;
+		for (; b < end && b < m->blocks; b++)
+			m->valid[b / 8] &= ~(1 << (b % 8));
+		m->writes++;
+	}
+	pthread_mutex_unlock (&img->hashMutex);
+}
+
+/**
+ * Drop a reference to a hashing pass and free it with the last one
+ * @param h Hashing pass
+ */
+static void
+hashPassRelease (HashPass * h)
+{
+	if (__sync_sub_and_fetch (&h->refs, 1) == 0)
+	{
+		pthread_mutex_destroy (&h->mutex);
+		pthread_cond_destroy (&h->cond);
+		free (h);
+	}
+}
+
+/**
+ * Hash blocks of a pass until there are none left to claim.  A hash only
+ * becomes valid if no write touched the partition while it was computed.
+ * @param h Hashing pass
+ */
+static void
+hashPassRun (HashPass * h)
+{
+	HashMap *m = h->map;
+	unsigned char hash[SHA256_SIZE];
+	char *buf = NULL;
+	uint64_t b, offset;
+	size_t len;
+	int ret;
+
+	while ((b = __sync_fetch_and_add (&h->next, 1)) < m->blocks)
+	{
+		offset = m->offset + b * SHA256MAP_BLOCK;
+		len = (b + 1 < m->blocks) ? SHA256MAP_BLOCK : m->size - b * SHA256MAP_BLOCK;
+		ret = 0;
+
+		pthread_mutex_lock (&h->image->hashMutex);
+		if (m->valid[b / 8] & (1 << (b % 8)))
+			len = 0;
+		pthread_mutex_unlock (&h->image->hashMutex);
+		if (!len)
+			__sync_fetch_and_add (&hashReused, 1);
+		else if (!diskAllocated (h->image, offset, len))
+		{
+			ret = sha256Zeros (len, hash);
+			__sync_fetch_and_add (&hashHoles, 1);
+		}
+		else if ((buf || (buf = malloc (SHA256MAP_BLOCK)))
+						 && RT_SUCCESS (ret = diskScan (h->image, offset, buf, len)))
+		{
+			sha256 (buf, len, hash);
+			__sync_fetch_and_add (&hashBlocks, 1);
+		}
+		else if (!buf)
+			ret = -1;
+
+		pthread_mutex_lock (&h->image->hashMutex);
+		if (len && RT_SUCCESS (ret))
+		{
+			memcpy (m->hash[b], hash, SHA256_SIZE);
+			if (m->writes == h->writes)
+				m->valid[b / 8] |= 1 << (b % 8);
+		}
+		pthread_mutex_unlock (&h->image->hashMutex);
+
+		pthread_mutex_lock (&h->mutex);
+		if (RT_FAILURE (ret) && RT_SUCCESS (h->result))
+			h->result = ret;
+		if (++h->done == m->blocks)
+			pthread_cond_signal (&h->cond);
+		pthread_mutex_unlock (&h->mutex);
+	}
+	free (buf);
+}
+
+/**
+ * Worker side of a hashing pass
+ * @param arg HashPass
+ */
+static void
+hashPassWorker (void *arg)
+{
+	hashPassRun (arg);
+	hashPassRelease (arg);
+}
+
+/**
+ * Find or make the block hashes of a partition and bring them up to date
+ * @param img Image
+ * @param p Partition
+ * @return the hashes, valid while the image is open, or NULL on error
+ */
+static HashMap *
+sha256mapUpdate (Image * img, Partition * p)
+{
+	HashMap *m;
+	HashPass *h;
+	int i, ret;
+
+	pthread_mutex_lock (&img->hashMutex);
+	for (m = img->hashMaps; m; m = m->next)
+		if (m->offset == (uint64_t) p->offset && m->size == p->size)
+			break;
+	if (!m && (m = calloc (1, sizeof (HashMap))))
+	{
+		m->offset = p->offset;
+		m->size = p->size;
+		m->blocks = (p->size + SHA256MAP_BLOCK - 1) / SHA256MAP_BLOCK;
+		m->hash = malloc (m->blocks * SHA256_SIZE + 1);
+		m->valid = calloc (1, (m->blocks + 7) / 8 + 1);
+		if (m->hash && m->valid)
+		{
+			m->next = img->hashMaps;
+			__atomic_store_n (&img->hashMaps, m, __ATOMIC_RELEASE);
+		}
+		else
+		{
+			free (m->hash);
+			free (m->valid);
+			free (m);
+			m = NULL;
+		}
+	}
+	if (m && !(h = calloc (1, sizeof (HashPass))))
+		m = NULL;
+	pthread_mutex_unlock (&img->hashMutex);
+	if (!m)
+		return NULL;
+
+	h->image = img;
+	h->map = m;
+	pthread_mutex_lock (&img->hashMutex);
+	h->writes = m->writes;
+	pthread_mutex_unlock (&img->hashMutex);
+	h->refs = 1;
+	pthread_mutex_init (&h->mutex, NULL);
+	pthread_cond_init (&h->cond, NULL);
+	for (i = 0; i < taskThreads && (uint64_t) i + 1 < m->blocks; i++)
+	{
+		__sync_fetch_and_add (&h->refs, 1);
+		if (taskSubmit (hashPassWorker, h) < 0)
+		{
+			__sync_fetch_and_sub (&h->refs, 1);
+			break;
+		}
+	}
+	hashPassRun (h);
+
+	pthread_mutex_lock (&h->mutex);
+	while (h->done < m->blocks)
+		pthread_cond_wait (&h->cond, &h->mutex);
+	ret = h->result;
+	pthread_mutex_unlock (&h->mutex);
+	hashPassRelease (h);
+	return RT_SUCCESS (ret) ? m : NULL;
+}
+
+/**
+ * Generate the block hash file of a partition for a reader
+ * @param img Image
+ * @param p Partition
+ * @return handle holding the text or NULL on error
+ */
+FileHandle *
+sha256mapOpen (Image * img, Partition * p)
+{
+	static const char hex[] = "0123456789abcdef";
+	FileHandle *fh = calloc (1, sizeof (FileHandle));
+	unsigned char digest[SHA256_SIZE];
+	HashMap *m;
+	Sha256 all;
+	uint64_t b;
+	char *line;
+	int i;
+
+	if (!fh || !(m = sha256mapUpdate (img, p)))
+	{
+		free (fh);
+		return NULL;
+	}
+	fh->size = sha256mapSize (p);
+	if (!(fh->data = malloc (fh->size + 1)))
+	{
+		free (fh);
+		return NULL;
+	}
+
+	sha256Init (&all);
+	pthread_mutex_lock (&img->hashMutex);
+	for (b = 0, line = fh->data + SHA256MAP_HEAD; b < m->blocks; b++)
+	{
+		sha256Update (&all, m->hash[b], SHA256_SIZE);
+		line += sprintf (line, "%016llx ",
+										 (unsigned long long) b * SHA256MAP_BLOCK);
+		for (i = 0; i < SHA256_SIZE; i++)
+		{
+			*line++ = hex[m->hash[b][i] >> 4];
+			*line++ = hex[m->hash[b][i] & 15];
+		}
+		*line++ = '\n';
+	}
+	pthread_mutex_unlock (&img->hashMutex);
+	sha256Final (&all, digest);
+	line = fh->data + sprintf (fh->data, "digest-of-blocks ");
+	for (i = 0; i < SHA256_SIZE; i++)
+	{
+		*line++ = hex[digest[i] >> 4];
+		*line++ = hex[digest[i] & 15];
+	}
+	*line = '\n';
+	return fh;
+}
+
+//====================================================================================================
+//                                          Metadata sidecar
+//====================================================================================================
+//
+// Opening an image detects the type of every file, reads the VDI headers and
+// block maps of the whole chain to build the native index, and walks the MBR and
+// EBR chain.  On slow storage and with long snapshot chains this takes a while.
+// With --sidecar, the results are saved to a file after a full open, and later
+// opens of the same files map it instead.  A sidecar is used only if its
+// checksum is right and every file still has the device, inode, size and
+// modification time it had when the sidecar was written.  Otherwise the image
+// is scanned as usual and the sidecar is written again.  VBoxDDU still opens the
+// chain when it is used, only the detection and scans are skipped.  Only
+// readonly opens write sidecars.  A writable open uses a valid one but then
+// removes it, because a write may not change the size or, on file systems
+// with coarse timestamps, the modification time.
+
+/**
+ * Where a file that belongs to an image lives: next to its top file, or in dir
+ * under a name derived from the top file's full path
+ * @param img Image
+ * @param dir Directory, "" for next to the image
+ * @param suffix Appended to the name, SIDECAR_SUFFIX or PROFILE_SUFFIX
+ * @param path out: Path of the file
+ * @param size Room in path
+ * @return 0 or -1 if the path cannot be made
+ */
+static int
+sidecarPath (Image * img, const char *dir, const char *suffix, char *path,
+						 size_t size)
+{
+	const char *top = img->differencingLen ? img->differencing[img->differencingLen - 1]
+		: img->filename;
+	unsigned char hash[SHA256_SIZE];
+	char *real;
+	int n;
+
+	if (!*dir)
+		n = snprintf (path, size, "%s%s", top, suffix);
+	else
+	{
+		if (!(real = realpath (top, NULL)))
+			return -1;
+		sha256 (real, strlen (real), hash);
+		free (real);
+		n = snprintf (path, size, "%s/%02x%02x%02x%02x%02x%02x%02x%02x%s",
+									dir, hash[0], hash[1], hash[2], hash[3], hash[4],
+									hash[5], hash[6], hash[7], suffix);
+	}
+	return (n < 0 || (size_t) n >= size) ? -1 : 0;
+}
+
+/**
+ * @param img Image
+ * @param n 0 for the base image, 1.. for the snapshots
+ * @return the file name
+ */
+static const char *
+sidecarFileName (Image * img, int n)
+{
+	return n ? img->differencing[n - 1] : img->filename;
+}
+
+/**
+ * Map an image's sidecar if it is valid for the files as they are now.  The
+ * mapping stays in img->sidecar until the image is open.
+ * @param img Image
+ * @return 0 or -1 if there is no valid sidecar
+ */
+int
+sidecarLoad (Image * img)
+{
+	char path[PATH_MAX];
+	unsigned char sum[SHA256_SIZE];
+	SidecarHeader *h;
+	SidecarFile *f;
+	SidecarVdi *v;
+	PartitionTable *t;
+	struct stat st;
+	uint64_t head, *index;
+	uint32_t b;
+	size_t size;
+	int fd, i, bad;
+
+	if (!sidecarDir
+			|| sidecarPath (img, sidecarDir, SIDECAR_SUFFIX, path, sizeof (path)) < 0
+			|| (fd = open (path, O_RDONLY)) < 0)
+		return -1;
+	if (fstat (fd, &st) < 0 || (uint64_t) st.st_size < sizeof (SidecarHeader)
+			|| (h = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0))
+			== MAP_FAILED)
+	{
+		close (fd);
+		return -1;
+	}
+	close (fd);
+	size = st.st_size;
+
+	head = sizeof (SidecarHeader) + (uint64_t) h->files * sizeof (SidecarFile)
+		+ sizeof (SidecarVdi) + sizeof (PartitionTable);
+	if (memcmp (h->magic, SIDECAR_MAGIC, sizeof (h->magic)) != 0
+			|| h->version != SIDECAR_VERSION || h->tableSize != sizeof (PartitionTable)
+			|| h->files != (uint32_t) img->differencingLen + 1
+			|| h->size != size || h->size < head
+			|| (h->indexOffset && (h->indexOffset < head || h->indexOffset
+														 + (uint64_t) SIDECAR_VDI (h)->blocks * sizeof (uint64_t)
+														 != h->size)))
+	{
+		vbprintf ("%s: not a sidecar of this version, rescanning", path);
+		goto stale;
+	}
+
+// The checksum only catches accidents, so do not trust the payload either: the
+// layers must match the files, and the VDI geometry, the index and the partition
+// table must be ones that opening the image could have produced.  Without an
+// index the disk size is not known yet, see initialisePartitionTable.
+
+	v = SIDECAR_VDI (h);
+	t = SIDECAR_TABLE (h);
+	index = h->indexOffset ? (uint64_t *) ((char *) h + h->indexOffset) : NULL;
+	bad = (v->layers != 0) != (h->indexOffset != 0)
+		|| (v->layers && (v->layers != (int32_t) h->files || v->layers > DIFFERENCING_MAX + 1
+											|| v->blockSize == 0 || (v->blockSize & (v->blockSize - 1))
+											|| (uint64_t) v->blocks * v->blockSize < v->diskSize))
+		|| t->last < 0 || t->last > HOSTPARTITION_MAX
+		|| t->sectors < 0 || t->sectors > HOSTPARTITION_MAX + 1;
+	for (i = 0; !bad && i <= t->last; i++)
+		bad = !memchr (t->partition[i].name, 0, sizeof (t->partition[i].name));
+	for (b = 0; !bad && index && b < v->blocks; b++)
+		bad = (index[b] >> 32) >= (uint64_t) v->layers && (uint32_t) index[b] < VDI_BLOCK_ZERO;
+	if (!bad && index)
+		bad = !partitionsFit (t, v->diskSize);
+	if (bad)
+	{
+		vbprintf ("%s: inconsistent sidecar, rescanning", path);
+		goto stale;
+	}
+	for (i = 0, f = SIDECAR_FILES (h); i < (int) h->files; i++, f++)
+		if (stat (sidecarFileName (img, i), &st) < 0 || f->dev != (uint64_t) st.st_dev
+				|| f->ino != (uint64_t) st.st_ino || f->size != (uint64_t) st.st_size
+				|| f->mtime != st.st_mtim.tv_sec || f->mtimeNs != st.st_mtim.tv_nsec)
+		{
+			vbprintf ("%s: %s has changed, rescanning", path, sidecarFileName (img, i));
+			goto stale;
+		}
+	if (strcmp (img->diskType, "auto") != 0
+			&& strncmp (img->diskType, SIDECAR_FILES (h)->type, sizeof (f->type)) != 0)
+		goto stale;
+	sha256 (h + 1, h->size - sizeof (SidecarHeader), sum);
+	if (memcmp (sum, h->checksum, SHA256_SIZE) != 0)
+	{
+		vbprintf ("%s: bad checksum, rescanning", path);
+		goto stale;
+	}
+
+	vbprintf ("using sidecar %s", path);
+	img->sidecar = h;
+	img->sidecarSize = h->size;
+	return 0;
+
+stale:
+	munmap (h, size);
+	return -1;
+}
+
+/**
+ * Take the type of a file from the sidecar
+ * @param img Image
+ * @param n 0 for the base image, 1.. for the snapshots
+ * @param type out: Disk type
+ * @return 0 or -1 if the sidecar does not know it
+ */
+static int
+sidecarDiskType (Image * img, int n, char **type)
+{
+	static char *types[] = { "VDI", "VMDK", "VHD" };
+	unsigned i;
+
+	if (!img->sidecar)
+		return -1;
+	for (i = 0; i < sizeof (types) / sizeof (types[0]); i++)
+		if (strncmp (SIDECAR_FILES (img->sidecar)[n].type, types[i],
+								 sizeof (SIDECAR_FILES (img->sidecar)[n].type)) == 0)
+		{
+			*type = types[i];
+			return 0;
+		}
+	return -1;
+}
+
+/**
+ * Open the native VDI chain from the sidecar: open the files and map the index
+ * instead of reading every header and block map.  The index is mapped privately,
+ * so a writable chain can still update it.
+ * @param img Image
+ * @return 0, or -1 if the sidecar has no index
+ */
+static int
+sidecarVdi (Image * img)
+{
+	VDIimage *vdi = &img->vdi;
+	SidecarVdi *v;
+	struct stat st;
+	int n;
+
+	if (!img->sidecar || !img->sidecar->indexOffset)
+		return -1;
+	v = SIDECAR_VDI (img->sidecar);
+	for (n = 0; n < v->layers; n++)
+	{
+		VDIlayer *l = vdi->layer + n;
+
+		if ((l->fd = open (sidecarFileName (img, n), O_RDONLY)) < 0
+				|| fstat (l->fd, &st) < 0)
+		{
+			if (l->fd >= 0)
+				close (l->fd);
+			vdiClose (img);
+			return -1;
+		}
+		vdi->layers = n + 1;
+		l->fileSize = st.st_size;
+		l->dataOffset = v->layer[n].dataOffset;
+		l->blockExtra = v->layer[n].blockExtra;
+		l->blocksOffset = v->layer[n].blocksOffset;
+	}
+	vdi->diskSize = v->diskSize;
+	vdi->blockSize = v->blockSize;
+	vdi->blocks = v->blocks;
+	vdi->index = (uint64_t *) ((char *) img->sidecar + img->sidecar->indexOffset);
+	vdi->indexMap = img->sidecar;
+	vdi->indexMapSize = img->sidecarSize;
+	return 0;
+}
+
+/**
+ * Write the sidecar of a freshly scanned image.  It is written to a temporary
+ * file first and renamed, so readers never see half of it.
+ * @param img Image
+ */
+static void
+sidecarSave (Image * img)
+{
+	uint64_t page = sysconf (_SC_PAGESIZE);
+	int files = img->differencingLen + 1;
+	uint64_t head = sizeof (SidecarHeader) + files * sizeof (SidecarFile)
+		+ sizeof (SidecarVdi) + sizeof (PartitionTable);
+	uint64_t indexOffset = img->vdi.layers ? (head + page - 1) / page * page : 0;
+	uint64_t size = indexOffset ? indexOffset + (uint64_t) img->vdi.blocks * sizeof (uint64_t)
+		: head;
+	char path[PATH_MAX], tmp[PATH_MAX + 16];
+	SidecarHeader *h;
+	SidecarFile *f;
+	SidecarVdi *v;
+	struct stat st;
+	ssize_t written = -1;
+	int fd, i;
+
+	if (sidecarPath (img, sidecarDir, SIDECAR_SUFFIX, path, sizeof (path)) < 0
+			|| !(h = calloc (1, size)))
+		return;
+	memcpy (h->magic, SIDECAR_MAGIC, sizeof (h->magic));
+	h->version = SIDECAR_VERSION;
+	h->files = files;
+	h->tableSize = sizeof (PartitionTable);
+	h->indexOffset = indexOffset;
+	h->size = size;
+	for (i = 0, f = SIDECAR_FILES (h); i < files; i++, f++)
+	{
+		const char *type = i ? img->differencingType[i - 1] : img->diskType;
+
+		if (stat (sidecarFileName (img, i), &st) < 0)
+			goto done;
+		f->dev = st.st_dev;
+		f->ino = st.st_ino;
+		f->size = st.st_size;
+		f->mtime = st.st_mtim.tv_sec;
+		f->mtimeNs = st.st_mtim.tv_nsec;
+		if (type)
+			strncpy (f->type, type, sizeof (f->type));
+	}
+	v = SIDECAR_VDI (h);
+	v->diskSize = img->vdi.diskSize;
+	v->blockSize = img->vdi.blockSize;
+	v->blocks = img->vdi.blocks;
+	v->layers = img->vdi.layers;
+	for (i = 0; i < img->vdi.layers; i++)
+	{
+		v->layer[i].dataOffset = img->vdi.layer[i].dataOffset;
+		v->layer[i].blockExtra = img->vdi.layer[i].blockExtra;
+		v->layer[i].blocksOffset = img->vdi.layer[i].blocksOffset;
+	}
+	memcpy (SIDECAR_TABLE (h), PARTITIONS (img), sizeof (PartitionTable));
+	SIDECAR_TABLE (h)->refs = 0;
+	SIDECAR_TABLE (h)->retired = NULL;
+	if (indexOffset)
+		memcpy ((char *) h + indexOffset, img->vdi.index,
+						(size_t) img->vdi.blocks * sizeof (uint64_t));
+	sha256 (h + 1, size - sizeof (SidecarHeader), h->checksum);
+
+	snprintf (tmp, sizeof (tmp), "%s.%d", path, (int) getpid ());
+	if ((fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0)
+	{
+		written = write (fd, h, size);
+		if (close (fd) < 0 || written != (ssize_t) size || rename (tmp, path) < 0)
+		{
+			written = -1;
+			unlink (tmp);
+		}
+	}
+	if (written < 0)
+		vbprintf ("cannot write sidecar %s: %s", path, strerror (errno));
+	else
+		vbprintf ("wrote sidecar %s", path);
+done:
+	free (h);
+}
+
+/**
+ * Remove the sidecar of an image that is about to be written to
+ * @param img Image
+ */
+void
+sidecarRemove (Image * img)
+{
+	char path[PATH_MAX];
+
+	if (sidecarPath (img, sidecarDir, SIDECAR_SUFFIX, path, sizeof (path)) == 0
+			&& unlink (path) == 0)
+		vbprintf ("removed sidecar %s", path);
+}
+
+//====================================================================================================
+//                                           Access profile
+//====================================================================================================
+//
+// Jobs that mount the same image over and over read mostly the same parts of
+// it, and the first pass is always cold.  With --profile, the chunks of the disk
+// that are read are recorded in the order they are first read, and written to a
+// profile next to the top image (or in the --profile directory) when the image
+// is closed.  The next open loads the profile, and once the background threads
+// run, a replay thread loads the same chunks into the block cache in the same
+// order.  It only reads while no read or write of the image is in flight, and
+// stops after as much as the cache holds.  Readahead and the replay itself are
+// not recorded, and an image that was not read keeps its old profile.
+
+/**
+ * Set up recording for an image and load the profile of an earlier open
+ * @param img Image
+ */
+void
+profileLoad (Image * img)
+{
+	char path[PATH_MAX];
+	unsigned char sum[SHA256_SIZE];
+	ProfileHeader h;
+	ProfileExtent *e = NULL;
+	struct stat st;
+	size_t size;
+	int fd;
+
+	img->profileChunks = (DISKsize (img) + PROFILE_CHUNK - 1) / PROFILE_CHUNK;
+	if (!img->profileChunks
+			|| !(img->profileSeen = calloc ((img->profileChunks + 7) / 8, 1)))
+		return;
+	if (sidecarPath (img, profileDir, PROFILE_SUFFIX, path, sizeof (path)) < 0
+			|| (fd = open (path, O_RDONLY)) < 0)
+		return;
+	if (fstat (fd, &st) < 0 || pread (fd, &h, sizeof (h), 0) != sizeof (h)
+			|| memcmp (h.magic, PROFILE_MAGIC, sizeof (h.magic)) != 0
+			|| h.version != PROFILE_VERSION || h.chunk != PROFILE_CHUNK
+			|| h.extents > PROFILE_EXTENTS_MAX
+			|| (uint64_t) st.st_size != sizeof (h) + h.extents * sizeof (ProfileExtent))
+	{
+		vbprintf ("%s: not a profile of this version, ignored", path);
+		goto fail;
+	}
+	if (h.diskSize != DISKsize (img))
+	{
+		vbprintf ("%s: recorded for a disk of a different size, ignored", path);
+		goto fail;
+	}
+	size = h.extents * sizeof (ProfileExtent);
+	if (!(e = malloc (size ? size : 1))
+			|| pread (fd, e, size, sizeof (h)) != (ssize_t) size)
+		goto fail;
+	sha256 (e, size, sum);
+	if (memcmp (sum, h.checksum, SHA256_SIZE) != 0)
+	{
+		vbprintf ("%s: bad checksum, ignored", path);
+		goto fail;
+	}
+	close (fd);
+	vbprintf ("loaded profile %s: %llu extents", path, (unsigned long long) h.extents);
+	img->replay = e;
+	img->replayExtents = h.extents;
+	return;
+
+fail:
+	free (e);
+	close (fd);
+}
+
+/**
+ * Record a read in the profile of an image.  Chunks that were read before only
+ * cost a look at the bitmap, without the lock.
+ * @param img Image
+ * @param offset Offset into the disk in bytes
+ * @param len Length of the read
+ */
+void
+profileRecord (Image * img, uint64_t offset, size_t len)
+{
+	uint64_t c = offset / PROFILE_CHUNK;
+	uint64_t last = (offset + len - 1) / PROFILE_CHUNK;
+	uint64_t recorded = 0;
+	ProfileExtent *e;
+
+	if (!len)
+		return;
+	if (last >= img->profileChunks)
+		last = img->profileChunks - 1;
+	while (c <= last && PROFILE_SEEN (img, c))
+		c++;
+	if (c > last)
+		return;
+
+	pthread_mutex_lock (&img->profileMutex);
+	for (; c <= last; c++)
+	{
+		if (PROFILE_SEEN (img, c))
+			continue;
+		e = img->profileExtents ? img->profile + img->profileExtents - 1 : NULL;
+		if (!e || e->start + e->count != c)
+		{
+			if (img->profileExtents == img->profileRoom)
+			{
+				uint64_t room = img->profileRoom ? 2 * img->profileRoom : 1024;
+
+				if (room > PROFILE_EXTENTS_MAX
+						|| !(e = realloc (img->profile, room * sizeof (ProfileExtent))))
+					break;						// the rest of the run goes unrecorded
+				img->profile = e;
+				img->profileRoom = room;
+			}
+			e = img->profile + img->profileExtents++;
+			e->start = c;
+			e->count = 0;
+		}
+		e->count++;
+		__atomic_or_fetch (img->profileSeen + c / 8, 1 << (c % 8), __ATOMIC_RELAXED);
+		recorded += PROFILE_CHUNK;
+	}
+	pthread_mutex_unlock (&img->profileMutex);
+	__sync_fetch_and_add (&profileRecorded, recorded);
+}
+
+/**
+ * Write the profile of an image that is being closed.  It is written to a
+ * temporary file first and renamed, like a sidecar.
+ * @param img Image
+ */
+void
+profileSave (Image * img)
+{
+	size_t size = img->profileExtents * sizeof (ProfileExtent);
+	char path[PATH_MAX], tmp[PATH_MAX + 16];
+	ProfileHeader h;
+	int fd, ok = 0;
+
+	if (!img->profileExtents
+			|| sidecarPath (img, profileDir, PROFILE_SUFFIX, path, sizeof (path)) < 0)
+		return;
+	memset (&h, 0, sizeof (h));
+	memcpy (h.magic, PROFILE_MAGIC, sizeof (h.magic));
+	h.version = PROFILE_VERSION;
+	h.chunk = PROFILE_CHUNK;
+	h.diskSize = DISKsize (img);
+	h.extents = img->profileExtents;
+	sha256 (img->profile, size, h.checksum);
+
+	snprintf (tmp, sizeof (tmp), "%s.%d", path, (int) getpid ());
+	if ((fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0)
+	{
+		ok = write (fd, &h, sizeof (h)) == sizeof (h)
+			&& write (fd, img->profile, size) == (ssize_t) size;
+		if (close (fd) < 0 || !ok || rename (tmp, path) < 0)
+		{
+			ok = 0;
+			unlink (tmp);
+		}
+	}
+	if (!ok)
+		vbprintf ("cannot write profile %s: %s", path, strerror (errno));
+	else
+		vbprintf ("wrote profile %s: %llu extents", path,
+							(unsigned long long) img->profileExtents);
+}
+
+/**
+ * Replay thread: load the chunks of the profile into the cache, in the
+ * order they were read, whenever the image is idle
+ * @param arg Image, kept open until the thread is joined by imageClose
+ */
+static void *
+profileReplay (void *arg)
+{
+	Image *img = arg;
+	uint64_t diskSize = img->profileChunks * PROFILE_CHUNK;
+	uint64_t loaded = 0, i, offset, end;
+	struct timespec start, now;
+	size_t len;
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	for (i = 0; i < img->replayExtents && loaded < cacheSize; i++)
+	{
+		offset = img->replay[i].start * PROFILE_CHUNK;
+		end = offset + img->replay[i].count * PROFILE_CHUNK;
+		if (end > diskSize)
+			end = diskSize;
+		for (; offset < end && loaded < cacheSize; offset += len, loaded += len)
+		{
+			while (__atomic_load_n (&img->foreground, __ATOMIC_RELAXED)
+						 && !__atomic_load_n (&img->replayStop, __ATOMIC_RELAXED))
+				usleep (PROFILE_BACKOFF_US);
+			if (__atomic_load_n (&img->replayStop, __ATOMIC_RELAXED))
+				goto done;
+			len = (end - offset < PROFILE_PIECE) ? end - offset : PROFILE_PIECE;
+			cachePrefetch (img, offset, len);
+		}
+	}
+
+done:
+	__atomic_store_n (&img->replaying, 0, __ATOMIC_RELAXED);
+	__sync_fetch_and_add (&profileReplayed, loaded);
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	vbprintf ("profile replayed: %llu bytes in %llu ms", (unsigned long long) loaded,
+						(unsigned long long) ((now.tv_sec - start.tv_sec) * 1000
+																	+ (now.tv_nsec - start.tv_nsec) / 1000000));
+	free (img->replay);
+	img->replay = NULL;
+	return NULL;
+}
+
+/**
+ * Start replaying the profile an image was opened with.  Must be called after
+ * daemonising.
+ * @param img Image
+ */
+void
+profileStart (Image * img)
+{
+	if (!img->replay || img->replayJoin)
+		return;
+	__atomic_store_n (&img->replaying, 1, __ATOMIC_RELAXED);
+	if (pthread_create (&img->replayThread, NULL, profileReplay, img) != 0)
+	{
+		img->replaying = 0;
+		return;
+	}
+	img->replayJoin = 1;
+}
+
+//====================================================================================================
+//                                             NBD server
+//====================================================================================================
+//
+// With --nbd, vdfuse does not mount anything.  It serves EntireDisk and the
+// partitions as NBD exports of the same names on a Unix socket, so that the
+// kernel's NBD client can attach them without FUSE and a loop device in between.
+// Only the fixed newstyle handshake is spoken.  Every connection has a thread
+// that reads requests and queues them for the workers, which answer in whatever
+// order they finish.  Access rules follow the mount options: other users may
+// connect with -a, and write with -w.
+
+/**
+ * Receive exactly len bytes
+ * @return 0 or -1 if the connection is gone
+ */
+static int
+nbdRecv (int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len)
+	{
+		if ((n = recv (fd, p, len, 0)) <= 0)
+		{
+			if (n < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * Send exactly len bytes
+ * @return 0 or -1 if the connection is gone
+ */
+static int
+nbdSend (int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len)
+	{
+		if ((n = send (fd, p, len, MSG_NOSIGNAL)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * Answer an option during the handshake
+ * @param fd Connection
+ * @param option Option answered
+ * @param type NBD_REP_xxx
+ * @param data Reply data or NULL
+ * @param len Length of data
+ * @return 0 or -1 if the connection is gone
+ */
+static int
+nbdOptionReply (int fd, uint32_t option, uint32_t type, const void *data,
+								uint32_t len)
+{
+	NbdOptionReply r;
+
+	r.magic = htobe64 (NBD_REP_MAGIC);
+	r.option = htobe32 (option);
+	r.type = htobe32 (type);
+	r.len = htobe32 (len);
+	if (nbdSend (fd, &r, sizeof (r)) < 0)
+		return -1;
+	return len ? nbdSend (fd, data, len) : 0;
+}
+
+/**
+ * Find an export
+ * @param t Partition table, see partitionsEnter
+ * @param name EntireDisk or a partition name, empty for EntireDisk
+ * @return the partition or NULL
+ */
+static Partition *
+nbdExport (PartitionTable * t, const char *name)
+{
+	int n = findPartition (t, *name ? name : "EntireDisk");
+	return (n < 0) ? NULL : t->partition + n;
+}
+
+/**
+ * @return transmission flags of a connection
+ */
+static uint16_t
+nbdFlags (NbdConn * c)
+{
+	uint16_t flags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA
+		| NBD_FLAG_SEND_TRIM | NBD_FLAG_SEND_WRITE_ZEROES | NBD_FLAG_CAN_MULTI_CONN;
+	return c->writable ? flags : flags | NBD_FLAG_READ_ONLY;
+}
+
+/**
+ * Attach a connection to its export, which holds on to the partition table
+ * @param c Connection
+ * @param t Partition table, see partitionsEnter
+ * @param p Export in t
+ */
+static void
+nbdOpen (NbdConn * c, PartitionTable * t, Partition * p)
+{
+	partitionsHold (t);
+	c->table = t;
+	c->partition = p;
+	c->ino = INO_PARTITION_FILE (c->image->slot, p - t->partition, KIND_PARTITION);
+	vbprintf ("nbd: export %s", p->name);
+}
+
+/**
+ * Answer NBD_OPT_INFO or NBD_OPT_GO
+ * @param c Connection
+ * @param option NBD_OPT_INFO or NBD_OPT_GO
+ * @param data Option data: name length, name, number of info requests, requests
+ * @param len Length of data
+ * @return 1 to start the transmission phase, 0 to go on with the handshake,
+ * -1 if the connection is gone
+ */
+static int
+nbdInfo (NbdConn * c, uint32_t option, const char *data, uint32_t len)
+{
+	char name[PNAMESIZE + 1] = "";
+	char info[14];
+	uint32_t nameLen, u32;
+	uint16_t requests, u16;
+	uint64_t u64, size = 0;
+	int blockSize = 0, i;
+	PartitionTable *t;
+	Partition *p;
+
+	if (len < 6)
+		return nbdOptionReply (c->fd, option, NBD_REP_ERR_INVALID, NULL, 0);
+	memcpy (&nameLen, data, 4);
+	nameLen = be32toh (nameLen);
+	if (nameLen > len - 6)
+		return nbdOptionReply (c->fd, option, NBD_REP_ERR_INVALID, NULL, 0);
+	memcpy (&requests, data + 4 + nameLen, 2);
+	requests = be16toh (requests);
+	if (6 + nameLen + 2 * (uint32_t) requests != len)
+		return nbdOptionReply (c->fd, option, NBD_REP_ERR_INVALID, NULL, 0);
+	for (i = 0; i < requests; i++)
+	{
+		memcpy (&u16, data + 6 + nameLen + 2 * i, 2);
+		if (be16toh (u16) == NBD_INFO_BLOCK_SIZE)
+			blockSize = 1;
+	}
+
+	if (nameLen > PNAMESIZE)
+		return nbdOptionReply (c->fd, option, NBD_REP_ERR_UNKNOWN, NULL, 0);
+	memcpy (name, data + 4, nameLen);
+	t = partitionsEnter (c->image);
+	if ((p = nbdExport (t, name)))
+	{
+		size = p->size;
+		if (option == NBD_OPT_GO)
+			nbdOpen (c, t, p);
+	}
+	partitionsExit (c->image);
+	if (!p)
+		return nbdOptionReply (c->fd, option, NBD_REP_ERR_UNKNOWN, NULL, 0);
+
+	u16 = htobe16 (NBD_INFO_EXPORT);
+	u64 = htobe64 (size);
+	memcpy (info, &u16, 2);
+	memcpy (info + 2, &u64, 8);
+	u16 = htobe16 (nbdFlags (c));
+	memcpy (info + 10, &u16, 2);
+	if (nbdOptionReply (c->fd, option, NBD_REP_INFO, info, 12) < 0)
+		return -1;
+	if (blockSize)
+	{
+		u16 = htobe16 (NBD_INFO_BLOCK_SIZE);
+		memcpy (info, &u16, 2);
+		u32 = htobe32 (1);
+		memcpy (info + 2, &u32, 4);
+		u32 = htobe32 (cacheSize ? cacheBlock : 4096);
+		memcpy (info + 6, &u32, 4);
+		u32 = htobe32 (NBD_REQUEST_MAX);
+		memcpy (info + 10, &u32, 4);
+		if (nbdOptionReply (c->fd, option, NBD_REP_INFO, info, 14) < 0)
+			return -1;
+	}
+	if (nbdOptionReply (c->fd, option, NBD_REP_ACK, NULL, 0) < 0)
+		return -1;
+	return option == NBD_OPT_GO;
+}
+
+/**
+ * Run the handshake until the client picks an export
+ * @param c Connection
+ * @return 0 when the transmission phase starts, -1 to close the connection
+ */
+static int
+nbdHandshake (NbdConn * c)
+{
+	char hello[18], data[NBD_OPTION_MAX + 1];
+	uint64_t u64;
+	uint32_t clientFlags, option, len;
+	uint16_t u16;
+	NbdOption o;
+	PartitionTable *t;
+	Partition *p;
+	int i, ret;
+
+	u64 = htobe64 (NBD_MAGIC);
+	memcpy (hello, &u64, 8);
+	u64 = htobe64 (NBD_OPTS_MAGIC);
+	memcpy (hello + 8, &u64, 8);
+	u16 = htobe16 (NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+	memcpy (hello + 16, &u16, 2);
+	if (nbdSend (c->fd, hello, sizeof (hello)) < 0
+			|| nbdRecv (c->fd, &clientFlags, 4) < 0)
+		return -1;
+	clientFlags = be32toh (clientFlags);
+	if (clientFlags & ~(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES))
+		return -1;
+
+	for (;;)
+	{
+		if (nbdRecv (c->fd, &o, sizeof (o)) < 0 || be64toh (o.magic) != NBD_OPTS_MAGIC)
+			return -1;
+		option = be32toh (o.option);
+		len = be32toh (o.len);
+		if (len > NBD_OPTION_MAX || nbdRecv (c->fd, data, len) < 0)
+			return -1;
+		data[len] = 0;
+
+		switch (option)
+		{
+			case NBD_OPT_EXPORT_NAME:
+			{
+				char reply[10 + 124] = "";
+
+// This option has no way to report an error but closing the connection
+
+				if (strlen (data) > PNAMESIZE)
+					return -1;
+				t = partitionsEnter (c->image);
+				if ((p = nbdExport (t, data)))
+					nbdOpen (c, t, p);
+				partitionsExit (c->image);
+				if (!p)
+					return -1;
+				u64 = htobe64 (c->partition->size);
+				memcpy (reply, &u64, 8);
+				u16 = htobe16 (nbdFlags (c));
+				memcpy (reply + 8, &u16, 2);
+				return nbdSend (c->fd, reply,
+												(clientFlags & NBD_FLAG_NO_ZEROES) ? 10 : sizeof (reply));
+			}
+			case NBD_OPT_ABORT:
+				nbdOptionReply (c->fd, option, NBD_REP_ACK, NULL, 0);
+				return -1;
+			case NBD_OPT_LIST:
+				if (len)
+				{
+					ret = nbdOptionReply (c->fd, option, NBD_REP_ERR_INVALID, NULL, 0);
+					break;
+				}
+
+// The client may be slow to take the list, so hold the table rather than
+// keeping retired tables from being freed
+
+				partitionsHold (t = partitionsEnter (c->image));
+				partitionsExit (c->image);
+				for (i = 0, ret = 0; i <= t->last && ret == 0; i++)
+				{
+					uint32_t n = strlen (t->partition[i].name);
+					if (t->partition[i].no == UNALLOCATED)
+						continue;
+					option = htobe32 (n);
+					memcpy (data, &option, 4);
+					memcpy (data + 4, t->partition[i].name, n);
+					ret = nbdOptionReply (c->fd, NBD_OPT_LIST, NBD_REP_SERVER, data, 4 + n);
+				}
+				partitionsDrop (c->image, t);
+				if (ret == 0)
+					ret = nbdOptionReply (c->fd, NBD_OPT_LIST, NBD_REP_ACK, NULL, 0);
+				break;
+			case NBD_OPT_INFO:
+			case NBD_OPT_GO:
+				if ((ret = nbdInfo (c, option, data, len)) > 0)
+					return 0;
+				break;
+			default:
+				ret = nbdOptionReply (c->fd, option, NBD_REP_ERR_UNSUP, NULL, 0);
+		}
+		if (ret < 0)
+			return -1;
+	}
+}
+
+/**
+ * Worker side of a request: do it and send the reply
+ * @param arg NbdRequest
+ */
+static void
+nbdRun (void *arg)
+{
+	uint64_t start = traceBegin ();
+	NbdRequest *r = arg;
+	NbdConn *c = r->conn;
+	Image *img = c->image;
+	Partition *p = c->partition;
+	uint64_t offset = p->offset + r->offset;
+	int outside = (r->offset > p->size || r->len > p->size - r->offset);
+	int op = TRACE_WRITE, err = 0;
+	NbdReply reply;
+
+	switch (r->type)
+	{
+		case NBD_CMD_READ:
+			op = TRACE_READ;
+			if (outside)
+				err = EINVAL;
+			else if (!(r->data = bufferGet (r->len)))
+				err = ENOMEM;
+			else if (RT_FAILURE (diskRead (img, offset, r->data, r->len)))
+				err = EIO;
+			break;
+		case NBD_CMD_WRITE:
+		case NBD_CMD_WRITE_ZEROES:
+		case NBD_CMD_TRIM:
+			if (!c->writable)
+				err = EPERM;
+			else if (outside)
+				err = ENOSPC;
+			else if (r->type == NBD_CMD_WRITE
+							 && RT_FAILURE (diskWrite (img, offset, r->data, r->len)))
+				err = EIO;
+			else if (r->type == NBD_CMD_WRITE_ZEROES
+							 && RT_FAILURE (diskZero (img, offset, r->len)))
+				err = EIO;
+
+// Trimming is advisory, so it does nothing if the image cannot free blocks
+
+			else if (r->type == NBD_CMD_TRIM && img->discard
+							 && RT_FAILURE (diskZero (img, offset, r->len)))
+				err = EIO;
+
+			if (!err && (r->flags & NBD_CMD_FLAG_FUA) && RT_FAILURE (groupCommit (img)))
+				err = EIO;
+			break;
+		case NBD_CMD_FLUSH:
+			op = TRACE_FSYNC;
+			if (RT_FAILURE (groupCommit (img)))
+				err = EIO;
+			break;
+		default:
+			err = EINVAL;
+	}
+
+	reply.magic = htobe32 (NBD_REPLY_MAGIC);
+	reply.error = htobe32 (err);
+	reply.handle = r->handle;
+	pthread_mutex_lock (&c->sendMutex);
+	if (nbdSend (c->fd, &reply, sizeof (reply)) < 0
+			|| (r->type == NBD_CMD_READ && !err && nbdSend (c->fd, r->data, r->len) < 0))
+		shutdown (c->fd, SHUT_RDWR);	// the reader notices and closes
+	pthread_mutex_unlock (&c->sendMutex);
+
+	if (r->type != NBD_CMD_TRIM)
+		traceEnd (op, img, p->no, c->ino, r->offset, r->len, err, start);
+	bufferPut (r->data);
+	free (r);
+	pthread_mutex_lock (&c->mutex);
+	c->inflight--;
+	pthread_cond_signal (&c->cond);
+	pthread_mutex_unlock (&c->mutex);
+}
+
+/**
+ * Serve one connection: handshake, then read requests and queue them for the
+ * workers.  Requests are run right here if there are no workers.
+ * @param arg NbdConn
+ */
+static void *
+nbdConnection (void *arg)
+{
+	NbdConn *c = arg;
+	NbdConn **link;
+	NbdRequestHeader h;
+	NbdRequest *r;
+
+	if (c->image && nbdHandshake (c) == 0)
+		while (nbdRecv (c->fd, &h, sizeof (h)) == 0
+					 && be32toh (h.magic) == NBD_REQUEST_MAGIC
+					 && be16toh (h.type) != NBD_CMD_DISC)
+		{
+			if (!(r = calloc (1, sizeof (NbdRequest))))
+				break;
+			r->conn = c;
+			r->flags = be16toh (h.flags);
+			r->type = be16toh (h.type);
+			r->handle = h.handle;
+			r->offset = be64toh (h.offset);
+			r->len = be32toh (h.len);
+			if (r->type == NBD_CMD_READ && r->len > NBD_REQUEST_MAX)
+				r->type = (uint16_t) -1;	// answered with EINVAL
+			if (r->type == NBD_CMD_WRITE
+					&& (r->len > NBD_REQUEST_MAX || !(r->data = bufferGet (r->len))
+							|| nbdRecv (c->fd, r->data, r->len) < 0))
+			{
+				bufferPut (r->data);
+				free (r);
+				break;
+			}
+
+			pthread_mutex_lock (&c->mutex);
+			while (c->inflight >= NBD_INFLIGHT_MAX)
+				pthread_cond_wait (&c->cond, &c->mutex);
+			c->inflight++;
+			pthread_mutex_unlock (&c->mutex);
+			if (taskSubmit (nbdRun, r) < 0)
+				nbdRun (r);
+		}
+
+	pthread_mutex_lock (&c->mutex);
+	while (c->inflight)
+		pthread_cond_wait (&c->cond, &c->mutex);
+	pthread_mutex_unlock (&c->mutex);
+	if (c->table)
+		partitionsDrop (c->image, c->table);
+	if (c->image)
+		imageRelease (c->image);
+	close (c->fd);
+
+	pthread_mutex_lock (&nbdMutex);
+	for (link = &nbdConns; *link != c; link = &(*link)->next)
+		;
+	*link = c->next;
+	pthread_cond_broadcast (&nbdCond);
+	pthread_mutex_unlock (&nbdMutex);
+	pthread_mutex_destroy (&c->sendMutex);
+	pthread_mutex_destroy (&c->mutex);
+	pthread_cond_destroy (&c->cond);
+	free (c);
+	return NULL;
+}
+
+/**
+ * Accept connections until the listening socket is shut down
+ * @param u UNUSED
+ */
+static void *
+nbdListen (void *u UNUSED)
+{
+	struct ucred cred;
+	socklen_t credLen = sizeof (cred);
+	pthread_t tid;
+	NbdConn *c;
+	int fd, owner;
+
+	for (;;)
+	{
+		if ((fd = accept (nbdListenFd, NULL, NULL)) < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+		owner = getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &cred, &credLen) == 0
+			&& (cred.uid == myuid || cred.uid == 0);
+		if ((!owner && !allowall) || !(c = calloc (1, sizeof (NbdConn))))
+		{
+			close (fd);
+			continue;
+		}
+		c->fd = fd;
+		c->image = imageGet (0);
+		c->writable = !readonly && (owner || allowallw);
+		pthread_mutex_init (&c->sendMutex, NULL);
+		pthread_mutex_init (&c->mutex, NULL);
+		pthread_cond_init (&c->cond, NULL);
+
+		pthread_mutex_lock (&nbdMutex);
+		c->next = nbdConns;
+		nbdConns = c;
+		pthread_mutex_unlock (&nbdMutex);
+		if (pthread_create (&tid, NULL, nbdConnection, c) == 0)
+			pthread_detach (tid);
+		else
+			nbdConnection (c);
+	}
+	return NULL;
+}
+
+/**
+ * Serve the image over NBD until SIGINT, SIGTERM or SIGHUP, then close the
+ * connections and write back and close the image
+ * @param path Unix socket to listen on, replaced if it exists
+ * @param foreground Do not daemonise
+ * @return 0 or -1 if the socket cannot be set up
+ */
+int
+nbdServe (const char *path, int foreground)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	sigset_t signals;
+	pthread_t listener;
+	NbdConn *c;
+	int sig;
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen (path) >= sizeof (addr.sun_path))
+		usageAndExit ("socket path %s is too long", path);
+	strcpy (addr.sun_path, path);
+	if (lstat (path, &st) == 0 && S_ISSOCK (st.st_mode))
+		unlink (path);
+	if ((nbdListenFd = socket (AF_UNIX, SOCK_STREAM, 0)) < 0
+			|| bind (nbdListenFd, (struct sockaddr *) &addr, sizeof (addr)) < 0
+			|| chmod (path, allowall ? 0666 : 0600) < 0
+			|| listen (nbdListenFd, SOMAXCONN) < 0)
+	{
+		fprintf (stderr, "%s: cannot listen on %s: %s\n", processName, path,
+						 strerror (errno));
+		return -1;
+	}
+	if (!foreground && daemon (1, 0) < 0)
+		return -1;
+
+// The signals are taken with sigwait, so every thread must have them blocked
+
+	sigemptyset (&signals);
+	sigaddset (&signals, SIGINT);
+	sigaddset (&signals, SIGTERM);
+	sigaddset (&signals, SIGHUP);
+	pthread_sigmask (SIG_BLOCK, &signals, NULL);
+	signal (SIGPIPE, SIG_IGN);
+	backgroundInit ();
+	if (pthread_create (&listener, NULL, nbdListen, NULL) != 0)
+		return -1;
+	vbprintf ("nbd: serving %s", path);
+	sigwait (&signals, &sig);
+
+	vbprintf ("nbd: shutting down");
+	shutdown (nbdListenFd, SHUT_RDWR);
+	pthread_join (listener, NULL);
+	close (nbdListenFd);
+	unlink (path);
+	pthread_mutex_lock (&nbdMutex);
+	for (c = nbdConns; c; c = c->next)
+		shutdown (c->fd, SHUT_RDWR);
+	while (nbdConns)
+		pthread_cond_wait (&nbdCond, &nbdMutex);
+	pthread_mutex_unlock (&nbdMutex);
+	VD_destroy (NULL);
+	return 0;
+}
+
+//====================================================================================================
+//                                           Streaming export
+//====================================================================================================
+//
+// --export copies EntireDisk or a partition out without FUSE, in EXPORT_CHUNK
+// pieces.  The chunks go through a pipeline on the workers: a read stage that
+// skips what the allocation map says is a hole and otherwise reads the chunk and
+// checks whether it is all zeros, then a compression stage that turns each chunk
+// into a gzip member of its own.  Concatenated members are a valid gzip file.
+// The calling thread writes the chunks in order, keeping the workers
+// EXPORT_WINDOW chunks ahead each.  Zero chunks are left as holes in a raw output
+// file and share one precompressed member in a gzip stream.
+
+/**
+ * Compress a buffer into a gzip member
+ * @param level Compression level
+ * @param data Data
+ * @param len Length of data
+ * @param out out: Compressed data, to be freed
+ * @return length of out or 0 on error
+ */
+#ifndef NO_ZLIB
+static size_t
+exportDeflate (int level, const char *data, size_t len, char **out)
+{
+	z_stream z;
+	size_t n = 0;
+
+	memset (&z, 0, sizeof (z));
+	if (deflateInit2 (&z, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return 0;
+	if ((*out = malloc (deflateBound (&z, len))))
+	{
+		z.next_in = (Bytef *) data;
+		z.avail_in = len;
+		z.next_out = (Bytef *) * out;
+		z.avail_out = deflateBound (&z, len);
+		if (deflate (&z, Z_FINISH) == Z_STREAM_END)
+			n = z.total_out;
+		else
+		{
+			free (*out);
+			*out = NULL;
+		}
+	}
+	deflateEnd (&z);
+	return n;
+}
+#else
+static size_t
+exportDeflate (int level UNUSED, const char *data UNUSED, size_t len UNUSED,
+							 char **out UNUSED)
+{
+	return 0;
+}
+#endif
+
+/**
+ * Hand a chunk to the writer
+ * @param c Chunk
+ */
+static void
+exportDone (ExportChunk * c)
+{
+	pthread_mutex_lock (&c->job->mutex);
+	c->state = EXPORT_DONE;
+	pthread_cond_broadcast (&c->job->cond);
+	pthread_mutex_unlock (&c->job->mutex);
+}
+
+/**
+ * Compression stage
+ * @param arg ExportChunk
+ */
+static void
+exportCompress (void *arg)
+{
+	ExportChunk *c = arg;
+	ExportJob *job = c->job;
+
+	if (c->zero && c->len == EXPORT_CHUNK && job->zeroMember)
+	{
+		c->out = job->zeroMember;
+		c->outLen = job->zeroMemberLen;
+	}
+	else
+	{
+		if (c->hole)
+			memset (c->data, 0, c->len);
+		if (!(c->outLen = exportDeflate (job->level, c->data, c->len, &c->out)))
+			c->error = ENOMEM;
+	}
+	exportDone (c);
+}
+
+/**
+ * Read stage
+ * @param arg ExportChunk
+ */
+static void
+exportRead (void *arg)
+{
+	ExportChunk *c = arg;
+	ExportJob *job = c->job;
+	uint64_t offset = job->partition->offset + c->offset;
+
+	if (!diskAllocated (job->image, offset, c->len))
+		c->hole = c->zero = 1;
+	else if (RT_FAILURE (poolRead (job->image, offset, c->data, c->len)))
+		c->error = EIO;
+	else
+		c->zero = isZero (c->data, c->len);
+
+	if (c->error || job->level < 0)
+		exportDone (c);
+	else if (taskSubmit (exportCompress, c) < 0)
+		exportCompress (c);
+}
+
+/**
+ * Write all of a buffer
+ * @param fd Output
+ * @param buf Data
+ * @param len Length of data
+ * @param offset Where to write, or -1 to append to a pipe
+ * @return 0 or -1 on error
+ */
+static int
+exportWrite (int fd, const char *buf, size_t len, off_t offset)
+{
+	ssize_t n;
+
+	while (len)
+	{
+		n = (offset < 0) ? write (fd, buf, len) : pwrite (fd, buf, len, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+		if (offset >= 0)
+			offset += n;
+	}
+	return 0;
+}
+
+/**
+ * Stream a partition out and exit
+ * @param name EntireDisk or a partition name
+ * @param output Output file or NULL for stdout
+ * @return 0 or -1 on error
+ */
+int
+exportStream (const char *name, const char *output)
+{
+	uint64_t start = traceClock (), holes = 0, zeros = 0, written = 0;
+	ExportJob job;
+	ExportChunk *chunk = NULL, *c;
+	struct stat st;
+	uint64_t chunks, next = 0, queued = 0;
+	int window = 0, fd = -1, sparse = 0, n, ret = 0;
+
+	memset (&job, 0, sizeof (job));
+	job.image = imageGet (0);
+	job.level = exportLevel;
+	pthread_mutex_init (&job.mutex, NULL);
+	pthread_cond_init (&job.cond, NULL);
+
+// An export is read only, so the partition table is never rescanned
+
+	if ((n = findPartition (PARTITIONS (job.image), name)) < 0)
+	{
+		fprintf (stderr, "%s: no partition %s\n", processName, name);
+		ret = -1;
+		goto done;
+	}
+	job.partition = PARTITIONS (job.image)->partition + n;
+	if (!output)
+		fd = STDOUT_FILENO;
+	else if ((fd = open (output, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+	{
+		fprintf (stderr, "%s: cannot create %s: %s\n", processName, output,
+						 strerror (errno));
+		ret = -1;
+		goto done;
+	}
+	sparse = job.level < 0 && fstat (fd, &st) == 0 && S_ISREG (st.st_mode);
+
+	backgroundInit ();
+	window = EXPORT_WINDOW * (taskThreads ? taskThreads : 1);
+	chunks = (job.partition->size + EXPORT_CHUNK - 1) / EXPORT_CHUNK;
+	if (!(chunk = calloc (window, sizeof (ExportChunk))))
+	{
+		ret = -1;
+		goto done;
+	}
+	for (n = 0; n < window; n++)
+		if (!(chunk[n].data = malloc (EXPORT_CHUNK)))
+		{
+			ret = -1;
+			goto done;
+		}
+	if (job.level >= 0)
+	{
+		char *zero = calloc (1, EXPORT_CHUNK);
+		if (zero)
+			job.zeroMemberLen = exportDeflate (job.level, zero, EXPORT_CHUNK,
+																				 &job.zeroMember);
+		free (zero);
+	}
+
+	for (next = 0; next < chunks && !ret; next++)
+	{
+		while (queued < chunks && queued < next + window)
+		{
+			c = chunk + queued % window;
+			c->job = &job;
+			c->offset = queued * EXPORT_CHUNK;
+			c->len = job.partition->size - c->offset;
+			if (c->len > EXPORT_CHUNK)
+				c->len = EXPORT_CHUNK;
+			c->state = EXPORT_QUEUED;
+			c->error = c->hole = c->zero = 0;
+			queued++;
+			if (taskSubmit (exportRead, c) < 0)
+				exportRead (c);
+		}
+
+		c = chunk + next % window;
+		pthread_mutex_lock (&job.mutex);
+		while (c->state != EXPORT_DONE)
+			pthread_cond_wait (&job.cond, &job.mutex);
+		pthread_mutex_unlock (&job.mutex);
+
+		if (c->error)
+		{
+			fprintf (stderr, "%s: cannot read %s at %llu: %s\n", processName, name,
+							 (unsigned long long) c->offset, strerror (c->error));
+			ret = -1;
+		}
+		else if (job.level >= 0)
+		{
+			ret = exportWrite (fd, c->out, c->outLen, -1);
+			written += c->outLen;
+		}
+		else if (!(c->zero && sparse))
+		{
+			if (c->hole)
+				memset (c->data, 0, c->len);
+			ret = exportWrite (fd, c->data, c->len, sparse ? (off_t) c->offset : -1);
+			written += c->len;
+		}
+		if (!c->error && ret < 0)
+			fprintf (stderr, "%s: cannot write %s: %s\n", processName,
+							 output ? output : "to stdout", strerror (errno));
+		holes += c->hole ? c->len : 0;
+		zeros += c->zero ? c->len : 0;
+		if (c->out != job.zeroMember)
+			free (c->out);
+		c->out = NULL;
+	}
+
+// Let the chunks still in the pipeline finish before their buffers go
+
+	pthread_mutex_lock (&job.mutex);
+	for (; next < queued; next++)
+		while (chunk[next % window].state != EXPORT_DONE)
+			pthread_cond_wait (&job.cond, &job.mutex);
+	pthread_mutex_unlock (&job.mutex);
+
+done:
+	if (chunk)
+	{
+		for (n = 0; n < window; n++)
+		{
+			if (chunk[n].out != job.zeroMember)
+				free (chunk[n].out);
+			free (chunk[n].data);
+		}
+		free (chunk);
+	}
+	free (job.zeroMember);
+
+	if (!ret && sparse && ftruncate (fd, job.partition->size) < 0)
+		ret = -1;
+	if (output && fd >= 0 && close (fd) < 0)
+		ret = -1;
+	if (job.partition)
+		vbprintf ("export: %s, %llu bytes, %llu in holes, %llu zero, %llu written in %.1fs",
+							name, (unsigned long long) job.partition->size,
+							(unsigned long long) holes, (unsigned long long) zeros,
+							(unsigned long long) written, (traceClock () - start) / 1e9);
+	pthread_mutex_destroy (&job.mutex);
+	pthread_cond_destroy (&job.cond);
+	imageRelease (job.image);
+	VD_destroy (NULL);
+	return ret;
+}
+
+//====================================================================================================
+//                                             Inventory
+//====================================================================================================
+//
+// --inventory describes a list of image files as JSON lines without mounting
+// anything: the format, the virtual size, the image's own id and its parent's,
+// and the partitions.  It is meant for sweeping thousands of images, so it reads
+// as little as it can.  The format and the parent come from the image headers,
+// and the partition scan reads only the MBR and the EBRs.  VDI images are read
+// with a backend that looks up the block map entry of each block it reads
+// instead of loading the map.  VMDK and VHD images are opened through VBoxDDU.
+// A differencing image has no partitions of its own without its parent chain,
+// so none are listed for it.  --io-threads workers take the files in turn.
+
+typedef struct
+{
+	char **files;
+	int count;
+	int next;											// next file to describe
+	FILE *out;
+	int failed;										// files that could not be described
+} InventoryJob;
+
+/**
+ * Read from a VDI image for the partition scan, looking up the block map entry
+ * of every block read
+ * @param img Image, with only layer 0 set up
+ * @param offset Offset into the disk in bytes
+ * @param buf out: Data read
+ * @param len Number of bytes to read
+ * @return 0 or -1 on error
+ */
+static int
+inventoryVdiRead (Image * img, uint64_t offset, void *buf, size_t len)
+{
+	VDIimage *vdi = &img->vdi;
+	VDIlayer *l = vdi->layer;
+	char *out = buf;
+
+	if (offset + len > vdi->diskSize)
+		return -1;
+	while (len)
+	{
+		uint32_t block = offset / vdi->blockSize;
+		uint32_t within = offset % vdi->blockSize;
+		size_t n = vdi->blockSize - within;
+		uint32_t entry;
+		ssize_t got = 0;
+
+		if (n > len)
+			n = len;
+		if (pread (l->fd, &entry, sizeof (entry),
+							 l->blocksOffset + (uint64_t) block * sizeof (entry)) != sizeof (entry))
+			return -1;
+		if (entry < VDI_BLOCK_ZERO
+				&& (got = pread (l->fd, out, n, l->dataOffset
+												 + (uint64_t) entry * (vdi->blockSize + l->blockExtra)
+												 + l->blockExtra + within)) < 0)
+			return -1;
+		memset (out + got, 0, n - got);	// unallocated, or past the end of a truncated image
+		out += n;
+		offset += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static DiskBackend inventoryVdiBackend = {
+	.name = "VDI",
+	.read = inventoryVdiRead,
+	.write = vdiWrite,
+	.flush = vdiFlush,
+	.size = vdiSize,
+	.close = vdiClose,
+	.concurrent = 1
+};
+
+/**
+ * Write a string as a JSON string
+ * @param out Stream
+ * @param s String
+ */
+static void
+inventoryString (FILE * out, const char *s)
+{
+	putc ('"', out);
+	for (; *s; s++)
+	{
+		unsigned char c = *s;
+		if (c == '"' || c == '\\')
+			fprintf (out, "\\%c", c);
+		else if (c < 0x20)
+			fprintf (out, "\\u%04x", c);
+		else
+			putc (c, out);
+	}
+	putc ('"', out);
+}
+
+/**
+ * Write a UUID as a JSON string
+ * @param out Stream
+ * @param u The UUID's 16 bytes
+ * @param le Whether the first three fields are little endian, as in VDI
+ */
+static void
+inventoryUuid (FILE * out, const uint8_t * u, int le)
+{
+	static const int order[2][16] = {
+		{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+		{3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15}
+	};
+	int i;
+
+	putc ('"', out);
+	for (i = 0; i < 16; i++)
+		fprintf (out, "%s%02x", i == 4 || i == 6 || i == 8 || i == 10 ? "-" : "",
+						 u[order[le][i]]);
+	putc ('"', out);
+}
+
+/**
+ * Write the partitions of a table as a JSON array
+ * @param out Stream
+ * @param t Partition table
+ */
+static void
+inventoryPartitions (FILE * out, PartitionTable * t)
+{
+	const char *sep = "";
+	int i;
+
+	fprintf (out, "[");
+	for (i = 1; i <= t->last; i++)
+	{
+		Partition *p = t->partition + i;
+		if (p->no == UNALLOCATED)
+			continue;
+		fprintf (out, "%s{\"name\":", sep);
+		inventoryString (out, p->name);
+		fprintf (out, ",\"number\":%d,\"type\":%u,\"offset\":%lld,\"size\":%llu}",
+						 p->no, p->descriptor.type, (long long) p->offset,
+						 (unsigned long long) p->size);
+		sep = ",";
+	}
+	fprintf (out, "]");
+}
+
+/**
+ * Describe a VDI image
+ * @param out Stream, after the "type" member
+ * @param fd The open image
+ * @param filename Image file
+ * @return NULL or an error message
+ */
+static const char *
+inventoryVdi (FILE * out, int fd, const char *filename)
+{
+	static const uint8_t none[16];
+	VDIpreHeader pre;
+	VDIheader header;
+	PartitionTable *t = NULL;
+	const char *error = NULL;
+	Image *img;
+
+	if (pread (fd, &pre, sizeof (pre), 0) != sizeof (pre)
+			|| pread (fd, &header, sizeof (header), sizeof (pre)) != sizeof (header)
+			|| pre.signature != VDI_SIGNATURE || pre.version != VDI_VERSION
+			|| header.headerSize < sizeof (VDIheader))
+		return "not a VDI 1.1 image";
+	fprintf (out, ",\"variant\":\"%s\",\"size\":%llu,\"uuid\":",
+					 header.type == VDI_TYPE_NORMAL ? "dynamic"
+					 : header.type == VDI_TYPE_FIXED ? "fixed"
+					 : header.type == VDI_TYPE_DIFF ? "differencing" : "unknown",
+					 (unsigned long long) header.diskSize);
+	inventoryUuid (out, header.uuidCreate, 1);
+	fprintf (out, ",\"parent\":");
+	if (header.type == VDI_TYPE_DIFF && memcmp (header.uuidLinkage, none, 16) != 0)
+		inventoryUuid (out, header.uuidLinkage, 1);
+	else
+		fprintf (out, "null");
+	if (header.type == VDI_TYPE_DIFF)
+		return NULL;
+	if (header.blockSize == 0
+			|| (uint64_t) header.blocks * header.blockSize < header.diskSize)
+		return "bad VDI header";
+
+	if (!(img = calloc (1, sizeof (Image))))
+		return "out of memory";
+	pthread_mutex_init (&img->diskMutex, NULL);
+	img->backend = &inventoryVdiBackend;
+	img->vdi.layers = 1;
+	img->vdi.layer[0].fd = dup (fd);
+	img->vdi.layer[0].dataOffset = header.dataOffset;
+	img->vdi.layer[0].blockExtra = header.blockExtra;
+	img->vdi.layer[0].blocksOffset = header.blocksOffset;
+	img->vdi.diskSize = header.diskSize;
+	img->vdi.blockSize = header.blockSize;
+	img->vdi.blocks = header.blocks;
+	if (img->vdi.layer[0].fd < 0)
+		error = strerror (errno);
+	else if (!(t = readPartitionTable (img, &error)))
+		error = "out of memory";
+	else
+	{
+		fprintf (out, ",\"partitions\":");
+		inventoryPartitions (out, t);
+	}
+	vdiClose (img);
+	free (t);
+	free (img);
+	vbprintf ("inventory: %s: %s", filename, error ? error : "ok");
+	return error;
+}
+
+/**
+ * Describe a VHD image
+ * @param out Stream, after the "type" member
+ * @param fd The open image
+ * @param diff out: Whether this is a differencing image
+ * @return NULL or an error message
+ */
+static const char *
+inventoryVhd (FILE * out, int fd, int *diff)
+{
+	VHDfooter footer;
+	VHDdynamicHeader dynamic;
+	uint32_t type;
+
+	if (pread (fd, &footer, sizeof (footer), 0) != sizeof (footer))
+		return "cannot read the VHD footer";
+	type = be32toh (footer.diskType);
+	*diff = type == VHD_TYPE_DIFF;
+	fprintf (out, ",\"variant\":\"%s\",\"size\":%llu,\"uuid\":",
+					 type == VHD_TYPE_FIXED ? "fixed" : type == VHD_TYPE_DYNAMIC ? "dynamic"
+					 : type == VHD_TYPE_DIFF ? "differencing" : "unknown",
+					 (unsigned long long) be64toh (footer.currentSize));
+	inventoryUuid (out, footer.uniqueId, 0);
+	fprintf (out, ",\"parent\":");
+	if (*diff && pread (fd, &dynamic, sizeof (dynamic), be64toh (footer.dataOffset))
+			== sizeof (dynamic) && memcmp (dynamic.cookie, "cxsparse", 8) == 0)
+		inventoryUuid (out, dynamic.parentUniqueId, 0);
+	else
+		fprintf (out, "null");
+	return NULL;
+}
+
+/**
+ * Describe a VMDK image from its sparse extent header and embedded descriptor.
+ * VMDK identifies images by a 32 bit content id rather than a UUID.
+ * @param out Stream, after the "type" member
+ * @param fd The open image
+ * @param diff out: Whether this is a differencing image
+ * @return NULL or an error message
+ */
+static const char *
+inventoryVmdk (FILE * out, int fd, int *diff)
+{
+	VMDKheader header;
+	char *desc, *s, *save;
+	char variant[64] = "unknown", cid[9] = "", parent[9] = "";
+	size_t len;
+	ssize_t got;
+
+	if (pread (fd, &header, sizeof (header), 0) != sizeof (header))
+		return "cannot read the VMDK header";
+	if (memcmp (header.magic, "KDMV", 4) != 0 || !header.descriptorOffset)
+		return "only VMDK images with an embedded descriptor are supported";
+	len = header.descriptorSize * BLOCKSIZE;
+	if (len > INVENTORY_DESCRIPTOR_MAX)
+		len = INVENTORY_DESCRIPTOR_MAX;
+	if (!(desc = malloc (len + 1)))
+		return "out of memory";
+	if ((got = pread (fd, desc, len, header.descriptorOffset * BLOCKSIZE)) < 0)
+		got = 0;
+	desc[got] = 0;
+	for (s = strtok_r (desc, "\r\n", &save); s; s = strtok_r (NULL, "\r\n", &save))
+		if (sscanf (s, " parentCID = %8[0-9a-fA-F]", parent) != 1
+				&& sscanf (s, " CID = %8[0-9a-fA-F]", cid) != 1)
+			sscanf (s, " createType = \"%63[^\"]\"", variant);
+	free (desc);
+	*diff = *parent && strcasecmp (parent, "ffffffff") != 0;
+
+	fprintf (out, ",\"variant\":");
+	inventoryString (out, variant);
+	fprintf (out, ",\"size\":%llu,\"uuid\":",
+					 (unsigned long long) header.capacity * BLOCKSIZE);
+	if (*cid)
+		inventoryString (out, cid);
+	else
+		fprintf (out, "null");
+	fprintf (out, ",\"parent\":");
+	if (*diff)
+		inventoryString (out, parent);
+	else
+		fprintf (out, "null");
+	return NULL;
+}
+
+/**
+ * List the partitions of a VMDK or VHD image opened through VBoxDDU
+ * @param out Stream
+ * @param filename Image file
+ * @return NULL or an error message
+ */
+static const char *
+inventoryVbox (FILE * out, const char *filename)
+{
+#ifdef NO_VBOX
+	(void) out;
+	(void) filename;
+	return "built without VBoxDDU, partitions are only listed for VDI images";
+#else
+	const char *error;
+	Image *img;
+
+	if (!(img = imageOpen ("", filename, NULL, 0, &error)))
+		return error;
+	fprintf (out, ",\"partitions\":");
+	inventoryPartitions (out, PARTITIONS (img));
+	imageClose (img);
+	return NULL;
+#endif
+}
+
+/**
+ * Describe one image as a JSON line
+ * @param job Job
+ * @param filename Image file
+ * @return 0 or -1 if the image could not be described
+ */
+static int
+inventoryImage (InventoryJob * job, const char *filename)
+{
+	char *line = NULL, *type = NULL;
+	const char *error = NULL;
+	size_t len = 0;
+	FILE *out;
+	int fd, diff = 0;
+
+	if (!(out = open_memstream (&line, &len)))
+		return -1;
+	fprintf (out, "{\"file\":");
+	inventoryString (out, filename);
+	if ((fd = open (filename, O_RDONLY)) < 0)
+		error = strerror (errno);
+	else if (detectDiskType (&type, (char *) filename) < 0)
+		error = "unknown image format";
+	else
+	{
+		fprintf (out, ",\"type\":\"%s\"", type);
+		if (strcmp (type, "VDI") == 0)
+			error = inventoryVdi (out, fd, filename);
+		else if (!(error = strcmp (type, "VHD") == 0 ? inventoryVhd (out, fd, &diff)
+							 : inventoryVmdk (out, fd, &diff)) && !diff)
+			error = inventoryVbox (out, filename);
+	}
+	if (fd >= 0)
+		close (fd);
+	if (error)
+	{
+		fprintf (out, ",\"error\":");
+		inventoryString (out, error);
+	}
+	fprintf (out, "}\n");
+	if (fclose (out) == 0)
+		fwrite (line, 1, len, job->out);	// one write per line, stdio locks the stream
+	free (line);
+	return error ? -1 : 0;
+}
+
+/**
+ * Worker, describes files until there are none left
+ * @param arg InventoryJob
+ * @return NULL
+ */
+static void *
+inventoryWorker (void *arg)
+{
+	InventoryJob *job = arg;
+	int n;
+
+	while ((n = __sync_fetch_and_add (&job->next, 1)) < job->count)
+		if (inventoryImage (job, job->files[n]) < 0)
+			__sync_add_and_fetch (&job->failed, 1);
+	return NULL;
+}
+
+/**
+ * Describe a list of images and exit
+ * @param files Image files, or none or "-" to read them from stdin, one per line
+ * @param count Number of files
+ * @param output Output file or NULL for stdout
+ * @return 0, or -1 if any image could not be described
+ */
+int
+inventoryRun (char **files, int count, const char *output)
+{
+	InventoryJob job;
+	pthread_t thread[IO_THREADS_MAX];
+	char *line = NULL;
+	size_t size = 0, room = 0;
+	ssize_t len;
+	int threads = ioThreads ? ioThreads : 1, i;
 
-	vbprintf ("disktype is %s", *disktype);
-	close (fd);
-	return 0;
+	memset (&job, 0, sizeof (job));
+	job.files = files;
+	job.count = count;
+	if (!count || (count == 1 && strcmp (files[0], "-") == 0))
+	{
+		job.files = NULL;
+		job.count = 0;
+		while ((len = getline (&line, &size, stdin)) >= 0)
+		{
+			while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+				line[--len] = 0;
+			if (!len)
+				continue;
+			if (job.count == (int) room)
+			{
+				char **more = realloc (job.files, (room = room ? room * 2 : 256)
+															 * sizeof (char *));
+				if (!more)
+					return -1;
+				job.files = more;
+			}
+			if (!(job.files[job.count++] = strdup (line)))
+				return -1;
+		}
+		free (line);
+	}
+	if (!(job.out = output ? fopen (output, "w") : stdout))
+	{
+		fprintf (stderr, "%s: cannot create %s: %s\n", processName, output,
+						 strerror (errno));
+		return -1;
+	}
+
+	if (threads > job.count)
+		threads = job.count;
+	for (i = 0; i < threads; i++)
+		if (pthread_create (thread + i, NULL, inventoryWorker, &job) != 0)
+			break;
+	if (i == 0)
+		inventoryWorker (&job);
+	while (i--)
+		pthread_join (thread[i], NULL);
+
+	if (job.files != files)
+	{
+		for (i = 0; i < job.count; i++)
+			free (job.files[i]);
+		free (job.files);
+	}
+	if (fflush (job.out) != 0 || (output && fclose (job.out) != 0))
+		return -1;
+	return job.failed ? -1 : 0;
 }
 
 //====================================================================================================
-//                                         Fuse Callback Routines
+//                                      Inodes and replies
 //====================================================================================================
 //
-// in alphetic order to help find them: destroy ,flush ,getattr ,open, read, readdir, write
+// vdfuse uses the FUSE low-level API.  The tree is fixed apart from the images
+// of a daemon, so every object has a constant inode number: the root is
+// FUSE_ROOT_ID and the statistics directory and its files follow.  images[slot]
+// owns the inodes from INO_IMAGE (slot), its directory in daemon mode, and
+// partition n (0 being EntireDisk) of the image owns the INO_STRIDE inodes from
+// INO_PARTITION_FILE (slot, n, 0), one per KIND_xxx.  A normal mount shows the
+// partitions of images[0] in the root directory.  The numbers survive a rescan
+// of the partition table; a partition that has gone away simply fails getattr
+// and open.  A slot can be reused after an image is removed, so the generation
+// of an inode is the id of its image.
 
-pthread_mutex_t disk_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t part_mutex = PTHREAD_MUTEX_INITIALIZER;
+typedef struct
+{
+	char *data;
+	size_t size;
+	int failed;										// out of memory, the listing is incomplete
+} DirBuf;
 
 /**
- * Close the disk
- * @param UNUSED yes, this is unused
+ * Find the image whose partitions a directory holds
+ * @param ino Inode number of the directory
+ * @return the image with a reference held or NULL
  */
-void
-VD_destroy (void *u UNUSED)
+static Image *
+directoryImage (fuse_ino_t ino)
 {
-// called when the fuse filesystem is umounted
-	vbprintf ("destroy");
-	DISKclose;
+	if (!daemonMode)
+		return (ino == FUSE_ROOT_ID) ? imageGet (0) : NULL;
+	if (INO_SLOT (ino) < 0 || INO_LOCAL (ino) != 0)
+		return NULL;
+	return imageGet (INO_SLOT (ino));
 }
 
 /**
- * Make sure the on disk representation of a virtual HDD is up to date.
- * @param p Additional info for -v output
- * @param UNUSED
+ * Map an inode number to a partition, see INO_KIND for which of its files it is
+ * @param t Partition table of the image the inode belongs to, see partitionsEnter
+ * @param ino Inode number
+ * @return partition in t or NULL
  */
-int
-VD_flush (const char *p, struct fuse_file_info *i UNUSED)
+static Partition *
+inodePartition (PartitionTable * t, fuse_ino_t ino)
 {
-	vbprintf ("flush: %s", p);
-	DISKflush;
-	return 0;
+	fuse_ino_t local = INO_LOCAL (ino);
+	Partition *p;
+
+	if (local < INO_PARTITION || INO_KIND (ino) >= KIND_MAX
+			|| (local - INO_PARTITION) / INO_STRIDE > (fuse_ino_t) t->last)
+		return NULL;
+	p = t->partition + (local - INO_PARTITION) / INO_STRIDE;
+	return (p->no == UNALLOCATED) ? NULL : p;
 }
 
 /**
- * 
- * @param p Partition
+ * Find a partition or one of its virtual files by name
+ * @param img Image
+ * @param name File name, e.g. Partition1 or Partition1.allocmap
+ * @param kind out: KIND_xxx of the file
+ * @return -1 if there is no such file, the partition id else
+ */
+static int
+partitionFile (Image * img, const char *name, int *kind)
+{
+	const char *dot = strchr (name, '.');
+	size_t len = dot ? (size_t) (dot - name) : strlen (name);
+	char base[PNAMESIZE + 1];
+
+	if (len > PNAMESIZE)
+		return -1;
+	memcpy (base, name, len);
+	base[len] = 0;
+	for (*kind = 0; *kind < KIND_MAX; (*kind)++)
+		if (strcmp (dot ? dot : "", partitionSuffix[*kind]) == 0)
+		{
+			int n = findPartition (partitionsEnter (img), base);
+			partitionsExit (img);
+			return n;
+		}
+	return -1;
+}
+
+/**
+ * Fill in the attributes of an inode
+ * @param ino Inode number
  * @param stbuf out: Results
- * @return 0
+ * @return 0 or -1 if there is no such inode
  */
 static int
-VD_getattr (const char *p, struct stat *stbuf)
+fillStat (fuse_ino_t ino, struct stat *stbuf)
 {
-	vbprintf ("getattr: %s", p);
-	int isFileRoot = (strcmp ("/", p) == 0);
-	int n = findPartition (p);
+	int isFileRoot = (ino == FUSE_ROOT_ID || ino == INO_STATSDIR);
+	int isStats = (ino == INO_STATSFILE);
+	int isControl = (ino == INO_CONTROLFILE && daemonMode);
+	Image *img = NULL;
+	PartitionTable *t = NULL;
+	Partition *p = NULL;
 
-	if (!isFileRoot && n == -1)
-		return -ENOENT;
+	if (INO_SLOT (ino) >= 0)
+	{
+		if (!(img = imageGet (INO_SLOT (ino))))
+			return -1;
+		if (INO_LOCAL (ino) == 0)
+			isFileRoot = daemonMode;
+		else
+			p = inodePartition (t = partitionsEnter (img), ino);
+	}
+	if (!isFileRoot && !isStats && !isControl && !p)
+	{
+		if (t)
+			partitionsExit (img);
+		if (img)
+			imageRelease (img);
+		return -1;
+	}
 
 // Use the container file's stat return as the basis. However since partitions cannot
 // be created by creating files, there is no write access to the directory.  I also
-// treat group access the same as other.
+// treat group access the same as other.  The directories of a daemon that are not
+// an image have no container file.
 
-	memcpy (stbuf, &VDfile_stat, sizeof (struct stat));
+	if (img)
+		memcpy (stbuf, &img->fileStat, sizeof (struct stat));
+	else
+		memcpy (stbuf, daemonMode ? &rootStat : &images[0]->fileStat,
+						sizeof (struct stat));
+	stbuf->st_ino = ino;
 
 	if (isFileRoot)
 	{
@@ -643,6 +8717,29 @@ VD_getattr (const char *p, struct stat *stbuf)
 		stbuf->st_size = 0;
 		stbuf->st_blocks = 2;
 	}
+	else if (isStats)
+	{
+		stbuf->st_mode = S_IFREG | S_IRUSR | S_IRGRP;
+		if (allowall)
+			stbuf->st_mode |= S_IROTH;
+		stbuf->st_size = 0;
+		stbuf->st_blocks = 0;
+	}
+	else if (isControl)
+	{
+		stbuf->st_mode = S_IFREG | S_IRUSR | S_IWUSR;
+		stbuf->st_size = 0;
+		stbuf->st_blocks = 0;
+	}
+	else if (INO_KIND (ino) != KIND_PARTITION)
+	{
+		stbuf->st_mode = S_IFREG | S_IRUSR | S_IRGRP;
+		if (allowall)
+			stbuf->st_mode |= S_IROTH;
+		stbuf->st_size = (INO_KIND (ino) == KIND_SHA256MAP) ? sha256mapSize (p)
+			: allocmapSize (p);				// a changemap is laid out like the allocmap
+		stbuf->st_blocks = (stbuf->st_size + BLOCKSIZE - 1) / BLOCKSIZE;
+	}
 	else
 	{
 		stbuf->st_mode = S_IFREG | S_IRUSR | S_IWUSR;
@@ -650,163 +8747,688 @@ VD_getattr (const char *p, struct stat *stbuf)
 			stbuf->st_mode |= S_IRGRP | S_IROTH;
 		if (allowallw)
 			stbuf->st_mode |= S_IWGRP | S_IWOTH;
-		stbuf->st_size = partitionTable[n].size;
+		stbuf->st_size = p->size;
 		stbuf->st_blocks = (stbuf->st_size + BLOCKSIZE - 1) / BLOCKSIZE;
 	}
-	if (readonly)
+	if (readonly && !isControl)
 	{
 		stbuf->st_mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
 	}
 
 	stbuf->st_nlink = 1;
 
+	if (t)
+		partitionsExit (img);
+	if (img)
+		imageRelease (img);
 	return 0;
 }
 
 /**
- * Open Partition
- * @param cName Partition name
- * @param i Fuse file info
- * @return 0
+ * Append an entry to a directory listing
+ * @param req Fuse request the listing is for
+ * @param d Listing
+ * @param name Entry name
+ * @param ino Inode number of the entry
+ */
+static void
+dirAdd (fuse_req_t req, DirBuf * d, const char *name, fuse_ino_t ino)
+{
+	struct stat st;
+	size_t old = d->size;
+	char *data;
+
+	memset (&st, 0, sizeof (st));
+	st.st_ino = ino;
+	d->size += fuse_add_direntry (req, NULL, 0, name, NULL, 0);
+	if (!(data = realloc (d->data, d->size)))
+	{
+		d->size = old;
+		d->failed = 1;
+		return;
+	}
+	d->data = data;
+	fuse_add_direntry (req, d->data + old, d->size - old, name, &st, d->size);
+}
+
+/**
+ * Answer a read with buffers that point into the image file, so that libfuse
+ * can splice the data from the file into the fuse device without copying it
+ * through user space.  Holes are served from a shared buffer of zeros.  The
+ * range is held until the data has been copied, so a write cannot change it.
+ * @param req Fuse request
+ * @param img Image
+ * @param offset Absolute disk offset
+ * @param len Length of the read
+ * @return 0 if the request was answered, -1 if the caller has to read the data
  */
 static int
-VD_open (const char *cName, struct fuse_file_info *i)
+replySpliced (fuse_req_t req, Image * img, uint64_t offset, size_t len)
 {
-	vbprintf ("open: %s, %lld, 0X%08lX ", cName, i->fh, i->flags);
-	int n = findPartition (cName);
-	if ((n == -1) || (entireDiskOpened && n > 0) || (partitionOpened && n == 0))
-		return -ENOENT;
-	if (readonly && ((i->flags & (O_WRONLY | O_RDWR)) != 0))
-		return -EROFS;
+	DiskExtent ext[SPLICE_EXTENTS_MAX];
+	struct fuse_bufvec *bufv;
+	RangeHold hold;
+	size_t covered = 0;
+	int n, i;
 
-	if (n == 0)
-		entireDiskOpened = 1;
-	else
-		partitionOpened = 1;
+	if (!img->backend->map || !img->backend->concurrent)
+		return -1;									// the file may only be read under diskMutex
+	rangeLock (img, &hold, offset, len, 0);
+	n = img->backend->map (img, offset, len, ext, SPLICE_EXTENTS_MAX);
+	for (i = 0; i < n; i++)
+	{
+		if (ext[i].fd < 0 && ext[i].len > SPLICE_ZERO_MAX)
+			break;
+		covered += ext[i].len;
+	}
+	if (n <= 0 || covered < len || !(bufv = calloc (1, sizeof (struct fuse_bufvec)
+																								 + (n - 1) * sizeof (struct fuse_buf))))
+	{
+		rangeUnlock (img, &hold);
+		return -1;
+	}
+	bufv->count = n;
+	for (i = 0; i < n; i++)
+	{
+		bufv->buf[i].size = ext[i].len;
+		if (ext[i].fd < 0)
+			bufv->buf[i].mem = spliceZeros;
+		else
+		{
+			bufv->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+			bufv->buf[i].fd = ext[i].fd;
+			bufv->buf[i].pos = ext[i].pos;
+		}
+	}
 
-	pthread_mutex_lock (&part_mutex);
-	opened++;
-	pthread_mutex_unlock (&part_mutex);
+// fuse_reply_data answers the request even when it fails
 
+	fuse_reply_data (req, bufv, FUSE_BUF_SPLICE_MOVE);
+	rangeUnlock (img, &hold);
+	free (bufv);
 	return 0;
 }
 
 /**
- * Open Partition
- * @param cName Partition name
+ * Drop an open handle and its reference on the image
+ * @param fh Handle to free
+ */
+static void
+closeHandle (FileHandle * fh)
+{
+	Image *img = fh->image;
+
+	if (!fh->data)
+		pthread_mutex_destroy (&fh->mutex);
+	if (fh->table)
+		partitionsDrop (img, fh->table);
+	free (fh->data);
+	free (fh);
+
+	if (img)
+		imageRelease (img);
+}
+
+//====================================================================================================
+//                                         Fuse Callback Routines
+//====================================================================================================
+//
+// in alphetic order to help find them: destroy ,fallocate ,flush ,fsync ,getattr ,init ,lookup ,open, read, readdir, release, write_buf
+
+/**
+ * Write back and close all images
+ * @param UNUSED yes, this is unused
+ */
+static void
+VD_destroy (void *u UNUSED)
+{
+	Image *list[IMAGES_MAX];
+	int i, n;
+
+// called when the fuse filesystem is umounted.  No more requests come in, so
+// the images are closed even if the kernel did not release every handle.  The
+// background threads are stopped first: a readahead job or a write back pass
+// still holds its reference and would otherwise use an image after it is closed.
+
+	vbprintf ("destroy");
+	n = imageList (list);
+	for (i = 0; i < n; i++)
+	{
+		if (writeBack)
+			groupCommit (list[i]);
+		imageRelease (list[i]);
+	}
+	if (verbose && cacheSize)
+	{
+		char stats[512];
+		cacheStats (stats, sizeof (stats));
+		vbprintf ("%s", stats);
+	}
+	backgroundStop ();
+
+	pthread_rwlock_wrlock (&imagesLock);
+	for (i = n = 0; i < imageCount; i++)
+		if (images[i])
+		{
+			list[n++] = images[i];
+			images[i] = NULL;
+		}
+	pthread_rwlock_unlock (&imagesLock);
+	for (i = 0; i < n; i++)
+		imageClose (list[i]);
+}
+
+/**
+ * Punch a hole in or zero a range of a partition.  fstrim on a loop device
+ * arrives here as holes, which free whole blocks in the image if it can discard
+ * (see diskZero).  Holes are refused otherwise, as nothing would be freed.
+ * @param req Fuse request
+ * @param ino Inode, for tracing
+ * @param mode FALLOC_FL_PUNCH_HOLE or FALLOC_FL_ZERO_RANGE, with
+ * FALLOC_FL_KEEP_SIZE as the size is fixed
+ * @param offset Offset into the file
+ * @param length Length of the range
  * @param i Fuse file info
- * @return 0
  */
-static int
-VD_release (const char *name, struct fuse_file_info *fi)
+static void
+VD_fallocate (fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+							off_t length, struct fuse_file_info *i)
 {
-	(void) fi;
-	vbprintf ("release: %s", name);
+	uint64_t start = traceBegin ();
+	FileHandle *fh = (FileHandle *) (uintptr_t) i->fh;
+	Image *img = fh->image;
+	Partition *p = fh->partition;
+	int err = 0;
 
-	pthread_mutex_lock (&part_mutex);
-	opened--;
-	if (opened == 0)
+	if (fh->data || fh->control || readonly)
+		err = EOPNOTSUPP;
+	else if (mode != (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)
+					 && (mode & ~FALLOC_FL_KEEP_SIZE) != FALLOC_FL_ZERO_RANGE)
+		err = EOPNOTSUPP;
+	else if ((mode & FALLOC_FL_PUNCH_HOLE) && !img->discard)
+		err = EOPNOTSUPP;
+	else if (offset < 0 || length <= 0)
+		err = EINVAL;
+	else if ((uint64_t) offset < p->size)
 	{
-		initialisePartitionTable ();
-		entireDiskOpened = 0;
-		partitionOpened = 0;
+		if ((uint64_t) (offset + length) > p->size)
+			length = p->size - offset;
+		if (RT_FAILURE (diskZero (img, offset + p->offset, length)))
+			err = EIO;
 	}
-	pthread_mutex_unlock (&part_mutex);
+	fuse_reply_err (req, err);
+	traceEnd (TRACE_WRITE, img, fh->data ? TRACE_OTHER : p->no, ino, offset, length,
+						err, start);
+}
 
-	return 0;
+/**
+ * Called on every close of a handle.  In write-back mode this is not a
+ * durability point, dirty data stays cached until fsync or a threshold.
+ * Otherwise make sure the on disk representation of a virtual HDD is up to date.
+ * @param req Fuse request
+ * @param ino Inode, for -v output
+ * @param i Fuse file info
+ */
+static void
+VD_flush (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *i)
+{
+	uint64_t start = traceBegin ();
+	FileHandle *fh = (FileHandle *) (uintptr_t) i->fh;
+
+	if (!fh->data && !writeBack)
+		groupCommit (fh->image);
+	fuse_reply_err (req, 0);
+	traceEnd (TRACE_FLUSH, fh->image, fh->data ? TRACE_OTHER : fh->partition->no,
+						ino, 0, 0, 0, start);
 }
 
 /**
- * Read from a file
- * @param c
- * @param out
- * @param len
- * @param offset
- * @param i
- * @return length read or -EIO
+ * Write back everything dirty and flush the disk
+ * @param req Fuse request, answered with 0 or EIO
+ * @param ino Inode, for -v output
+ * @param datasync UNUSED, there is no metadata to skip
+ * @param i Fuse file info
  */
-static int
-VD_read (const char *c, char *out, size_t len, off_t offset,
-				 struct fuse_file_info *i UNUSED)
+static void
+VD_fsync (fuse_req_t req, fuse_ino_t ino, int datasync UNUSED,
+					struct fuse_file_info *i)
 {
-	vbprintf ("read: %s, offset=%lld, length=%d", c, offset, len);
-	int n = findPartition (c);
-	if (n < 0)
-		return -ENOENT;
-	if ((n == 0) ? partitionOpened : entireDiskOpened)
-		return -EIO;
+	uint64_t start = traceBegin ();
+	FileHandle *fh = (FileHandle *) (uintptr_t) i->fh;
+	int err = 0;
 
-	Partition *p = &(partitionTable[n]);
-//   if (offset >= p->size) return 0;
-//   if (offset + len> p->size) len = p->size - offset;
-	if ((uint64_t) offset >= p->size)
-		return 0;
-	if ((uint64_t) (offset + len) > p->size)
-		len = p->size - offset;
+	if (!fh->data && RT_FAILURE (groupCommit (fh->image)))
+		err = EIO;
+	fuse_reply_err (req, err);
+	traceEnd (TRACE_FSYNC, fh->image, fh->data ? TRACE_OTHER : fh->partition->no,
+						ino, 0, 0, err, start);
+}
+
+/**
+ * 
+ * @param req Fuse request
+ * @param ino Inode
+ * @param i UNUSED
+ */
+static void
+VD_getattr (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *i UNUSED)
+{
+	uint64_t start = traceBegin ();
+	Image *img = imageGet (INO_SLOT (ino));
+	Partition *p = img ? inodePartition (partitionsEnter (img), ino) : NULL;
+	int no = p ? p->no : TRACE_OTHER;
+	struct stat stbuf;
+	int err = 0;
+
+	if (img)
+		partitionsExit (img);
+	if (fillStat (ino, &stbuf) < 0)
+		fuse_reply_err (req, err = ENOENT);
+	else
+		fuse_reply_attr (req, &stbuf, ATTR_TIMEOUT);
+	traceEnd (TRACE_GETATTR, img, no, ino, 0, 0, err, start);
+	if (img)
+		imageRelease (img);
+}
+
+/**
+ * Called once fuse is up, after it has daemonised
+ * @param userdata UNUSED
+ * @param conn Connection parameters, used to ask for splice and big writes
+ */
+static void
+VD_init (void *userdata UNUSED, struct fuse_conn_info *conn)
+{
+	vbprintf ("init");
+	backgroundInit ();
 
-	pthread_mutex_lock (&disk_mutex);
-	int ret = DISKread (offset + p->offset, out, len);
-	pthread_mutex_unlock (&disk_mutex);
+// A daemon does not know yet whether its images can be spliced
 
-	return RT_SUCCESS (ret) ? (signed) len : -EIO;
+	if (!cacheSize && (daemonMode || images[0]->backend->map))
+	{
+		spliceZeros = calloc (1, SPLICE_ZERO_MAX);
+		conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+	}
+	conn->want |= conn->capable & FUSE_CAP_BIG_WRITES;
 }
 
 /**
- * Read from a file
- * @param p
- * @param buf
- * @param filler
- * @param offset
- * @param i
- * @return o or -ENOENT
+ * Look up a name in a directory
+ * @param req Fuse request
+ * @param parent Inode of the directory
+ * @param name Name to look for
  */
-static int
-VD_readdir (const char *p, void *buf, fuse_fill_dir_t filler,
-						off_t offset UNUSED, struct fuse_file_info *i UNUSED)
+static void
+VD_lookup (fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-	int n;
+	struct fuse_entry_param e;
+	Image *img = NULL;
+	int n, kind;
+
+	vbprintf ("lookup: %lu/%s", parent, name);
+	memset (&e, 0, sizeof (e));
+	if (parent == FUSE_ROOT_ID && strcmp (name, STATSDIR) == 0)
+		e.ino = INO_STATSDIR;
+	else if (parent == INO_STATSDIR && strcmp (name, STATSFILE) == 0)
+		e.ino = INO_STATSFILE;
+	else if (parent == INO_STATSDIR && daemonMode && strcmp (name, CONTROLFILE) == 0)
+		e.ino = INO_CONTROLFILE;
+	else if (parent == FUSE_ROOT_ID && daemonMode)
+	{
+		if ((img = imageFind (name)))
+			e.ino = INO_IMAGE (img->slot);
+	}
+	else if ((img = directoryImage (parent))
+					 && (n = partitionFile (img, name, &kind)) >= 0)
+		e.ino = INO_PARTITION_FILE (img->slot, n, kind);
+
+	if (img)
+	{
+		e.generation = img->id;
+		imageRelease (img);
+	}
+	if (!e.ino || fillStat (e.ino, &e.attr) < 0)
+	{
+		fuse_reply_err (req, ENOENT);
+		return;
+	}
+	e.attr_timeout = ATTR_TIMEOUT;
+	e.entry_timeout = ATTR_TIMEOUT;
+	fuse_reply_entry (req, &e);
+}
+
+/**
+ * Open Partition
+ * @param req Fuse request
+ * @param ino Inode of the partition
+ * @param i Fuse file info
+ */
+static void
+VD_open (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *i)
+{
+	vbprintf ("open: %lu, 0X%08lX ", ino, i->flags);
+	if (ino == INO_STATSFILE)
+	{
+		if ((i->flags & (O_WRONLY | O_RDWR)) != 0)
+		{
+			fuse_reply_err (req, EACCES);
+			return;
+		}
+		if (!(i->fh = (uintptr_t) statsOpen ()))
+		{
+			fuse_reply_err (req, ENOMEM);
+			return;
+		}
+		i->direct_io = 1;					// size is unknown to getattr
+		if (fuse_reply_open (req, i) == -ENOENT)
+			closeHandle ((FileHandle *) (uintptr_t) i->fh);	// interrupted
+		return;
+	}
+
+// The mount is not checked with default_permissions, and anybody who can add an
+// image can make vdfuse open any file it can access
+
+	if (ino == INO_CONTROLFILE && daemonMode)
+	{
+		const struct fuse_ctx *ctx = fuse_req_ctx (req);
+		if (ctx->uid != myuid && ctx->uid != 0)
+		{
+			fuse_reply_err (req, EACCES);
+			return;
+		}
+		if (!(i->fh = (uintptr_t) controlOpen ()))
+		{
+			fuse_reply_err (req, ENOMEM);
+			return;
+		}
+		i->direct_io = 1;
+		if (fuse_reply_open (req, i) == -ENOENT)
+			closeHandle ((FileHandle *) (uintptr_t) i->fh);	// interrupted
+		return;
+	}
+
+// A virtual file is generated from a copy of the partition, an open partition
+// holds on to its table
+
+	Image *img = imageGet (INO_SLOT (ino));
+	PartitionTable *t = NULL;
+	Partition *p = NULL, part;
+	if (img)
+	{
+		if ((p = inodePartition (t = partitionsEnter (img), ino)))
+		{
+			part = *p;
+			partitionsHold (t);
+		}
+		partitionsExit (img);
+	}
+	if (p && INO_KIND (ino) != KIND_PARTITION)
+	{
+		FileHandle *fh;
+		partitionsDrop (img, t);
+		p = &part;
+		if ((i->flags & (O_WRONLY | O_RDWR)) != 0)
+		{
+			imageRelease (img);
+			fuse_reply_err (req, EACCES);
+			return;
+		}
+		if (INO_KIND (ino) == KIND_ALLOCMAP)
+			fh = allocmapOpen (img, p);
+		else if (INO_KIND (ino) == KIND_CHANGEMAP)
+			fh = changemapOpen (img, p);
+		else
+			fh = sha256mapOpen (img, p);
+		if (!fh)
+		{
+			imageRelease (img);
+			fuse_reply_err (req, (INO_KIND (ino) == KIND_SHA256MAP) ? EIO : ENOMEM);
+			return;
+		}
+		fh->image = img;
+		i->fh = (uintptr_t) fh;
+		if (fuse_reply_open (req, i) == -ENOENT)
+			closeHandle (fh);					// interrupted
+		return;
+	}
+	if (!p)
+	{
+		if (img)
+			imageRelease (img);
+		fuse_reply_err (req, ENOENT);
+		return;
+	}
+	if (readonly && ((i->flags & (O_WRONLY | O_RDWR)) != 0))
+	{
+		partitionsDrop (img, t);
+		imageRelease (img);
+		fuse_reply_err (req, EROFS);
+		return;
+	}
+
+	FileHandle *fh = calloc (1, sizeof (FileHandle));
+	if (!fh)
+	{
+		partitionsDrop (img, t);
+		imageRelease (img);
+		fuse_reply_err (req, ENOMEM);
+		return;
+	}
+	fh->image = img;
+	fh->partition = p;
+	fh->table = t;
+	pthread_mutex_init (&fh->mutex, NULL);
+	i->fh = (uintptr_t) fh;
+
+	if (fuse_reply_open (req, i) == -ENOENT)
+		closeHandle (fh);						// interrupted, there will be no release
+}
+
+/**
+ * Read from a file.  Without the block cache, reads from a backend that can map
+ * the disk onto the image file are answered by splicing from the file.
+ * @param req Fuse request
+ * @param ino Inode, for tracing
+ * @param len Length of the read
+ * @param offset Offset into the file
+ * @param i Fuse file info
+ */
+static void
+VD_read (fuse_req_t req, fuse_ino_t ino, size_t len, off_t offset,
+				 struct fuse_file_info *i)
+{
+	uint64_t start = traceBegin ();
+	FileHandle *fh = (FileHandle *) (uintptr_t) i->fh;
+	Image *img = fh->image;
+	Partition *p = fh->partition;
+	char *out = NULL;
+	int err = 0;
+
+	if (fh->data)
+	{
+		if ((uint64_t) offset >= fh->size)
+			len = 0;
+		else if (offset + len > fh->size)
+			len = fh->size - offset;
+		fuse_reply_buf (req, fh->data + offset, len);
+	}
+	else if ((uint64_t) offset >= p->size)
+		fuse_reply_buf (req, NULL, 0);
+	else
+	{
+		if ((uint64_t) (offset + len) > p->size)
+			len = p->size - offset;
+
+		if (!spliceZeros || replySpliced (req, img, offset + p->offset, len) < 0)
+		{
+			if (!(out = bufferGet (len)))
+				err = ENOMEM;
+			else if (RT_FAILURE (diskRead (img, offset + p->offset, out, len)))
+				err = EIO;
+			else
+			{
+				if (readaheadMax)
+					readaheadUpdate (fh, offset, len);
+				fuse_reply_buf (req, out, len);
+			}
+		}
+	}
+	if (err)
+		fuse_reply_err (req, err);
+	bufferPut (out);
+	traceEnd (TRACE_READ, img, fh->data ? TRACE_OTHER : p->no, ino, offset, len,
+						err, start);
+}
+
+/**
+ * List a directory
+ * @param req Fuse request
+ * @param ino Inode of the directory
+ * @param size Maximum size of the reply
+ * @param offset Where to continue the listing
+ * @param i UNUSED
+ */
+static void
+VD_readdir (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+						struct fuse_file_info *i UNUSED)
+{
+	DirBuf d = { NULL, 0, 0 };
+	char name[PNAMESIZE + 16];
+	Image *img;
+	int n, kind;
+
 	vbprintf ("readdir");
-	if (strcmp ("/", p) != 0)
-		return -ENOENT;
-	filler (buf, ".", NULL, 0);
-	filler (buf, "..", NULL, 0);
-	for (n = 0; n <= lastPartition; n++)
+	if (ino == INO_STATSDIR)
 	{
-		Partition *p = partitionTable + n;
-		if (p->no != UNALLOCATED)
-			filler (buf, p->name, NULL, 0);
+		dirAdd (req, &d, ".", INO_STATSDIR);
+		dirAdd (req, &d, "..", FUSE_ROOT_ID);
+		dirAdd (req, &d, STATSFILE, INO_STATSFILE);
+		if (daemonMode)
+			dirAdd (req, &d, CONTROLFILE, INO_CONTROLFILE);
 	}
-	return 0;
+	else if (ino == FUSE_ROOT_ID && daemonMode)
+	{
+		Image *list[IMAGES_MAX];
+
+		dirAdd (req, &d, ".", FUSE_ROOT_ID);
+		dirAdd (req, &d, "..", FUSE_ROOT_ID);
+		dirAdd (req, &d, STATSDIR, INO_STATSDIR);
+		n = imageList (list);
+		for (kind = 0; kind < n; kind++)
+		{
+			dirAdd (req, &d, list[kind]->name, INO_IMAGE (list[kind]->slot));
+			imageRelease (list[kind]);
+		}
+	}
+	else if ((img = directoryImage (ino)))
+	{
+		PartitionTable *t = partitionsEnter (img);
+
+		dirAdd (req, &d, ".", ino);
+		dirAdd (req, &d, "..", FUSE_ROOT_ID);
+		if (!daemonMode)
+			dirAdd (req, &d, STATSDIR, INO_STATSDIR);
+		for (n = 0; n <= t->last; n++)
+		{
+			Partition *p = t->partition + n;
+			if (p->no == UNALLOCATED)
+				continue;
+			for (kind = 0; kind < KIND_MAX; kind++)
+			{
+				snprintf (name, sizeof (name), "%s%s", p->name, partitionSuffix[kind]);
+				dirAdd (req, &d, name, INO_PARTITION_FILE (img->slot, n, kind));
+			}
+		}
+		partitionsExit (img);
+		imageRelease (img);
+	}
+	else
+	{
+		fuse_reply_err (req, ENOTDIR);
+		return;
+	}
+
+	if (d.failed)
+		fuse_reply_err (req, ENOMEM);
+	else if ((size_t) offset < d.size)
+		fuse_reply_buf (req, d.data + offset,
+										(d.size - offset < size) ? d.size - offset : size);
+	else
+		fuse_reply_buf (req, NULL, 0);
+	free (d.data);
+}
+
+/**
+ * Close a handle
+ * @param req Fuse request
+ * @param ino Inode, for -v output
+ * @param fi Fuse file info
+ */
+static void
+VD_release (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	vbprintf ("release: %lu", ino);
+	closeHandle ((FileHandle *) (uintptr_t) fi->fh);
+	fuse_reply_err (req, 0);
 }
 
 /**
  * Write to an open file
- * @param c Partition to write to
- * @param in write buffer
- * @param len size of write buffer
+ * @param req Fuse request
+ * @param ino Inode, for tracing
+ * @param bufv Data to write, normally a single memory buffer
  * @param offset Offset to write to
- * @param i unused
- * @return written length or -EIO
+ * @param i Fuse file info
  */
-static int
-VD_write (const char *c, const char *in, size_t len, off_t offset,
-					struct fuse_file_info *i UNUSED)
+static void
+VD_write_buf (fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+							off_t offset, struct fuse_file_info *i)
 {
-	vbprintf ("write: %s, offset=%lld, length=%d", c, offset, len);
-	int n = findPartition (c);
-	if (n < 0)
-		return -ENOENT;
-	if ((n == 0) ? partitionOpened : entireDiskOpened)
-		return -EIO;
-	Partition *p = &(partitionTable[n]);
-	if ((uint64_t) offset >= p->size)
-		return 0;
-	if ((uint64_t) (offset + len) > p->size)
+	uint64_t start = traceBegin ();
+	FileHandle *fh = (FileHandle *) (uintptr_t) i->fh;
+	Image *img = fh->image;
+	Partition *p = fh->partition;
+	struct fuse_buf *b = bufv->buf + bufv->idx;
+	size_t len = fuse_buf_size (bufv);
+	char *in = NULL, *copy = NULL;
+	int err = 0;
+
+	if (fh->control)
+		;														// commands are not positioned, offset is ignored
+	else if (fh->data)
+		err = EIO;
+	else if ((uint64_t) offset >= p->size)
+		len = 0;
+	else if ((uint64_t) (offset + len) > p->size)
 		len = p->size - offset;
 
-	pthread_mutex_lock (&disk_mutex);
-	int ret = DISKwrite (offset + p->offset, in, len);
-	pthread_mutex_unlock (&disk_mutex);
+// Use the request buffer in place; only data that is still in a pipe is copied
 
-	return RT_SUCCESS (ret) ? (signed) len : -EIO;
+	if (!err && len)
+	{
+		if (bufv->count - bufv->idx == 1 && !(b->flags & FUSE_BUF_IS_FD))
+			in = (char *) b->mem + bufv->off;
+		else
+		{
+			struct fuse_bufvec dst = FUSE_BUFVEC_INIT (len);
+			if (!(copy = dst.buf[0].mem = bufferGet (len)))
+				err = ENOMEM;
+			else if (fuse_buf_copy (&dst, bufv, 0) != (ssize_t) len)
+				err = EIO;
+			in = copy;
+		}
+	}
+
+	if (in && !err && fh->control)
+		err = controlWrite (in, len);
+	else if (in && !err && RT_FAILURE (diskWrite (img, offset + p->offset, in, len)))
+		err = EIO;
+	bufferPut (copy);
+
+	if (err)
+		fuse_reply_err (req, err);
+	else
+		fuse_reply_write (req, len);
+	traceEnd (TRACE_WRITE, img, fh->data ? TRACE_OTHER : p->no, ino, offset, len,
+						err, start);
 }